@@ -0,0 +1,57 @@
+#define _GNU_SOURCE
+#include "arena.h"
+#include "logging.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+// Explicit huge pages come in this size on x86-64 and most arm64 kernels
+#define HUGE_PAGE (2UL << 20)
+
+int BTArenaInit(BTcpArena *arena, size_t size, int huge) {
+    arena->used = 0;
+    arena->huge = 0;
+    if (huge) {
+        size_t rounded = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+        void *p = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            arena->base = p;
+            arena->size = rounded;
+            arena->huge = 1;
+            return 0;
+        }
+        Logf(LOG_INFO, "No huge pages for the packet pool (%s), using normal ones", strerror(errno));
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        arena->base = NULL;
+        arena->size = 0;
+        return -1;
+    }
+    if (huge)
+        madvise(p, size, MADV_HUGEPAGE);  // Only a hint, fine if it is ignored
+    arena->base = p;
+    arena->size = size;
+    return 0;
+}
+
+void BTArenaFree(BTcpArena *arena) {
+    if (arena->base != NULL)
+        munmap(arena->base, arena->size);
+    arena->base = NULL;
+    arena->size = arena->used = 0;
+}
+
+void *BTArenaAlloc(BTcpArena *arena, size_t size) {
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (arena->base == NULL) {
+        arena->used = start + size;
+        return NULL;
+    }
+    if (start + size > arena->size)
+        return NULL;
+    arena->used = start + size;
+    return arena->base + start;
+}
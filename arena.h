@@ -0,0 +1,30 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every carve is aligned to this, so no two arrays share a cache line
+#define ARENA_ALIGN 64
+
+// One mapping that fixed-size buffers are carved from once and never given
+// back individually. Pages are only backed by memory once touched, so
+// carving more than a caller ends up using costs address space only.
+typedef struct _BTcpArena {
+    uint8_t *base;  // NULL while only measuring
+    size_t size;
+    size_t used;
+    int huge;       // Backed by explicit huge pages
+} BTcpArena;
+
+// Map $size bytes, on huge pages if $huge and the system has any to spare.
+// Without them, transparent huge pages are asked for instead.
+int BTArenaInit(BTcpArena *arena, size_t size, int huge);
+void BTArenaFree(BTcpArena *arena);
+
+// $size bytes from the arena, NULL once it is exhausted. An arena that was
+// never initialized hands out nothing but still counts, which tells how
+// big to make a real one for the same carves.
+void *BTArenaAlloc(BTcpArena *arena, size_t size);
+
+#endif // __ARENA_H
@@ -0,0 +1,1133 @@
+#include "btcp.h"
+#include "crc32c.h"
+#include "emulator.h"
+#include "lz4.h"
+#include "ring.h"
+#include "server.h"
+#include "logging.h"
+#include "window.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+typedef struct _BenchResult {
+    double seconds;
+    size_t received;
+    BTcpStats send_stats;
+    BTcpStats recv_stats;
+    uint64_t dropped;  // By the emulated link
+    uint64_t duplicated, reordered;
+    double cpu;  // Seconds of CPU both ends took, the link's not counted
+} BenchResult;
+
+typedef struct _BenchPeer {
+    BTcpConnection *conn;
+    uint8_t *data;
+    size_t len;
+    size_t done;
+    size_t chunk;  // Bytes per BTRecv call, 0 for all at once
+    int linger;  // Keep answering until the sender closes
+    double cpu;  // Seconds of CPU the thread took
+} BenchPeer;
+
+static unsigned short bench_port = 16666;
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double ThreadCpu(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *RecvThread(void *arg) {
+    BenchPeer *peer = arg;
+    double cpu = ThreadCpu();
+    while (peer->done < peer->len) {
+        size_t want = peer->len - peer->done;
+        if (peer->chunk != 0 && want > peer->chunk)
+            want = peer->chunk;
+        size_t n = BTRecv(peer->conn, peer->data + peer->done, want);
+        if (n == 0)
+            break;
+        peer->done += n;
+    }
+    peer->cpu = ThreadCpu() - cpu;
+    if (peer->done < peer->len)
+        return NULL;
+    // The sender may not have heard our last ACK yet
+    uint8_t spare[4096];
+    while (peer->linger && BTRecv(peer->conn, spare, sizeof spare) != 0);
+    return NULL;
+}
+
+// The close message is not retransmitted, pass it by the emulator
+static void SendClose(unsigned short port) {
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+        .sin_port = htons(port)
+    };
+    sendto(s, NULL, 0, 0, (struct sockaddr *)&addr, sizeof addr);
+    close(s);
+}
+
+// Move the $len bytes at $src over loopback with both ends using $config,
+// through an emulated link if $link is given
+static int RunTransferOf(const BTcpConfig *config, const EmulatorConfig *link,
+                         const uint8_t *src, size_t len, BenchResult *result) {
+    uint8_t *dst = malloc(len);
+    if (dst == NULL)
+        return -1;
+
+    unsigned short port = bench_port;
+    bench_port += 2;
+    Emulator emu;
+    if (link != NULL && EmulatorStart(&emu, port, port + 1, link) != 0) {
+        free(dst);
+        return -1;
+    }
+    BTcpConnection *sender = BTOpen(inet_addr("127.0.0.1"), port, config),
+                   *receiver = BTOpen(inet_addr("127.0.0.1"), link ? port + 1 : port, config);
+
+    BenchPeer peer = {receiver, dst, len, 0, 0, 1};
+    pthread_t thread;
+    pthread_create(&thread, NULL, RecvThread, &peer);
+    usleep(10000);  // Give the receiver time to bind, off the clock
+    double start = Now();
+    double cpu = ThreadCpu();
+    BTSend(sender, src, len);
+    result->cpu = ThreadCpu() - cpu;
+    result->send_stats = sender->stats;
+    BTClose(sender);
+    if (link != NULL)
+        SendClose(port + 1);
+    pthread_join(thread, NULL);
+    result->seconds = Now() - start;
+    result->received = peer.done;
+    result->recv_stats = receiver->stats;
+    result->cpu += peer.cpu;
+    BTClose(receiver);
+    if (link != NULL) {
+        EmulatorStop(&emu);
+        result->dropped = emu.dropped;
+        result->duplicated = emu.duplicated;
+        result->reordered = emu.reordered;
+    }
+
+    int ok = peer.done == len && memcmp(src, dst, len) == 0;
+    free(dst);
+    return ok ? 0 : -1;
+}
+
+// Same with $len random bytes
+static int RunTransfer(const BTcpConfig *config, const EmulatorConfig *link,
+                       size_t len, BenchResult *result) {
+    uint8_t *src = malloc(len);
+    if (src == NULL)
+        return -1;
+    for (size_t i = 0; i < len; i++)
+        src[i] = rand();
+    int status = RunTransferOf(config, link, src, len, result);
+    free(src);
+    return status;
+}
+
+// Syscalls and copies per packet, one datagram at a time. Offload has its
+// own table below, as merged datagrams cost a copy of their own.
+static void BenchBatchIO(size_t len) {
+    printf("# batch_io: %zu bytes over loopback, no offload\n", len);
+    printf("%-10s %12s %12s %16s %16s %16s\n", "mode", "seconds", "packets/s",
+           "send sys/packet", "recv sys/packet", "recv copies/byte");
+    for (int batch = 0; batch <= 1; batch++) {
+        BTcpConnection conn;
+        BTDefaultConfig(&conn);
+        conn.config.batch_io = batch;
+        conn.config.offload = 0;
+        BenchResult r = {0};
+        int status = RunTransfer(&conn.config, NULL, len, &r);
+        uint64_t packets = r.send_stats.packets_sent + r.recv_stats.packets_sent;
+        printf("%-10s %12.3f %12.0f %16.3f %16.3f %16.3f%s\n",
+               batch ? "sendmmsg" : "send",
+               r.seconds,
+               packets / r.seconds,
+               (double)r.send_stats.syscalls / r.send_stats.packets_sent,
+               (double)r.recv_stats.syscalls / r.recv_stats.packets_received,
+               (double)r.recv_stats.bytes_copied / r.recv_stats.bytes_delivered,
+               status ? "  (FAILED)" : "");
+    }
+}
+
+// CPU per byte with the kernel cutting and merging datagrams, against one
+// syscall's worth of work per packet. Merged payloads cannot be scattered
+// into their slots, so GRO costs a copy per byte of its own.
+static void BenchOffload(size_t len) {
+    printf("# offload: %zu bytes over loopback\n", len);
+    printf("%-10s %12s %12s %12s %16s %16s %16s\n", "mode", "seconds", "MB/s", "cpu ns/byte",
+           "send sys/packet", "recv sys/packet", "recv copies/byte");
+    for (int offload = 0; offload <= 1; offload++) {
+        BTcpConnection conn;
+        BTDefaultConfig(&conn);
+        conn.config.offload = offload;
+        BenchResult r = {0};
+        int status = RunTransfer(&conn.config, NULL, len, &r);
+        printf("%-10s %12.3f %12.2f %12.3f %16.3f %16.3f %16.3f%s\n",
+               offload ? "gso/gro" : "none",
+               r.seconds, len / r.seconds / 1e6, r.cpu * 1e9 / len,
+               (double)r.send_stats.syscalls / r.send_stats.packets_sent,
+               (double)r.recv_stats.syscalls / r.recv_stats.packets_received,
+               (double)r.recv_stats.bytes_copied / r.recv_stats.bytes_delivered,
+               status ? "  (FAILED)" : "");
+    }
+}
+
+// Goodput against packet size, v1 first for reference
+static void BenchPayload(size_t len) {
+    static const size_t sizes[] = {256, 512, 1472, 4096, 9000, 16384, 32768, 65507};
+    printf("# payload: %zu bytes over loopback\n", len);
+    printf("%-10s %12s %12s %12s\n", "header", "packet", "seconds", "MB/s");
+    for (int k = -1; k < (int)(sizeof sizes / sizeof *sizes); k++) {
+        BTcpConnection conn;
+        BTDefaultConfig(&conn);
+        if (k < 0)
+            conn.config.header_version = 1;
+        else
+            conn.config.max_packet_size = sizes[k];
+        BenchResult r = {0};
+        int status = RunTransfer(&conn.config, NULL, len, &r);
+        printf("v%-9d %12zu %12.3f %12.2f%s\n",
+               conn.config.header_version,
+               k < 0 ? sizeof(BTcpHeader) + 64 : sizes[k],
+               r.seconds, len / r.seconds / 1e6,
+               status ? "  (FAILED)" : "");
+    }
+}
+
+// Goodput against random loss on a link with a bottleneck, per algorithm
+static void BenchCongestion(size_t len) {
+    static const double losses[] = {0, 0.001, 0.005, 0.01, 0.02, 0.05};
+    static const int algorithms[] = {CC_NONE, CC_RENO, CC_CUBIC};
+    const EmulatorConfig base = {
+        .delay = 2000,
+        .rate = 100000000 / 8,  // 100 Mbit/s
+        .queue = 10000
+    };
+    printf("# congestion: %zu bytes, %u us each way, %.0f Mbit/s, %u us queue, MB/s\n",
+           len, base.delay, base.rate * 8 / 1e6, base.queue);
+    printf("%-10s", "loss");
+    for (int a = 0; a < sizeof algorithms / sizeof *algorithms; a++)
+        printf(" %12s", BTCongestionName(algorithms[a]));
+    printf("\n");
+    for (int k = 0; k < sizeof losses / sizeof *losses; k++) {
+        EmulatorConfig link = base;
+        link.loss = losses[k];
+        printf("%-10.3f", losses[k]);
+        for (int a = 0; a < sizeof algorithms / sizeof *algorithms; a++) {
+            BTcpConnection conn;
+            BTDefaultConfig(&conn);
+            conn.config.recv_buffer_size = 512;  // Well past the path's capacity
+            conn.config.congestion = algorithms[a];
+            BenchResult r = {0};
+            int status = RunTransfer(&conn.config, &link, len, &r);
+            printf(" %12.2f%s", len / r.seconds / 1e6, status ? "(FAILED)" : "");
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+}
+
+// Whole windows sent back to back against a short queue: with and without
+// pacing, goodput and what the queue dropped and had to be sent again
+static void BenchPacing(size_t len) {
+    static const int algorithms[] = {CC_NONE, CC_RENO, CC_CUBIC};
+    static const int modes[] = {PACING_OFF, PACING_USER};
+    static const size_t windows[] = {64, 256, 1024};
+    const EmulatorConfig link = {
+        .delay = 2000,
+        .rate = 100000000 / 8,  // 100 Mbit/s
+        .queue = 2000  // About 17 full packets
+    };
+    printf("# pacing: %zu bytes, %u us each way, %.0f Mbit/s, %u us queue\n",
+           len, link.delay, link.rate * 8 / 1e6, link.queue);
+    printf("%-8s %8s %-6s %10s %10s %10s %10s\n",
+           "cc", "window", "pacing", "MB/s", "dropped", "resent", "paced");
+    for (int a = 0; a < sizeof algorithms / sizeof *algorithms; a++)
+        for (int w = 0; w < sizeof windows / sizeof *windows; w++)
+            for (int m = 0; m < sizeof modes / sizeof *modes; m++) {
+                BTcpConnection conn;
+                BTDefaultConfig(&conn);
+                conn.config.congestion = algorithms[a];
+                conn.config.recv_buffer_size = windows[w];
+                conn.config.pacing = modes[m];
+                BenchResult r = {0};
+                int status = RunTransfer(&conn.config, &link, len, &r);
+                printf("%-8s %8zu %-6s %10.2f %10lu %10lu %10lu%s\n",
+                       BTCongestionName(algorithms[a]), windows[w], BTPacingName(modes[m]),
+                       len / r.seconds / 1e6, r.dropped, r.send_stats.retransmissions,
+                       r.send_stats.paced, status ? "  (FAILED)" : "");
+                fflush(stdout);
+            }
+}
+
+// Goodput against random loss with and without parity, and how much of
+// the loss it saved retransmitting
+static void BenchFec(size_t len) {
+    static const double losses[] = {0, 0.001, 0.01, 0.02, 0.05, 0.1};
+    static const int ratios[][2] = {{0, 0}, {32, 1}, {16, 1}, {16, 2}, {8, 2}};
+    const EmulatorConfig base = {
+        .delay = 2000,
+        .rate = 100000000 / 8,  // 100 Mbit/s
+        .queue = 10000
+    };
+    printf("# fec: %zu bytes, %u us each way, %.0f Mbit/s, MB/s and retransmissions\n",
+           len, base.delay, base.rate * 8 / 1e6);
+    printf("%-10s", "loss");
+    for (int f = 0; f < sizeof ratios / sizeof *ratios; f++) {
+        char name[16];
+        if (ratios[f][0] == 0)
+            snprintf(name, sizeof name, "off");
+        else
+            snprintf(name, sizeof name, "%d:%d", ratios[f][0], ratios[f][1]);
+        printf(" %14s", name);
+    }
+    printf("\n");
+    for (int k = 0; k < sizeof losses / sizeof *losses; k++) {
+        EmulatorConfig link = base;
+        link.loss = losses[k];
+        printf("%-10.3f", losses[k]);
+        for (int f = 0; f < sizeof ratios / sizeof *ratios; f++) {
+            BTcpConnection conn;
+            BTDefaultConfig(&conn);
+            conn.config.recv_buffer_size = 512;
+            conn.config.fec_block = ratios[f][0];
+            conn.config.fec_parity = ratios[f][1];
+            BenchResult r = {0};
+            int status = RunTransfer(&conn.config, &link, len, &r);
+            printf(" %8.2f/%-5llu%s", len / r.seconds / 1e6,
+                   (unsigned long long)r.send_stats.retransmissions, status ? "(FAILED)" : "");
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+}
+
+// Cost of sealing and checking packets: CRC32C per byte on its own, then
+// what it takes off a loopback transfer
+static void BenchChecksum(size_t len) {
+    static const size_t sizes[] = {64, 1436, 16384, 1 << 20};
+    static const size_t total = 256 << 20;  // Bytes hashed per measurement
+    uint8_t *buf = malloc(sizes[3]);
+    for (size_t i = 0; i < sizes[3]; i++)
+        buf[i] = rand();
+
+    printf("# checksum: CRC32C on %s\n", BTCrc32cName());
+    printf("%-10s %12s %12s %12s %12s\n", "bytes", "ns/byte", "GB/s", "table ns/B", "table GB/s");
+    for (int k = 0; k < sizeof sizes / sizeof *sizes; k++) {
+        double seconds[2];
+        volatile uint32_t crc = 0;  // Keeps the loops from being dropped
+        for (int portable = 0; portable <= 1; portable++) {
+            double start = Now();
+            for (size_t done = 0; done < total; done += sizes[k])
+                crc = portable ? BTCrc32cPortable(crc, buf, sizes[k]) : BTCrc32c(crc, buf, sizes[k]);
+            seconds[portable] = Now() - start;
+        }
+        printf("%-10zu %12.3f %12.2f %12.3f %12.2f\n", sizes[k],
+               seconds[0] * 1e9 / total, total / seconds[0] / 1e9,
+               seconds[1] * 1e9 / total, total / seconds[1] / 1e9);
+    }
+    free(buf);
+
+    printf("%-10s %12s %12s\n", "transfer", "seconds", "MB/s");
+    for (int sealed = 0; sealed <= 1; sealed++) {
+        BTcpConnection conn;
+        BTDefaultConfig(&conn);
+        conn.config.checksum = sealed;
+        BenchResult r = {0};
+        int status = RunTransfer(&conn.config, NULL, len, &r);
+        printf("%-10s %12.3f %12.2f%s\n", sealed ? "crc32c" : "none", r.seconds,
+               len / r.seconds / 1e6, status ? "  (FAILED)" : "");
+    }
+}
+
+static int CompareDouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Completion time of small messages on a lossy link, by ACK policy
+static void BenchAck(void) {
+    static const struct {
+        const char *name;
+        int ack_every, sack;
+    } policies[] = {
+        {"timer", 0, 0},
+        {"every 16", 16, 0},
+        {"every 16+sack", 16, 1},
+    };
+    const size_t chunk = 16384, chunks = 200, len = chunk * chunks;
+    const EmulatorConfig link = {.loss = 0.02, .delay = 2000};
+    double times[chunks];
+    uint8_t *src = malloc(len), *dst = malloc(len);
+    for (size_t i = 0; i < len; i++)
+        src[i] = rand();
+
+    printf("# ack: %zu messages of %zu bytes, %u us each way, %.0f%% loss, ms per message\n",
+           chunks, chunk, link.delay, link.loss * 100);
+    printf("%-14s %10s %10s %10s %10s %10s\n", "policy", "p50", "p90", "p99", "max", "retrans");
+    for (int k = 0; k < sizeof policies / sizeof *policies; k++) {
+        unsigned short port = bench_port;
+        bench_port += 2;
+        Emulator emu;
+        if (EmulatorStart(&emu, port, port + 1, &link) != 0)
+            break;
+        BTcpConnection conn;
+        BTDefaultConfig(&conn);
+        conn.config.ack_every = policies[k].ack_every;
+        conn.config.sack = policies[k].sack;
+        BTcpConnection *sender = BTOpen(inet_addr("127.0.0.1"), port, &conn.config),
+                       *receiver = BTOpen(inet_addr("127.0.0.1"), port + 1, &conn.config);
+        BenchPeer peer = {receiver, dst, len, 0, chunk, 1};
+        pthread_t thread;
+        pthread_create(&thread, NULL, RecvThread, &peer);
+        usleep(10000);  // Give the receiver time to bind
+        for (size_t c = 0; c < chunks; c++) {
+            double start = Now();
+            BTSend(sender, src + c * chunk, chunk);
+            times[c] = (Now() - start) * 1e3;
+        }
+        uint64_t retransmissions = sender->stats.retransmissions;
+        BTClose(sender);
+        SendClose(port + 1);
+        pthread_join(thread, NULL);
+        BTClose(receiver);
+        EmulatorStop(&emu);
+
+        qsort(times, chunks, sizeof *times, CompareDouble);
+        printf("%-14s %10.2f %10.2f %10.2f %10.2f %10llu%s\n", policies[k].name,
+               times[chunks / 2], times[chunks * 9 / 10], times[chunks * 99 / 100],
+               times[chunks - 1], (unsigned long long)retransmissions,
+               peer.done != len || memcmp(src, dst, len) ? "  (FAILED)" : "");
+    }
+    free(src);
+    free(dst);
+}
+
+// How the RTT estimator settles over consecutive chunks on one connection,
+// and that the chunks after BTOpen allocate nothing
+static void BenchRtt(size_t len) {
+    const int chunks = 8;
+    uint8_t *src = malloc(len), *dst = malloc(len);
+    for (size_t i = 0; i < len; i++)
+        src[i] = rand();
+    unsigned short port = bench_port++;
+    BTcpConnection *sender = BTOpen(inet_addr("127.0.0.1"), port, NULL),
+                   *receiver = BTOpen(inet_addr("127.0.0.1"), port, NULL);
+
+    printf("# rtt: %d chunks of %zu bytes over loopback, microseconds\n", chunks, len);
+    printf("%-6s %10s %10s %10s %10s %10s %10s %10s %10s\n", "chunk", "seconds",
+           "srtt", "rttvar", "rto", "samples", "recv srtt", "timeouts", "allocs");
+    for (int c = 0; c < chunks; c++) {
+        BenchPeer peer = {receiver, dst, len, 0, 0, 0};
+        pthread_t thread;
+        pthread_create(&thread, NULL, RecvThread, &peer);
+        if (c == 0)
+            usleep(10000);  // Give the receiver time to bind
+        double start = Now();
+        BTSend(sender, src, len);
+        pthread_join(thread, NULL);
+        const BTcpRtt *rtt = &sender->state.rtt;
+        printf("%-6d %10.3f %10u %10u %10u %10llu %10u %10llu %10llu%s\n", c, Now() - start,
+               rtt->srtt, rtt->rttvar, rtt->rto,
+               (unsigned long long)sender->stats.rtt_samples,
+               receiver->state.rtt.srtt,
+               (unsigned long long)sender->stats.timeouts,
+               (unsigned long long)(sender->stats.allocations + receiver->stats.allocations),
+               peer.done != len || memcmp(src, dst, len) ? "  (FAILED)" : "");
+    }
+    BTClose(sender);
+    BTClose(receiver);
+    free(src);
+    free(dst);
+}
+
+// Many senders against a pooled server, every flow carries the same data
+typedef struct _BenchUploads {
+    const uint8_t *src;
+    size_t len;
+    unsigned short port;
+    uint64_t bad;  // Flows that came out wrong, updated atomically
+    const BTcpConfig *config;  // Of the senders
+    uint64_t syscalls, packets;  // Summed over the senders, atomically
+} BenchUploads;
+
+typedef struct _BenchUpload {
+    BenchUploads *uploads;
+    int ok;
+} BenchUpload;
+
+static void *UploadOpen(void *arg, const struct sockaddr_in *addr, uint8_t sport, uint8_t dport) {
+    BenchUpload *upload = malloc(sizeof *upload);
+    upload->uploads = arg;
+    upload->ok = 1;
+    return upload;
+}
+
+static int UploadData(void *ctx, const void *data, size_t len, uint64_t offset) {
+    BenchUpload *upload = ctx;
+    if (offset + len > upload->uploads->len ||
+        memcmp(upload->uploads->src + offset, data, len) != 0)
+        upload->ok = 0;
+    return 0;
+}
+
+static void UploadClose(void *ctx, uint64_t total, int complete) {
+    BenchUpload *upload = ctx;
+    if (!upload->ok || !complete || total != upload->uploads->len)
+        __atomic_add_fetch(&upload->uploads->bad, 1, __ATOMIC_RELAXED);
+    free(upload);
+}
+
+static void *SendThread(void *arg) {
+    BenchUploads *uploads = arg;
+    BTcpConnection *conn = BTOpen(inet_addr("127.0.0.1"), uploads->port, uploads->config);
+    BTSend(conn, uploads->src, uploads->len);
+    __atomic_add_fetch(&uploads->syscalls, conn->stats.syscalls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&uploads->packets, conn->stats.packets_sent, __ATOMIC_RELAXED);
+    BTClose(conn);
+    return NULL;
+}
+
+// Aggregate goodput against the # of server threads
+static void BenchServer(size_t len) {
+    static const BTcpServerOps ops = {UploadOpen, UploadData, UploadClose};
+    static const size_t threads[] = {1, 2, 4, 8};
+    const size_t flows = 32;
+    uint8_t *src = malloc(len);
+    pthread_t *senders = malloc(flows * sizeof *senders);
+    for (size_t i = 0; i < len; i++)
+        src[i] = rand();
+
+    printf("# server: %zu flows of %zu bytes over loopback, %ld CPUs\n",
+           flows, len, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-10s %12s %12s\n", "threads", "seconds", "MB/s");
+    for (int k = 0; k < sizeof threads / sizeof *threads; k++) {
+        BenchUploads uploads = {src, len, bench_port++, 0};
+        BTcpServerPool *pool = BTListenPool(inet_addr("127.0.0.1"), uploads.port, NULL,
+                                            &ops, &uploads, threads[k], NULL, 0);
+        if (pool == NULL)
+            continue;
+        double start = Now();
+        for (size_t i = 0; i < flows; i++)
+            pthread_create(&senders[i], NULL, SendThread, &uploads);
+        for (size_t i = 0; i < flows; i++)
+            pthread_join(senders[i], NULL);
+        BTServerPoolWait(pool, flows);
+        double seconds = Now() - start;
+        BTServerPoolClose(pool);
+        printf("%-10zu %12.3f %12.2f%s\n", threads[k], seconds, flows * len / seconds / 1e6,
+               uploads.bad ? "  (FAILED)" : "");
+    }
+    free(senders);
+    free(src);
+}
+
+// A disk that takes $delay microseconds per chunk
+#define ASYNC_THREADS 0  // A blocking sender thread per flow
+#define ASYNC_EPOLL 1    // All flows from one thread through BTSendAsync
+#define ASYNC_URING 2    // Same, with io_uring doing the batches
+
+static void AsyncDone(BTcpConnection *conn, size_t len, void *arg) {
+    size_t *pending = arg;
+    (*pending)--;
+}
+
+// Drive every flow from this thread, off a single epoll set
+static void AsyncSenders(BenchUploads *uploads, size_t flows) {
+    BTcpConnection **conns = malloc(flows * sizeof *conns);
+    struct epoll_event *events = malloc(flows * sizeof *events);
+    int epoll = epoll_create1(0);
+    size_t pending = 0;
+    for (size_t i = 0; i < flows; i++) {
+        conns[i] = BTOpen(inet_addr("127.0.0.1"), uploads->port, uploads->config);
+        if (conns[i] == NULL || BTSendAsync(conns[i], uploads->src, uploads->len, AsyncDone, &pending) != 0)
+            continue;
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conns[i]};
+        epoll_ctl(epoll, EPOLL_CTL_ADD, BTFileno(conns[i]), &event);
+        pending++;
+    }
+
+    while (pending > 0) {
+        uint64_t wait = UINT64_MAX;
+        for (size_t i = 0; i < flows; i++) {
+            uint64_t t = conns[i] != NULL ? BTNextTimeout(conns[i]) : UINT64_MAX;
+            wait = t < wait ? t : wait;
+        }
+        if (wait == 0) {
+            // Run the timers that are due before looking at traffic
+            for (size_t i = 0; i < flows; i++)
+                if (conns[i] != NULL && BTNextTimeout(conns[i]) == 0)
+                    BTPoll(conns[i]);
+            continue;
+        }
+        struct timespec ts = {wait / 1000000, wait % 1000000 * 1000};
+        int ready = epoll_pwait2(epoll, events, flows, wait == UINT64_MAX ? NULL : &ts, NULL);
+        for (int i = 0; i < ready; i++)
+            BTPoll(events[i].data.ptr);
+    }
+
+    // Not from the callbacks, BTPoll still holds the connection there
+    for (size_t i = 0; i < flows; i++) {
+        if (conns[i] == NULL)
+            continue;
+        uploads->syscalls += conns[i]->stats.syscalls;
+        uploads->packets += conns[i]->stats.packets_sent;
+        BTClose(conns[i]);
+    }
+    close(epoll);
+    free(events);
+    free(conns);
+}
+
+// One event loop against a thread per connection, same server behind
+static void BenchAsync(size_t len) {
+    static const BTcpServerOps ops = {UploadOpen, UploadData, UploadClose};
+    static const char *names[] = {"threads", "epoll", "io_uring"};
+    const size_t flows = 32;
+    uint8_t *src = malloc(len);
+    pthread_t *senders = malloc(flows * sizeof *senders);
+    for (size_t i = 0; i < len; i++)
+        src[i] = rand();
+
+    printf("# async: %zu flows of %zu bytes over loopback into 4 server threads\n", flows, len);
+    printf("%-10s %12s %12s %14s\n", "senders", "seconds", "MB/s", "syscalls/pkt");
+    for (int mode = ASYNC_THREADS; mode <= ASYNC_URING; mode++) {
+        BTcpConnection defaults;
+        BTDefaultConfig(&defaults);
+        defaults.config.io_uring = mode == ASYNC_URING;
+        BenchUploads uploads = {src, len, bench_port++, 0, &defaults.config};
+        BTcpServerPool *pool = BTListenPool(inet_addr("127.0.0.1"), uploads.port, NULL,
+                                            &ops, &uploads, 4, NULL, 0);
+        if (pool == NULL)
+            continue;
+        double start = Now();
+        if (mode == ASYNC_THREADS) {
+            for (size_t i = 0; i < flows; i++)
+                pthread_create(&senders[i], NULL, SendThread, &uploads);
+            for (size_t i = 0; i < flows; i++)
+                pthread_join(senders[i], NULL);
+        } else {
+            AsyncSenders(&uploads, flows);
+        }
+        BTServerPoolWait(pool, flows);
+        double seconds = Now() - start;
+        BTServerPoolClose(pool);
+        printf("%-10s %12.3f %12.2f %14.2f%s\n", names[mode], seconds, flows * len / seconds / 1e6,
+               uploads.packets ? (double)uploads.syscalls / uploads.packets : 0.0,
+               uploads.bad ? "  (FAILED)" : "");
+    }
+    free(senders);
+    free(src);
+}
+
+typedef struct _BenchDisk {
+    BTcpRing ring;
+    const uint8_t *src;
+    size_t len;
+    useconds_t delay;
+} BenchDisk;
+
+static void DiskRead(const BenchDisk *disk, uint8_t *dst, size_t offset, size_t n) {
+    usleep(disk->delay);
+    memcpy(dst, disk->src + offset, n);
+}
+
+static void *DiskThread(void *arg) {
+    BenchDisk *disk = arg;
+    size_t n;
+    for (size_t offset = 0;; offset += n) {
+        n = disk->len - offset < disk->ring.size ? disk->len - offset : disk->ring.size;
+        uint8_t *buf = BTRingAcquire(&disk->ring);
+        if (n > 0)
+            DiskRead(disk, buf, offset, n);
+        BTRingCommit(&disk->ring, n);
+        if (n == 0)
+            return NULL;
+    }
+}
+
+#define PIPE_NET 0        // Straight from memory, no disk
+#define PIPE_SERIAL 1     // Read a chunk, then send it
+#define PIPE_OVERLAP 2    // Disk thread reads ahead through a ring
+
+// Send $disk chunk by chunk as btsend does, returns the seconds it took
+static double PipeTransfer(BenchDisk *disk, int mode) {
+    const size_t chunk = disk->ring.size;
+    uint8_t *dst = malloc(disk->len), *buf = malloc(chunk);
+    unsigned short port = bench_port++;
+    BTcpConnection *sender = BTOpen(inet_addr("127.0.0.1"), port, NULL),
+                   *receiver = BTOpen(inet_addr("127.0.0.1"), port, NULL);
+    BenchPeer peer = {receiver, dst, disk->len, 0, chunk, 1};
+    pthread_t thread, reader;
+    pthread_create(&thread, NULL, RecvThread, &peer);
+    usleep(10000);  // Give the receiver time to bind
+
+    double start = Now();
+    if (mode == PIPE_OVERLAP) {
+        pthread_create(&reader, NULL, DiskThread, disk);
+        uint8_t *p;
+        size_t n;
+        while ((p = BTRingPeek(&disk->ring, &n)), n > 0) {
+            BTSend(sender, p, n);
+            BTRingRelease(&disk->ring);
+        }
+        BTRingRelease(&disk->ring);
+        pthread_join(reader, NULL);
+    } else {
+        for (size_t offset = 0; offset < disk->len; offset += chunk) {
+            size_t n = disk->len - offset < chunk ? disk->len - offset : chunk;
+            if (mode == PIPE_SERIAL) {
+                DiskRead(disk, buf, offset, n);
+                BTSend(sender, buf, n);
+            } else {
+                BTSend(sender, disk->src + offset, n);
+            }
+        }
+    }
+    double seconds = Now() - start;
+    BTClose(sender);
+    pthread_join(thread, NULL);
+    BTClose(receiver);
+    if (peer.done != disk->len || memcmp(disk->src, dst, disk->len) != 0)
+        seconds = -1;
+    free(dst);
+    free(buf);
+    return seconds;
+}
+
+// End-to-end time with a slow disk, serial against overlapped through a
+// ring. The disk is made about as fast as the network.
+static void BenchPipeline(size_t len) {
+    const size_t chunk = 1UL << 16, chunks = (len + chunk - 1) / chunk;
+    BenchDisk disk = {.src = malloc(len), .len = len};
+    for (size_t i = 0; i < len; i++)
+        ((uint8_t *)disk.src)[i] = rand();
+    BTRingInit(&disk.ring, 16, chunk);
+
+    double net = PipeTransfer(&disk, PIPE_NET);
+    disk.delay = net * 1e6 / chunks;
+    uint8_t *buf = malloc(chunk);
+    double start = Now();
+    for (size_t i = 0; i < chunks; i++)
+        DiskRead(&disk, buf, 0, chunk < len ? chunk : len);
+    double read = Now() - start;
+    free(buf);
+
+    printf("# pipeline: %zu bytes in %zu-byte chunks from a disk taking %u us per chunk\n",
+           len, chunk, (unsigned)disk.delay);
+    printf("%-10s %12s\n", "mode", "seconds");
+    printf("%-10s %12.3f\n", "disk", read);
+    printf("%-10s %12.3f\n", "network", net);
+    printf("%-10s %12.3f\n", "serial", PipeTransfer(&disk, PIPE_SERIAL));
+    printf("%-10s %12.3f\n", "ring", PipeTransfer(&disk, PIPE_OVERLAP));
+    BTRingFree(&disk.ring);
+    free((void *)disk.src);
+}
+
+// Log lines, about as compressible as the text btsend -z is meant for
+static void FillText(uint8_t *buf, size_t len) {
+    for (size_t i = 0, line = 0; i < len; line++) {
+        char text[128];
+        int n = snprintf(text, sizeof text, "2026-10-17T12:%02zu:%02zu host%02d GET /api/v1/items/%d 200 %d\n",
+                         line / 60 % 60, line % 60, rand() % 20, rand() % 100000, rand() % 10000);
+        if (n > len - i)
+            n = len - i;
+        memcpy(buf + i, text, n);
+        i += n;
+    }
+}
+
+// LZ4 on 64 KiB blocks the way btsend -z packs them, then goodput over a
+// link slower than the codec, with the codec overlapped as in btsend and
+// btrecv: the slowest of compressing, sending and decompressing
+static void BenchCompress(size_t len) {
+    static const char *const kinds[] = {"text", "random", "mixed"};
+    const size_t block = 1UL << 16, blocks = (len + block - 1) / block;
+    const EmulatorConfig link = {
+        .delay = 2000,
+        .rate = 100000000 / 8,  // 100 Mbit/s
+        .queue = 10000
+    };
+    uint8_t *src = malloc(len), *packed = malloc(len), *dst = malloc(len);
+    size_t *sizes = malloc(blocks * sizeof *sizes);
+    printf("# compress: %zu bytes in %zu-byte blocks, %u us each way, %.0f Mbit/s, MB/s\n",
+           len, block, link.delay, link.rate * 8 / 1e6);
+    printf("%-8s %8s %10s %10s %10s %10s\n", "data", "ratio", "pack", "unpack", "raw", "-z");
+    for (int k = 0; k < sizeof kinds / sizeof *kinds; k++) {
+        // Mixed has every other block random
+        for (size_t i = 0; i < len; i += block) {
+            size_t n = len - i < block ? len - i : block;
+            if (k == 1 || (k == 2 && (i / block) % 2 == 1))
+                for (size_t j = 0; j < n; j++)
+                    src[i + j] = rand();
+            else
+                FillText(src + i, n);
+        }
+
+        size_t total = 0;
+        double start = Now();
+        for (size_t b = 0; b < blocks; b++) {
+            const uint8_t *p = src + b * block;
+            size_t n = len - b * block < block ? len - b * block : block;
+            sizes[b] = BTLz4Compress(p, n, packed + total, n - n / 32 - 1);
+            if (sizes[b] == 0) {  // Goes as it is
+                memcpy(packed + total, p, n);
+                sizes[b] = n;
+            }
+            total += sizes[b];
+        }
+        double pack = Now() - start;
+        int status = 0;
+        start = Now();
+        for (size_t b = 0, at = 0; b < blocks; at += sizes[b], b++) {
+            size_t n = len - b * block < block ? len - b * block : block;
+            if (sizes[b] == n)
+                memcpy(dst + b * block, packed + at, n);
+            else if (BTLz4Decompress(packed + at, sizes[b], dst + b * block, n) != 0)
+                status = -1;
+        }
+        double unpack = Now() - start;
+        if (memcmp(src, dst, len) != 0)
+            status = -1;
+
+        BTcpConnection conn;
+        BTDefaultConfig(&conn);
+        BenchResult raw = {0}, z = {0};
+        status |= RunTransferOf(&conn.config, &link, src, len, &raw);
+        status |= RunTransferOf(&conn.config, &link, packed, total, &z);
+        double slowest = z.seconds;
+        if (pack > slowest)
+            slowest = pack;
+        if (unpack > slowest)
+            slowest = unpack;
+        printf("%-8s %8.3f %10.0f %10.0f %10.2f %10.2f%s\n", kinds[k], (double)total / len,
+               len / pack / 1e6, len / unpack / 1e6, len / raw.seconds / 1e6, len / slowest / 1e6,
+               status ? "  (FAILED)" : "");
+        fflush(stdout);
+    }
+    free(src);
+    free(packed);
+    free(dst);
+    free(sizes);
+}
+
+// Old-style window: slide everything down by $n packets
+static void RotateMemmove(uint8_t *slots, uint8_t *flags, size_t size, size_t slot_size, size_t n) {
+    memmove(slots, slots + n * slot_size, (size - n) * slot_size);
+    memmove(flags, flags + n, size - n);
+    memset(flags + size - n, 0, n);
+}
+
+// Cost of delivering packets a few at a time out of a full window
+static void BenchWindow(void) {
+    static const size_t sizes[] = {10, 64, 256, 1024, 4096};
+    const size_t slot_size = 64, step = 4, packets = 1UL << 22;
+    printf("# receive window: ns per delivered packet, %zu packets per advance\n", step);
+    printf("%-10s %12s %12s\n", "slots", "memmove", "ring");
+    for (int k = 0; k < sizeof sizes / sizeof *sizes; k++) {
+        size_t size = sizes[k];
+        uint8_t *slots = calloc(size, slot_size), *flags = calloc(size, 1);
+        double start = Now();
+        for (size_t done = 0; done < packets; done += step) {
+            RotateMemmove(slots, flags, size, slot_size, step);
+            for (size_t i = size - step; i < size; i++)
+                flags[i] = 1;
+        }
+        double old_ns = (Now() - start) * 1e9 / packets;
+
+        BTcpWindow win;
+        BTWindowInit(&win, size, slot_size);
+        for (size_t i = 0; i < size; i++)
+            BTWindowSet(&win, i, slot_size);
+        start = Now();
+        for (size_t done = 0; done < packets; done += step) {
+            if (!BTWindowTest(&win, step - 1))
+                abort();
+            BTWindowAdvance(&win, step);
+            for (size_t i = size - step; i < size; i++)
+                BTWindowSet(&win, i, slot_size);
+        }
+        double ring_ns = (Now() - start) * 1e9 / packets;
+        printf("%-10zu %12.1f %12.1f\n", size, old_ns, ring_ns);
+        BTWindowFree(&win);
+        free(slots);
+        free(flags);
+    }
+}
+
+#define LOG_CALLS 200000  // Per thread and measurement
+
+static void *LogCalls(void *arg) {
+    double *ns = arg;
+    double start = Now();
+    for (uint32_t i = 0; i < LOG_CALLS; i++)
+        Logf(LOG_INFO, "Sent packets seq=%u-%u to %s", i, i + 16, "127.0.0.1");
+    *ns = (Now() - start) * 1e9 / LOG_CALLS;
+    return NULL;
+}
+
+// What a log call costs the thread making it: filtered by level, written
+// on the spot, or handed to the logging thread
+static void BenchLogging(void) {
+    static const size_t threads[] = {1, 4};
+    FILE *null = fopen("/dev/null", "w");
+    if (null == NULL)
+        return;
+    SetLogStream(null);
+    printf("# logging: ns per Logf call with 3 arguments, to /dev/null\n");
+    printf("%-10s %12s %12s %12s %12s\n", "threads", "filtered", "sync", "async", "dropped");
+    for (int k = 0; k < sizeof threads / sizeof *threads; k++) {
+        double ns[3] = {0};
+        size_t dropped = 0;
+        for (int mode = 0; mode < 3; mode++) {
+            SetLogLevel(mode == 0 ? LOG_ERROR : LOG_INFO);
+            if (mode == 2 && StartLogThread() != 0)
+                break;
+            pthread_t tids[4];
+            double each[4];
+            for (size_t i = 0; i < threads[k]; i++)
+                pthread_create(&tids[i], NULL, LogCalls, &each[i]);
+            for (size_t i = 0; i < threads[k]; i++) {
+                pthread_join(tids[i], NULL);
+                ns[mode] += each[i] / threads[k];
+            }
+            if (mode == 2) {
+                dropped = LogDropped();
+                StopLogThread();
+            }
+        }
+        printf("%-10zu %12.1f %12.1f %12.1f %12zu\n", threads[k], ns[0], ns[1], ns[2], dropped);
+    }
+    SetLogLevel(LOG_ERROR);
+    SetLogStream(stderr);
+    fclose(null);
+}
+
+// Link conditions the suite runs through, the same random choices every
+// time so that runs can be held against each other
+typedef struct _BenchScenario {
+    const char *name;
+    int direct;  // Straight over loopback, no emulated link
+    EmulatorConfig link;
+} BenchScenario;
+
+static const BenchScenario scenarios[] = {
+    {"loopback", 1},
+    {"lan", 0, {.delay = 100, .rate = 1000000000 / 8, .queue = 2000}},
+    {"wan", 0, {.delay = 10000, .rate = 100000000 / 8, .queue = 20000}},
+    {"lossy", 0, {.loss = 0.01, .delay = 10000, .rate = 100000000 / 8, .queue = 20000}},
+    {"jitter", 0, {.delay = 10000, .jitter = 2000, .rate = 100000000 / 8, .queue = 20000}},
+    {"reorder", 0, {.delay = 10000, .rate = 100000000 / 8, .queue = 20000, .reorder = 0.02, .duplicate = 0.01}},
+};
+
+#define SUITE_SEED 0x5EED
+
+typedef struct _SuiteRow {
+    const char *scenario;
+    size_t bytes;
+    size_t window;
+    BenchResult r;
+    int ok;
+} SuiteRow;
+
+static void SuiteCsv(FILE *fp, const SuiteRow *rows, size_t count) {
+    fprintf(fp, "scenario,bytes,window,seconds,goodput_mbs,retrans_ratio,cpu_s_per_gb,"
+                "dropped,duplicated,reordered,ok\n");
+    for (size_t i = 0; i < count; i++) {
+        const SuiteRow *row = &rows[i];
+        fprintf(fp, "%s,%zu,%zu,%.6f,%.3f,%.6f,%.4f,%llu,%llu,%llu,%d\n",
+                row->scenario, row->bytes, row->window, row->r.seconds,
+                row->bytes / row->r.seconds / 1e6,
+                (double)row->r.send_stats.retransmissions / row->r.send_stats.packets_sent,
+                row->r.cpu / (row->bytes / 1e9),
+                (unsigned long long)row->r.dropped, (unsigned long long)row->r.duplicated,
+                (unsigned long long)row->r.reordered, row->ok);
+    }
+}
+
+static void SuiteJson(FILE *fp, const SuiteRow *rows, size_t count) {
+    fprintf(fp, "[\n");
+    for (size_t i = 0; i < count; i++) {
+        const SuiteRow *row = &rows[i];
+        fprintf(fp, "  {\"scenario\": \"%s\", \"bytes\": %zu, \"window\": %zu, "
+                    "\"seconds\": %.6f, \"goodput_mbs\": %.3f, \"retrans_ratio\": %.6f, "
+                    "\"cpu_s_per_gb\": %.4f, \"dropped\": %llu, \"duplicated\": %llu, "
+                    "\"reordered\": %llu, \"ok\": %s}%s\n",
+                row->scenario, row->bytes, row->window, row->r.seconds,
+                row->bytes / row->r.seconds / 1e6,
+                (double)row->r.send_stats.retransmissions / row->r.send_stats.packets_sent,
+                row->r.cpu / (row->bytes / 1e9),
+                (unsigned long long)row->r.dropped, (unsigned long long)row->r.duplicated,
+                (unsigned long long)row->r.reordered, row->ok ? "true" : "false",
+                i + 1 < count ? "," : "");
+    }
+    fprintf(fp, "]\n");
+}
+
+// Hold goodput against an earlier CSV from the suite. Returns the # of
+// rows that failed or fell more than $tolerance below their baseline.
+static int SuiteCompare(const char *filename, const SuiteRow *rows, size_t count, double tolerance) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        Logf(LOG_ERROR, "Cannot open %s: %s", filename, strerror(errno));
+        return -1;
+    }
+    int regressions = 0;
+    char line[512];
+    while (fgets(line, sizeof line, fp) != NULL) {
+        char name[64];
+        size_t bytes, window;
+        double seconds, goodput;
+        if (sscanf(line, "%63[^,],%zu,%zu,%lf,%lf", name, &bytes, &window, &seconds, &goodput) != 5)
+            continue;  // The header
+        for (size_t i = 0; i < count; i++) {
+            const SuiteRow *row = &rows[i];
+            if (strcmp(row->scenario, name) != 0 || row->bytes != bytes || row->window != window)
+                continue;
+            double now = row->bytes / row->r.seconds / 1e6;
+            int bad = !row->ok || now < goodput * (1 - tolerance);
+            fprintf(stderr, "%-10s %10zu %8zu %10.2f -> %10.2f MB/s %+7.1f%%%s\n", name, bytes,
+                    window, goodput, now, (now / goodput - 1) * 100, bad ? "  REGRESSION" : "");
+            regressions += bad;
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+// Every scenario across file sizes and window sizes, as CSV to $csv and
+// JSON to $json, either of them "-" for stdout
+static int BenchSuite(size_t len, const char *csv, const char *json,
+                      const char *baseline, double tolerance) {
+    const size_t sizes[] = {len, 4 * len};
+    static const size_t windows[] = {64, 512};
+    const size_t total = sizeof scenarios / sizeof *scenarios *
+                         (sizeof sizes / sizeof *sizes) * (sizeof windows / sizeof *windows);
+    SuiteRow *rows = calloc(total, sizeof *rows);
+    if (rows == NULL)
+        return 1;
+    size_t count = 0;
+    for (int s = 0; s < sizeof scenarios / sizeof *scenarios; s++)
+        for (int k = 0; k < sizeof sizes / sizeof *sizes; k++)
+            for (int w = 0; w < sizeof windows / sizeof *windows; w++) {
+                SuiteRow *row = &rows[count++];
+                BTcpConnection conn;
+                BTDefaultConfig(&conn);
+                conn.config.recv_buffer_size = windows[w];
+                EmulatorConfig link = scenarios[s].link;
+                link.seed = SUITE_SEED;
+                srand(SUITE_SEED);
+                row->scenario = scenarios[s].name;
+                row->bytes = sizes[k];
+                row->window = windows[w];
+                row->ok = RunTransfer(&conn.config, scenarios[s].direct ? NULL : &link,
+                                      sizes[k], &row->r) == 0;
+                fprintf(stderr, "%-10s %10zu %8zu %10.3f s %10.2f MB/s%s\n", row->scenario,
+                        row->bytes, row->window, row->r.seconds,
+                        row->bytes / row->r.seconds / 1e6, row->ok ? "" : "  (FAILED)");
+            }
+
+    int status = 0;
+    for (int k = 0; k < 2; k++) {
+        const char *filename = k == 0 ? csv : json;
+        if (filename == NULL)
+            continue;
+        FILE *fp = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+        if (fp == NULL) {
+            Logf(LOG_ERROR, "Cannot open %s: %s", filename, strerror(errno));
+            status = 1;
+            continue;
+        }
+        (k == 0 ? SuiteCsv : SuiteJson)(fp, rows, count);
+        if (fp != stdout)
+            fclose(fp);
+    }
+    for (size_t i = 0; i < count; i++)
+        if (!rows[i].ok)
+            status = 1;
+    if (baseline != NULL) {
+        int regressions = SuiteCompare(baseline, rows, count, tolerance);
+        if (regressions != 0) {
+            if (regressions > 0)
+                Logf(LOG_ERROR, "%d of %zu runs regressed past %.0f%%", regressions, count, tolerance * 100);
+            status = 1;
+        }
+    }
+    free(rows);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    size_t len = 1UL << 20;
+    int suite = 0;
+    const char *csv = NULL, *json = NULL, *baseline = NULL;
+    double tolerance = 0.25;
+    int c;
+    while ((c = getopt(argc, argv, "c:j:o:st:")) != -1)
+        switch (c) {
+            case 'c':
+                baseline = optarg;
+                break;
+            case 'j':
+                json = optarg;
+                break;
+            case 'o':
+                csv = optarg;
+                break;
+            case 's':
+                suite = 1;
+                break;
+            case 't':
+                tolerance = strtod(optarg, NULL);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s [-o csv] [-j json] [-c baseline.csv] [-t tolerance]] [bytes]\n", argv[0]);
+                return 1;
+        }
+    if (optind < argc)
+        len = strtoul(argv[optind], NULL, 0);
+    SetLogLevel(LOG_ERROR);
+    if (suite) {
+        if (csv == NULL && json == NULL)
+            csv = "-";
+        return BenchSuite(len, csv, json, baseline, tolerance);
+    }
+    BenchBatchIO(len);
+    BenchOffload(8 * len);
+    BenchPayload(len);
+    BenchRtt(len);
+    BenchChecksum(8 * len);
+    BenchCongestion(len);
+    BenchPacing(len);
+    BenchFec(len);
+    BenchAck();
+    BenchServer(len);
+    BenchAsync(len);
+    BenchPipeline(8 * len);
+    BenchCompress(8 * len);
+    BenchWindow();
+    BenchLogging();
+    return 0;
+}
@@ -1,271 +1,2005 @@
+#define _GNU_SOURCE
 #include "btcp.h"
+#include "protocol.h"
+#include "crc32c.h"
+#include "fec.h"
 #include "logging.h"
+#include "pacing.h"
+#include "uring.h"
+#include "window.h"
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
 
-size_t BTSend(BTcpConnection* conn, const void *data, size_t len) {
-    const size_t bufsize = conn->config.max_packet_size;
-    uint8_t *buf = malloc(bufsize);  // Buffer for a single packet
-    if (buf == NULL) {
-        Logf(LOG_ERROR, "Buffer allocation failed: %s", strerror(errno));
+uint64_t NowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void RttSample(BTcpConnection* conn, uint32_t sample) {
+    BTcpRtt *rtt = &conn->state.rtt;
+    if (rtt->srtt == 0) {
+        rtt->srtt = sample ? sample : 1;
+        rtt->rttvar = sample / 2;
+    } else {
+        uint32_t delta = rtt->srtt > sample ? rtt->srtt - sample : sample - rtt->srtt;
+        rtt->rttvar = (3 * (uint64_t)rtt->rttvar + delta) / 4;
+        rtt->srtt = (7 * (uint64_t)rtt->srtt + sample) / 8;
+        if (rtt->srtt == 0)
+            rtt->srtt = 1;
+    }
+    uint64_t rto = rtt->srtt + 4 * (uint64_t)rtt->rttvar;
+    rtt->rto = rto < MIN_RTO ? MIN_RTO : rto > MAX_RTO ? MAX_RTO : rto;
+    rtt->latest = sample;
+    conn->stats.rtt_samples++;
+    conn->stats.rtt_hist[StatsBucket(sample, STATS_RTT_BUCKETS)]++;
+}
+
+uint64_t AckDelay(const BTcpConnection* conn) {
+    uint64_t limit = conn->config.recv_timeout * 1000ULL,
+             delay = conn->state.rtt.srtt / 2;
+    if (conn->state.rtt.srtt == 0 || delay > limit)
+        return limit;
+    return delay < MIN_ACK_DELAY ? MIN_ACK_DELAY : delay;
+}
+
+#define WAIT_FOREVER UINT64_MAX
+
+// Wait up to $timeout microseconds for the socket to become readable
+static int WaitReadable(BTcpConnection* conn, uint64_t timeout) {
+    struct pollfd pfd = {conn->socket, POLLIN, 0};
+    struct timespec ts = {timeout / 1000000, timeout % 1000000 * 1000};
+    int result = ppoll(&pfd, 1, timeout == WAIT_FOREVER ? NULL : &ts, NULL);
+    conn->stats.syscalls++;
+    if (result > 0 && !(pfd.revents & POLLIN))
+        return -1;
+    return result;
+}
+
+size_t PayloadSize(int version, size_t max_packet_size) {
+    if (max_packet_size > MAX_DATAGRAM)
+        max_packet_size = MAX_DATAGRAM;
+    size_t size = max_packet_size - HeaderSize(version);
+    if (version < 2 && size > PAYLOAD_V1)
+        size = PAYLOAD_V1;
+    return size;
+}
+
+void EncodeHeader(int version, const BTcpHeaderInfo *info, void *buf) {
+    if (version >= 2) {
+        BTcpHeaderV2 hdr = {
+            .btcp_sport = info->sport,
+            .btcp_dport = info->dport,
+            .version = 2,
+            .flags = info->flags,
+            .btcp_seq = htonl(info->seq),
+            .btcp_ack = htonl(info->ack),
+            .data_off = htons(info->data_off),
+            .win_size = htons(info->win_size),
+            .data_len = htons(info->data_len),
+            .fec_tag = htons(info->fec_tag),
+            .ts_val = htonl(info->ts_val),
+            .ts_ecr = htonl(info->ts_ecr)
+        };
+        memcpy(buf, &hdr, sizeof hdr);
+    } else {
+        BTcpHeader hdr = {
+            .btcp_sport = info->sport,
+            .btcp_dport = info->dport,
+            .btcp_seq = info->seq,
+            .btcp_ack = info->ack,
+            .data_off = info->data_off,
+            .win_size = info->win_size,
+            .flags = info->flags,
+            .data_len = info->data_len
+        };
+        memcpy(buf, &hdr, sizeof hdr);
+    }
+}
+
+int DecodeHeader(int version, const void *buf, size_t len, uint32_t ref, BTcpHeaderInfo *info) {
+    if (len < HeaderSize(version))
+        return -1;
+    if (version >= 2) {
+        BTcpHeaderV2 hdr;
+        memcpy(&hdr, buf, sizeof hdr);
+        if (hdr.version != 2)
+            return -1;
+        info->sport = hdr.btcp_sport;
+        info->dport = hdr.btcp_dport;
+        info->seq = ntohl(hdr.btcp_seq);
+        info->ack = ntohl(hdr.btcp_ack);
+        info->data_off = ntohs(hdr.data_off);
+        info->win_size = ntohs(hdr.win_size);
+        info->data_len = ntohs(hdr.data_len);
+        info->fec_tag = ntohs(hdr.fec_tag);
+        info->flags = hdr.flags;
+        info->ts_val = ntohl(hdr.ts_val);
+        info->ts_ecr = ntohl(hdr.ts_ecr);
+    } else {
+        BTcpHeader hdr;
+        memcpy(&hdr, buf, sizeof hdr);
+        info->sport = hdr.btcp_sport;
+        info->dport = hdr.btcp_dport;
+        info->seq = ref + (uint8_t)(hdr.btcp_seq - (uint8_t)ref);
+        info->ack = ref + (uint8_t)(hdr.btcp_ack - (uint8_t)ref);
+        info->data_off = hdr.data_off;
+        info->win_size = hdr.win_size;
+        info->data_len = hdr.data_len;
+        info->fec_tag = 0;
+        info->flags = hdr.flags;
+        info->ts_val = 0;
+        info->ts_ecr = 0;
+    }
+    return 0;
+}
+
+void SealPacket(void *hdr, const void *payload, size_t len) {
+    uint8_t *p = hdr;
+    p[offsetof(BTcpHeaderV2, flags)] |= F_CRC;
+    memset(p + offsetof(BTcpHeaderV2, checksum), 0, sizeof(uint32_t));
+    uint32_t crc = htonl(BTCrc32c(BTCrc32c(0, p, sizeof(BTcpHeaderV2)), payload, len));
+    memcpy(p + offsetof(BTcpHeaderV2, checksum), &crc, sizeof crc);
+}
+
+int CheckPacket(int version, const void *hdr, const void *payload, size_t len) {
+    static const uint8_t zero[sizeof(uint32_t)];
+    const uint8_t *p = hdr;
+    if (version < 2 || !(p[offsetof(BTcpHeaderV2, flags)] & F_CRC))
         return 0;
+    uint32_t sent;
+    memcpy(&sent, p + offsetof(BTcpHeaderV2, checksum), sizeof sent);
+    uint32_t crc = BTCrc32c(0, p, offsetof(BTcpHeaderV2, checksum));
+    crc = BTCrc32c(BTCrc32c(crc, zero, sizeof zero), payload, len);
+    return crc == ntohl(sent) ? 0 : -1;
+}
+
+// Whether what we send gets sealed
+static inline int Sealing(const BTcpConnection* conn) {
+    return conn->config.checksum && conn->state.version >= 2;
+}
+
+// Max # of ACKs read per wakeup
+#define ACK_BATCH 64
+
+// Control message that carries a departure time (SO_TXTIME)
+#define TXTIME_SPACE CMSG_SPACE(sizeof(uint64_t))
+
+// Most packets and bytes the kernel cuts out of one send with UDP_SEGMENT:
+// UDP_MAX_SEGMENTS of older kernels, and a whole IPv4 datagram
+#define GSO_SEGMENTS 64
+#define GSO_BYTES 65507
+#define GSO_SPACE CMSG_SPACE(sizeof(uint16_t))
+
+// Coalesced datagrams read per call with UDP_GRO. Each one is a whole IP
+// datagram at most and usually GSO_SEGMENTS packets, as Linux merges no more.
+#define GRO_BATCH 8
+#define GRO_BUFSIZE 65536
+#define GRO_SPACE CMSG_SPACE(sizeof(int))
+
+// Working memory of BTSend, and where the transfer in progress stands.
+// Headers for a whole window; payloads are sent straight from the caller's
+// data. $sent_at keeps the last transmission time of every packet in
+// flight, indexed by sequence number modulo the window, 0 once it is known
+// lost. $resent marks those that cannot give an RTT sample any more (Karn's
+// algorithm) and $sacked those the receiver already holds. With SO_TXTIME,
+// every message has a control buffer in $ctrl for its departure time. With
+// UDP_SEGMENT, runs of staged messages go out as one in $gso_msgs, whose
+// iovecs are those of the run in place.
+typedef struct _BTcpSendBuffers {
+    size_t capacity;  // Largest window the buffers hold
+    size_t parity_capacity;  // Parity packets a window may bring along
+    BTcpHeaderV2 *hdrs;
+    uint8_t *acks;
+    struct mmsghdr *msgs, *ack_msgs;
+    struct iovec *iov, *ack_iov;
+    uint64_t *sent_at;
+    uint8_t *resent, *sacked;
+    uint8_t *parity;     // Payloads of the parity packets being staged
+    uint8_t *ctrl;
+    int txtime;          // The socket takes departure times
+    struct mmsghdr *gso_msgs;
+    uint8_t *gso_ctrl;
+    unsigned *gso_segs;  // Packets in each of $gso_msgs
+    int gso;             // The socket takes UDP_SEGMENT
+
+    int active;          // An asynchronous transfer is under way
+    BTcpCallback done;
+    void *arg;
+    int negotiating;     // Still waiting for the reply to our probe
+    uint64_t probe_sent;
+    int probe_retried;
+
+    const uint8_t *data;
+    size_t len;
+    size_t hdr_size, payload_size, max_win;
+    uint32_t first_seq,  // Carries data+0
+             total,
+             last_acked,
+             next_seq;   // Next packet never sent before
+    size_t win_size;
+    int window_known;
+    // Losses of packets sent before these were already answered by the
+    // congestion control, one reduction per window is enough
+    uint32_t loss_recover,
+             timeout_recover;
+    // Latest transmission known to have arrived, anything sent a while
+    // before it and still missing is lost (as in RACK)
+    uint64_t rack_time;
+    int sacking;         // The receiver sends SACK blocks
+    uint64_t expires;    // When the oldest packet in flight times out
+    size_t fec_block, fec_parity;  // 0 without FEC
+    size_t parity_used;  // Parity payloads staged so far in this round
+    int pacing;
+    BTcpPacer pacer;
+    uint64_t resume;     // When the pacer lets held packets go, 0 if none are
+} BTcpSendBuffers;
+
+// Working memory of BTRecv, and where the transfer in progress stands. One
+// scratch payload per datagram in a batch for packets that arrive out of
+// order, the window ring holds slots past the end of the caller's buffer.
+// With UDP_GRO, datagrams come in merged into $gro_buf instead and are cut
+// back into packets there, up to $max_segments of them per batch; their
+// payloads stay put until the second pass copies them to their slots.
+typedef struct _BTcpRecvBuffers {
+    size_t capacity, max_batch, max_payload,  // Largest of each the buffers hold
+           max_segments;  // Packets per batch, more than $max_batch with UDP_GRO
+    void *window;
+    uint8_t *scratch;
+    BTcpHeaderV2 *hdrs;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    uint8_t *deferred;
+    uint8_t **spare;     // Where each deferred payload waits out the batch
+    uint8_t *gro_buf, *gro_ctrl;
+    struct mmsghdr *gro_msgs;
+    struct iovec *gro_iov;
+    int gro;             // The socket hands over merged datagrams
+    BTcpFec fec;         // Parity groups in flight, size 0 without FEC
+
+    int active;          // An asynchronous transfer is under way
+    BTcpCallback done;
+    void *arg;
+
+    uint8_t *data;
+    size_t len;
+    int version;
+    size_t hdr_size, bufsize, payload_size,
+           batch;        // Datagrams per recv call
+    BTcpWindow win;
+    uint32_t last_acked,
+             win_start;
+    size_t recv_len,
+           guess;        // Window slot the next datagram will most likely fill
+    uint32_t last_ecr;   // Latest echo of our timestamps
+    int eager, sack;
+    size_t ack_every;
+    size_t unacked;      // Datagrams since the last ACK
+    uint64_t held_since;  // When the first of them came in
+    int idle;            // Nothing of this call has arrived yet
+    int ack_now;
+    uint64_t since;      // Latest datagram or ACK, for the timers
+} BTcpRecvBuffers;
+
+static size_t Smaller(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+// Carve both sets of buffers out of $arena, for whichever header version
+// needs more. On an arena that only measures, the pointers stay NULL.
+static int CarveBuffers(BTcpArena *arena, const BTcpConfig *config,
+                        BTcpSendBuffers *tx, BTcpRecvBuffers *rx) {
+    // A v1 payload is larger than a v2 one for tiny packets
+    const size_t payload_v1 = PayloadSize(1, config->max_packet_size),
+                 payload_v2 = PayloadSize(2, config->max_packet_size);
+    const size_t max_win = Smaller(config->send_buffer_size, MaxWindow(2));
+    const int offload = config->offload && config->batch_io;
+    // Every block a window touches may end in it and bring its parity
+    const size_t max_parity = config->fec_block > 0 ?
+                              (max_win / config->fec_block + 1) * config->fec_parity : 0,
+                 max_msgs = max_win + max_parity;
+    tx->capacity = max_win;
+    tx->parity_capacity = max_parity;
+    tx->hdrs = BTArenaAlloc(arena, max_msgs * sizeof *tx->hdrs);
+    tx->acks = BTArenaAlloc(arena, ACK_BATCH * ACK_SIZE);
+    tx->msgs = BTArenaAlloc(arena, max_msgs * sizeof *tx->msgs);
+    tx->ack_msgs = BTArenaAlloc(arena, ACK_BATCH * sizeof *tx->ack_msgs);
+    tx->iov = BTArenaAlloc(arena, 2 * max_msgs * sizeof *tx->iov);
+    tx->ack_iov = BTArenaAlloc(arena, ACK_BATCH * sizeof *tx->ack_iov);
+    tx->sent_at = BTArenaAlloc(arena, max_win * sizeof *tx->sent_at);
+    tx->resent = BTArenaAlloc(arena, max_win);
+    tx->sacked = BTArenaAlloc(arena, max_win);
+    tx->parity = BTArenaAlloc(arena, max_parity * payload_v2);
+    tx->ctrl = BTArenaAlloc(arena, config->pacing == PACING_TXTIME ? max_msgs * TXTIME_SPACE : 0);
+    const size_t max_runs = offload ? max_msgs : 0;
+    tx->gso_msgs = BTArenaAlloc(arena, max_runs * sizeof *tx->gso_msgs);
+    tx->gso_ctrl = BTArenaAlloc(arena, max_runs * GSO_SPACE);
+    tx->gso_segs = BTArenaAlloc(arena, max_runs * sizeof *tx->gso_segs);
+
+    rx->max_payload = payload_v1 > payload_v2 ? payload_v1 : payload_v2;
+    rx->capacity = Smaller(config->recv_buffer_size, MaxWindow(2));
+    rx->max_batch = config->batch_io ? rx->capacity : 1;
+    rx->max_segments = offload && rx->max_batch < GRO_BATCH * GSO_SEGMENTS ?
+                       GRO_BATCH * GSO_SEGMENTS : rx->max_batch;
+    rx->window = BTArenaAlloc(arena, BTWindowBytes(rx->capacity, rx->max_payload));
+    rx->scratch = BTArenaAlloc(arena, rx->max_batch * rx->max_payload);
+    rx->hdrs = BTArenaAlloc(arena, rx->max_segments * sizeof *rx->hdrs);
+    rx->msgs = BTArenaAlloc(arena, rx->max_segments * sizeof *rx->msgs);
+    rx->iov = BTArenaAlloc(arena, 2 * rx->max_segments * sizeof *rx->iov);
+    rx->spare = BTArenaAlloc(arena, rx->max_segments * sizeof *rx->spare);
+    const size_t gro_batch = offload ? GRO_BATCH : 0;
+    rx->gro_buf = BTArenaAlloc(arena, gro_batch * GRO_BUFSIZE);
+    rx->gro_ctrl = BTArenaAlloc(arena, gro_batch * GRO_SPACE);
+    rx->gro_msgs = BTArenaAlloc(arena, gro_batch * sizeof *rx->gro_msgs);
+    rx->gro_iov = BTArenaAlloc(arena, gro_batch * sizeof *rx->gro_iov);
+    // Parity only ever comes with v2, and one group per window slot is
+    // plenty as groups never overlap
+    void *fec = config->fec_block > 0 ?
+                BTArenaAlloc(arena, BTFecBytes(rx->capacity, payload_v2)) : NULL;
+    rx->fec.size = 0;
+    if (fec != NULL)
+        BTFecInitAt(&rx->fec, rx->capacity, payload_v2, fec);
+    rx->deferred = BTArenaAlloc(arena, rx->max_segments);
+    return rx->deferred != NULL ? 0 : -1;  // The last carve fails first
+}
+
+// Agree on a header version with the receiver. The probe is an empty v1
+// packet, so a v1 receiver just acknowledges it and we stay on v1.
+static void SendProbe(BTcpConnection* conn) {
+    BTcpHeaderInfo probe = {
+        .sport = conn->config.sport,
+        .dport = conn->config.dport,
+        .seq = conn->state.packet_sent,
+        .data_off = sizeof(BTcpHeader),
+        .flags = conn->config.header_version >= 2 ? F_V2 : 0
+    };
+    if (conn->config.header_version >= 2 && conn->config.compress)
+        probe.flags |= F_LZ4;
+    uint8_t buf[sizeof(BTcpHeader)];
+    EncodeHeader(1, &probe, buf);
+    send(conn->socket, buf, sizeof buf, 0);
+    conn->stats.syscalls++;
+    conn->stats.packets_sent++;
+    conn->stats.bytes_sent += sizeof buf;
+    // Only the reply to a probe sent once times the round trip
+    conn->tx->probe_retried = conn->tx->probe_sent != 0;
+    conn->tx->probe_sent = NowUs();
+}
+
+// Settle on what the reply to our probe offers, -1 if it is none
+static int ProbeReply(BTcpConnection* conn, const uint8_t *reply, ssize_t n) {
+    const uint32_t seq = conn->state.packet_sent;
+    BTcpHeaderInfo info, params;
+    if (n < 0 || DecodeHeader(1, reply, n, seq, &info) != 0 ||
+        !(info.flags & F_ACK) || info.ack != seq + 1)
+        return -1;
+    // The handshake seeds the round-trip time, as the SYN does in TCP. A
+    // reply to a resent probe could answer either (Karn's algorithm), the
+    // first ACK then does it, and INITIAL_RTO holds until then.
+    if (!conn->tx->probe_retried)
+        RttSample(conn, NowUs() - conn->tx->probe_sent);
+
+    conn->state.packet_sent = info.ack;
+    if ((info.flags & F_V2) && conn->config.header_version >= 2 &&
+        DecodeHeader(2, reply + sizeof(BTcpHeader), n - sizeof(BTcpHeader), 0, &params) == 0 &&
+        CheckPacket(2, reply + sizeof(BTcpHeader), NULL, 0) == 0) {
+        // The receiver tells its largest payload in data_len
+        conn->state.version = 2;
+        conn->state.ts_recent = params.ts_val;
+        conn->state.payload_size = PayloadSize(2, conn->config.max_packet_size);
+        if (params.data_len < conn->state.payload_size)
+            conn->state.payload_size = params.data_len;
+        conn->state.peer_window = params.win_size;
+        if ((params.flags & F_PARITY) && conn->config.fec_block > 0 && conn->config.fec_parity > 0)
+            conn->state.flags |= F_FEC;
+        if ((params.flags & F_LZ4) && conn->config.compress)
+            conn->state.flags |= F_COMPRESSED;
+    } else {
+        conn->state.version = 1;
+        conn->state.payload_size = PayloadSize(1, conn->config.max_packet_size);
     }
+    Logf(LOG_INFO, "Using header v%d, %zu bytes per packet", conn->state.version, conn->state.payload_size);
+    if (conn->state.flags & F_FEC)
+        Logf(LOG_INFO, "Adding %d parity packets to every %d", conn->config.fec_parity, conn->config.fec_block);
+    return 0;
+}
 
-    int socket = conn->socket;
-    const struct sockaddr_in *addr = (struct sockaddr_in *)&conn->addr;
+static int Negotiate(BTcpConnection* conn) {
+    uint8_t reply[sizeof(BTcpHeader) + sizeof(BTcpHeaderV2)];
+    conn->tx->probe_sent = 0;
+    while (1) {
+        SendProbe(conn);
+        int presult = WaitReadable(conn, Rto(conn));
+        if (presult == 0) {
+            Log(LOG_DEBUG, "Negotiation timeout, retrying");
+            continue;
+        } else if (presult < 0) {
+            Logf(LOG_ERROR, "Unknown error: %s", strerror(errno));
+            return -1;
+        }
+        ssize_t n = recv(conn->socket, reply, sizeof reply, 0);
+        conn->stats.syscalls++;
+        if (n >= 0) {
+            conn->stats.packets_received++;
+            conn->stats.bytes_received += n;
+        }
+        if (ProbeReply(conn, reply, n) == 0)
+            return 0;
+    }
+}
+
+// Point the socket at the receiver
+static int ConnectSocket(BTcpConnection* conn) {
+    const struct sockaddr_in *addr = &conn->addr;
     Logf(LOG_INFO, "Connecting to %s:%d", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
-    if (connect(socket, (struct sockaddr *)addr, sizeof *addr) == -1) {
+    if (connect(conn->socket, (struct sockaddr *)addr, sizeof *addr) == -1) {
         Logf(LOG_ERROR, "Failed to connect to server: %s", strerror(errno));
-        free(buf);
-        return 0UL;
+        return -1;
     }
+    conn->stats.syscalls++;
+    return 0;
+}
+
+// Sending side of the handshake: fix the peer and agree on the version,
+// packet size and window. Done once per connection.
+static int Connect(BTcpConnection* conn) {
+    if (ConnectSocket(conn) != 0)
+        return -1;
+    if (conn->state.version == 0 && Negotiate(conn) != 0)
+        return -1;
+    conn->state.flags |= F_CONNECTED;
+    return 0;
+}
+
+// Receiving side: take the version the sender offers in $flags if we can
+static void AcceptVersion(BTcpConnection* conn, uint8_t flags) {
+    if ((flags & F_V2) && conn->config.header_version >= 2)
+        conn->state.version = 2;
+    else
+        conn->state.version = 1;
+    if (conn->state.version >= 2 && conn->rx->fec.size > 0)
+        conn->state.flags |= F_FEC;
+    if (conn->state.version >= 2 && (flags & F_LZ4) && conn->config.compress)
+        conn->state.flags |= F_COMPRESSED;
+    conn->state.payload_size = PayloadSize(conn->state.version, conn->config.max_packet_size);
+    Logf(LOG_INFO, "Using header v%d, %zu bytes per packet", conn->state.version, conn->state.payload_size);
+}
 
-    uint8_t last_acked = conn->state.packet_sent,
-            recv_win_size = 1,  // # of available slots
-            win_size = 1,  // Assume 1-packet window at the beginning
-            packet_sent,
-            is_retransmission = 0;
-    size_t sent_len = 0;  // Size of data successfully sent (acked)
-
-    while (sent_len < len) {
-        packet_sent = 0;
-        uint8_t next_seq = last_acked;
-        win_size = recv_win_size;
-        while (packet_sent < win_size) {
-            size_t payload_size = bufsize - sizeof(BTcpHeader);
-            off_t offset = sent_len + packet_sent * payload_size;
-            if (offset >= len)
-                // Already sent all data in window
+// Submissions per io_uring_enter(2), the most sendmmsg(2) takes as well
+#define URING_ENTRIES 1024
+
+// Push $count messages out of the socket, returns how many went before
+// the first that failed. errno tells why that one did.
+static unsigned SendMessages(BTcpConnection* conn, struct mmsghdr *msgs, unsigned count) {
+    unsigned sent = count;
+    if (conn->uring != NULL) {
+        unsigned done = 0;
+        int error = 0;
+        while (done < count) {
+            unsigned n = 0;
+            while (done + n < count &&
+                   BTUringSendmsg(conn->uring, conn->socket, &msgs[done + n].msg_hdr, 0, done + n, 0) == 0)
+                n++;
+            int result = BTUringSubmit(conn->uring, n);
+            conn->stats.syscalls++;
+            if (result < 0) {
+                Logf(LOG_WARNING, "io_uring_enter failed: %s", strerror(errno));
+                return done < sent ? done : sent;
+            }
+            for (unsigned i = 0; i < n; i++) {
+                struct io_uring_cqe *cqe = BTUringWait(conn->uring);
+                if (cqe->res >= 0) {
+                    conn->stats.bytes_sent += cqe->res;
+                } else if (cqe->user_data < sent) {
+                    sent = cqe->user_data;
+                    error = -cqe->res;
+                }
+                BTUringSeen(conn->uring);
+            }
+            done += n;
+        }
+        errno = error;
+    } else if (conn->config.batch_io) {
+        unsigned done = 0;
+        while (done < count) {
+            int result = sendmmsg(conn->socket, msgs + done, count - done, 0);
+            conn->stats.syscalls++;
+            if (result <= 0) {
+                Logf(LOG_WARNING, "sendmmsg failed: %s", strerror(errno));
                 break;
-            else if (len - offset < payload_size)
-                payload_size = len - offset;
-            BTcpHeader hdr = {
-                .btcp_seq = next_seq,
-                .data_off = sizeof(BTcpHeader),
-                .win_size = win_size - packet_sent - 1, // # of remaining packets
-                .flags = 0,
-                .data_len = payload_size
-            };
-            if (is_retransmission)
-                hdr.flags |= F_RETRANSMISSION;
+            }
+            for (int i = 0; i < result; i++)
+                conn->stats.bytes_sent += msgs[done + i].msg_len;
+            done += result;
+        }
+        sent = done;
+    } else {
+        int error = 0;
+        for (unsigned i = 0; i < count; i++) {
+            ssize_t n = sendmsg(conn->socket, &msgs[i].msg_hdr, 0);
+            conn->stats.syscalls++;
+            if (n >= 0) {
+                conn->stats.bytes_sent += n;
+            } else if (i < sent) {
+                sent = i;
+                error = errno;
+            }
+        }
+        errno = error;
+    }
+    return sent;
+}
 
-            memcpy(buf, &hdr, sizeof hdr);
-            memcpy(buf + sizeof hdr, data + offset, payload_size);
-            send(socket, buf, sizeof hdr + payload_size, 0);
-            next_seq++;
-            packet_sent++;
+// Push $count packets staged in $msgs out of the socket. With UDP_SEGMENT,
+// each run of packets of one size, but for a shorter last one, goes as a
+// single message that the kernel cuts up again, which is where most of the
+// cost of a datagram is.
+static void FlushPackets(BTcpConnection* conn, struct mmsghdr *msgs, unsigned count) {
+    BTcpSendBuffers *tx = conn->tx;
+    if (!tx->gso || (tx->txtime && tx->pacing) || count < 2) {
+        conn->stats.packets_sent += SendMessages(conn, msgs, count);
+        return;
+    }
+
+    unsigned runs = 0;
+    for (unsigned i = 0; i < count; runs++) {
+        const struct iovec *iov = msgs[i].msg_hdr.msg_iov;
+        const size_t size = iov[0].iov_len + iov[1].iov_len;
+        size_t bytes = size;
+        unsigned n = 1;
+        // Staged messages have their iovecs side by side, so a run is a
+        // message with all of them
+        while (i + n < count && n < GSO_SEGMENTS && msgs[i + n].msg_hdr.msg_iov == iov + 2 * n) {
+            size_t next = iov[2 * n].iov_len + iov[2 * n + 1].iov_len;
+            if (next > size || bytes + next > GSO_BYTES)
+                break;
+            bytes += next;
+            n++;
+            if (next < size)
+                break;
         }
-        if (last_acked == next_seq - 1)
-            Logf(LOG_DEBUG, "Sent packet seq=%d, data offset=%d", last_acked, sent_len);
-        else
-            Logf(LOG_DEBUG, "Sent packets seq=%d-%d, data offset=%d", last_acked, next_seq - 1, sent_len);
-        is_retransmission = 0;
-
-        // Poll for response for 10 ms (configurable)
-        struct pollfd pfd = {socket, POLLIN, 0};
-        ssize_t presult = poll(&pfd, 1, conn->config.timeout);
-        if (presult == 1 && pfd.revents == POLLIN) {  // Something's ready
-            recv(socket, buf, bufsize, 0);
-            BTcpHeader hdr;
-            memcpy(&hdr, buf, sizeof hdr);
-            sent_len += (uint8_t)(hdr.btcp_ack - last_acked) * (bufsize - sizeof hdr);
-            Logf(LOG_DEBUG, "Response received, ack=%d, win=%d, last_ack=%d, sent=%d", hdr.btcp_ack, hdr.win_size, last_acked, sent_len);
-            last_acked = hdr.btcp_ack;
-            recv_win_size = hdr.win_size;
-            if (last_acked != next_seq) {
-                // Some packets are lost, retransmit them
-                Log(LOG_INFO, "Packet loss detected, retransmitting");
-                is_retransmission = 1;
+        struct msghdr *msg = &tx->gso_msgs[runs].msg_hdr;
+        *msg = msgs[i].msg_hdr;
+        msg->msg_iovlen = 2 * n;
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+        if (n > 1) {
+            uint16_t segment = size;
+            msg->msg_control = tx->gso_ctrl + runs * GSO_SPACE;
+            msg->msg_controllen = GSO_SPACE;
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof segment);
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof segment);
+        }
+        tx->gso_segs[runs] = n;
+        i += n;
+    }
+
+    unsigned sent = SendMessages(conn, tx->gso_msgs, runs), done = 0;
+    for (unsigned r = 0; r < sent; r++)
+        done += tx->gso_segs[r];
+    conn->stats.packets_sent += done;
+    // Devices without checksum offload, or a path MTU below the packet
+    // size, turn every run down. What is left goes one by one.
+    if (sent < runs && tx->gso_segs[sent] > 1 &&
+        (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+        Logf(LOG_INFO, "No UDP segmentation offload (%s), sending packets one by one", strerror(errno));
+        tx->gso = 0;
+        conn->stats.packets_sent += SendMessages(conn, msgs + done, count - done);
+    }
+}
+
+// Read whatever is pending into $msgs without waiting, -1 if nothing is
+static int ReadPackets(BTcpConnection* conn, struct mmsghdr *msgs, unsigned count) {
+    int result;
+    if (conn->uring != NULL) {
+        // Linked, so the first one that finds nothing cancels the rest and
+        // the datagrams that did arrive come first
+        unsigned n = count < conn->uring->entries ? count : conn->uring->entries;
+        for (unsigned i = 0; i < n; i++)
+            BTUringRecvmsg(conn->uring, conn->socket, &msgs[i].msg_hdr, MSG_DONTWAIT, i, i + 1 < n);
+        result = BTUringSubmit(conn->uring, n);
+        conn->stats.syscalls++;
+        if (result < 0)
+            return -1;
+        int error = 0;
+        result = 0;
+        for (unsigned i = 0; i < n; i++) {
+            struct io_uring_cqe *cqe = BTUringWait(conn->uring);
+            if (cqe->res >= 0) {
+                msgs[cqe->user_data].msg_len = cqe->res;
+                result++;
+            } else if (error == 0) {
+                error = -cqe->res;
+            }
+            BTUringSeen(conn->uring);
+        }
+        if (result == 0) {
+            errno = error;
+            return -1;
+        }
+    } else {
+        if (conn->config.batch_io) {
+            result = recvmmsg(conn->socket, msgs, count, MSG_DONTWAIT, NULL);
+        } else {
+            ssize_t n = recvmsg(conn->socket, &msgs[0].msg_hdr, MSG_DONTWAIT);
+            msgs[0].msg_len = n;
+            result = n == -1 ? -1 : 1;
+        }
+        conn->stats.syscalls++;
+    }
+    for (int i = 0; i < result; i++)
+        conn->stats.bytes_received += msgs[i].msg_len;
+    return result;
+}
+
+// Read a batch of merged datagrams without waiting and cut them back into
+// packets, as if ReadPackets had read each into rx->msgs on its own: the
+// header goes to rx->hdrs, the payload stays where it came in. Returns the
+// # of packets, -1 as ReadPackets.
+static int ReadSegments(BTcpConnection* conn) {
+    BTcpRecvBuffers *rx = conn->rx;
+    for (size_t i = 0; i < GRO_BATCH; i++)
+        rx->gro_msgs[i].msg_hdr.msg_controllen = GRO_SPACE;
+    int count = ReadPackets(conn, rx->gro_msgs, GRO_BATCH);
+    if (count == -1)
+        return -1;
+    int k = 0;
+    for (int i = 0; i < count; i++) {
+        struct msghdr *msg = &rx->gro_msgs[i].msg_hdr;
+        uint8_t *p = msg->msg_iov->iov_base;
+        size_t left = rx->gro_msgs[i].msg_len, segment = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int size;
+                memcpy(&size, CMSG_DATA(cmsg), sizeof size);
+                segment = size;
+            }
+        }
+        if (segment == 0)
+            segment = left;  // A datagram of its own, maybe an empty one
+        do {
+            if (k == rx->max_segments) {
+                Log(LOG_WARNING, "Too many packets in one batch, dropped the rest");
+                return k;
+            }
+            size_t packet_len = Smaller(left, segment);
+            memcpy(&rx->hdrs[k], p, Smaller(packet_len, sizeof rx->hdrs[k]));
+            rx->msgs[k].msg_len = packet_len;
+            rx->iov[2 * k + 1].iov_base = rx->spare[k] = p + rx->hdr_size;
+            k++;
+            p += packet_len;
+            left -= packet_len;
+        } while (left > 0);
+    }
+    return k;
+}
+
+// Describe packet $seq of a message starting with $first_seq, the payload
+// is referenced in place
+static void StagePacket(BTcpConnection* conn, BTcpHeaderV2 *hdr_buf, struct iovec *payload,
+                        const void *data, size_t len, uint32_t first_seq, uint32_t seq, uint8_t flags) {
+    const BTcpSendBuffers *tx = conn->tx;
+    const size_t payload_size = conn->state.payload_size,
+                 offset = (size_t)(seq - first_seq) * payload_size,
+                 this_size = len - offset < payload_size ? len - offset : payload_size;
+    BTcpHeaderInfo hdr = {
+        .sport = conn->config.sport,
+        .dport = conn->config.dport,
+        .seq = seq,
+        .data_off = HeaderSize(conn->state.version),
+        .flags = flags,
+        .data_len = this_size,
+        .fec_tag = tx->fec_parity ? BTFecTag(tx->fec_parity, (seq - first_seq) % tx->fec_block) : 0,
+        .ts_val = Timestamp(),
+        .ts_ecr = conn->state.ts_recent
+    };
+    EncodeHeader(conn->state.version, &hdr, hdr_buf);
+    if (Sealing(conn))
+        SealPacket(hdr_buf, (const uint8_t *)data + offset, this_size);
+    payload->iov_base = (void *)data + offset;
+    payload->iov_len = this_size;
+    conn->stats.bytes_copied += this_size;
+}
+
+// Bytes per second to pace at: the window over the round trip, with some
+// headroom. 0, for no pacing, until the round trip is known.
+static double PacingRate(const BTcpConnection* conn) {
+    const BTcpSendBuffers *tx = conn->tx;
+    if (conn->config.pacing_rate != 0)
+        return conn->config.pacing_rate;
+    if (conn->state.rtt.srtt == 0)
+        return 0;
+    double gain = conn->cc.cwnd < conn->cc.ssthresh ? PACING_GAIN_SS : PACING_GAIN_CA;
+    size_t window = Smaller(BTCongestionWindow(&conn->cc), tx->win_size);
+    return gain * window * (tx->hdr_size + tx->payload_size) * 1e6 / conn->state.rtt.srtt;
+}
+
+// Count the packet staged at $at against the pacing rate. With SO_TXTIME
+// it also gets its departure time, and the kernel holds it until then.
+static void PacePacket(BTcpConnection* conn, unsigned at, uint64_t now) {
+    BTcpSendBuffers *tx = conn->tx;
+    if (!tx->pacing)
+        return;
+    uint64_t due = BTPacerSpend(&tx->pacer, now * 1000,
+                                tx->iov[2 * at].iov_len + tx->iov[2 * at + 1].iov_len);
+    if (tx->txtime)
+        memcpy(CMSG_DATA(CMSG_FIRSTHDR(&tx->msgs[at].msg_hdr)), &due, sizeof due);
+}
+
+// Stage the parity packets of the block [$from, $to) right behind the
+// $at packets staged so far, returns how many there are. Blocks start
+// every fec_block packets from the start of the message.
+static unsigned StageParity(BTcpConnection* conn, uint32_t from, uint32_t to, unsigned at, uint64_t now) {
+    BTcpSendBuffers *tx = conn->tx;
+    const size_t payload_size = tx->payload_size,
+                 stride = tx->fec_parity,
+                 groups = Smaller(stride, to - from);
+    for (size_t j = 0; j < groups; j++, at++) {
+        // The first member is the longest, only the message's last packet
+        // can be short
+        uint8_t *parity = tx->parity + tx->parity_used++ * payload_size;
+        size_t offset = (size_t)(from + j - tx->first_seq) * payload_size,
+               parity_len = Smaller(tx->len - offset, payload_size);
+        uint16_t count = 0, len_xor = 0;
+        for (uint32_t seq = from + j; seq - from < to - from; seq += stride, count++) {
+            offset = (size_t)(seq - tx->first_seq) * payload_size;
+            size_t this_size = Smaller(tx->len - offset, payload_size);
+            if (count == 0)
+                memcpy(parity, tx->data + offset, this_size);
+            else
+                BTFecXor(parity, tx->data + offset, this_size);
+            len_xor ^= this_size;
+        }
+        BTcpHeaderInfo hdr = {
+            .sport = conn->config.sport,
+            .dport = conn->config.dport,
+            .seq = from + j,
+            .ack = (uint32_t)count << 16 | len_xor,
+            .data_off = tx->hdr_size,
+            .win_size = stride,
+            .flags = F_PARITY,
+            .data_len = parity_len,
+            .ts_val = Timestamp(),
+            .ts_ecr = conn->state.ts_recent
+        };
+        EncodeHeader(conn->state.version, &hdr, &tx->hdrs[at]);
+        if (Sealing(conn))
+            SealPacket(&tx->hdrs[at], parity, parity_len);
+        tx->iov[2 * at + 1].iov_base = parity;
+        tx->iov[2 * at + 1].iov_len = parity_len;
+        PacePacket(conn, at, now);
+        conn->stats.parity_sent++;
+    }
+    return groups;
+}
+
+// Karn's algorithm: an ACK times its last packet only if nothing it covers
+// was sent twice, or it might be answering a retransmission that filled a hole
+static int Unambiguous(const uint8_t *resent, size_t max_win, uint32_t from, uint32_t to) {
+    for (uint32_t seq = from; seq != to; seq++)
+        if (resent[seq % max_win])
+            return 0;
+    return 1;
+}
+
+// Get ready to send $len bytes from $data, once the version is settled
+static int SendStart(BTcpConnection* conn, const void *data, size_t len) {
+    BTcpSendBuffers *tx = conn->tx;
+    const int version = conn->state.version;
+    const size_t max_win = Smaller(conn->config.send_buffer_size, MaxWindow(version));
+    if (max_win > tx->capacity) {
+        Logf(LOG_ERROR, "Window of %zu packets is past the %zu the connection was opened for", max_win, tx->capacity);
+        return -1;
+    }
+    tx->fec_block = tx->fec_parity = 0;
+    if (conn->state.flags & F_FEC) {
+        tx->fec_block = conn->config.fec_block;
+        tx->fec_parity = conn->config.fec_parity;
+        if ((max_win / tx->fec_block + 1) * tx->fec_parity > tx->parity_capacity) {
+            Logf(LOG_ERROR, "%zu parity packets per %zu are more than the connection was opened for",
+                 tx->fec_parity, tx->fec_block);
+            return -1;
+        }
+    }
+    tx->data = data;
+    tx->len = len;
+    tx->hdr_size = HeaderSize(version);
+    tx->payload_size = conn->state.payload_size;
+    tx->max_win = max_win;
+    // A v1 receiver only ACKs once we go quiet, spreading the window out
+    // would just hold its ACK back
+    tx->pacing = conn->config.pacing != PACING_OFF && version >= 2;
+    for (size_t i = 0; i < max_win + tx->parity_capacity; i++) {
+        tx->iov[2 * i].iov_base = &tx->hdrs[i];
+        tx->iov[2 * i].iov_len = tx->hdr_size;
+        tx->msgs[i].msg_hdr.msg_iov = &tx->iov[2 * i];
+        tx->msgs[i].msg_hdr.msg_iovlen = 2;
+        if (tx->txtime && tx->pacing) {
+            struct msghdr *msg = &tx->msgs[i].msg_hdr;
+            msg->msg_control = tx->ctrl + i * TXTIME_SPACE;
+            msg->msg_controllen = TXTIME_SPACE;
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_TXTIME;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        }
+    }
+    for (size_t i = 0; i < ACK_BATCH; i++) {
+        tx->ack_iov[i].iov_base = tx->acks + i * ACK_SIZE;
+        tx->ack_iov[i].iov_len = ACK_SIZE;
+        tx->ack_msgs[i].msg_hdr.msg_iov = &tx->ack_iov[i];
+        tx->ack_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    tx->first_seq = tx->last_acked = tx->next_seq = conn->state.packet_sent;
+    tx->total = (len + tx->payload_size - 1) / tx->payload_size;
+    // A v1 receiver replies to the first packet of every call with its
+    // window, v2 ones told theirs in the handshake and kept it since
+    tx->win_size = 1;  // Assume 1-packet window until the first ACK
+    tx->window_known = 0;
+    if (version >= 2 && conn->state.peer_window != 0) {
+        tx->win_size = Smaller(conn->state.peer_window, max_win);
+        tx->window_known = 1;
+    }
+    tx->loss_recover = tx->timeout_recover = tx->last_acked;
+    tx->rack_time = 0;
+    tx->sacking = 0;
+    tx->expires = 0;
+    tx->resume = 0;
+    return 0;
+}
+
+static inline int SendComplete(const BTcpSendBuffers *tx) {
+    return tx->last_acked - tx->first_seq >= tx->total;
+}
+
+// Resend whatever timed out and fill the window with new packets, as far
+// as the pacer lets them go, then note when the oldest packet in flight
+// expires and when the pacer lets the rest go
+static void SendPump(BTcpConnection* conn, uint64_t now) {
+    BTcpSendBuffers *tx = conn->tx;
+    const size_t max_win = tx->max_win;
+    uint64_t *sent_at = tx->sent_at;
+    uint8_t *resent = tx->resent,
+            *sacked = tx->sacked;
+    uint64_t earliest = UINT64_MAX,
+             rto = Rto(conn);
+    unsigned packet_sent = 0, timed_out = 0;
+    int held = 0;
+    if (tx->pacing)
+        tx->pacer.rate = PacingRate(conn);
+
+    // Resend only what has been waiting longer than the timeout
+    for (uint32_t seq = tx->last_acked; seq != tx->next_seq; seq++) {
+        if (sacked[seq % max_win])
+            continue;
+        if (now - sent_at[seq % max_win] >= rto) {
+            if (!BTPacerReady(&tx->pacer, now * 1000)) {
+                held = 1;  // Still expired when the pacer lets it go
                 continue;
             }
-        } else if (presult == 0) {
-            // Timeout
-            Log(LOG_DEBUG, "ACK timeout, retransmitting");
-            is_retransmission = 1;
+            if (sent_at[seq % max_win] != 0)  // Not given up on by a hint
+                timed_out++;
+            StagePacket(conn, &tx->hdrs[packet_sent], &tx->iov[2 * packet_sent + 1], tx->data, tx->len,
+                        tx->first_seq, seq, F_RETRANSMISSION);
+            PacePacket(conn, packet_sent, now);
+            sent_at[seq % max_win] = now;
+            resent[seq % max_win] = 1;
+            packet_sent++;
+            conn->stats.retransmissions++;
+        }
+        if (sent_at[seq % max_win] < earliest)
+            earliest = sent_at[seq % max_win];
+    }
+    if (packet_sent > 0)
+        Logf(LOG_DEBUG, "Retransmitting %u expired packets from seq=%u", packet_sent, tx->last_acked);
+    if (timed_out > 0 && (int32_t)(tx->last_acked - tx->timeout_recover) >= 0) {
+        BTCongestionTimeout(&conn->cc, now);
+        conn->stats.loss_events++;
+        tx->timeout_recover = tx->loss_recover = tx->next_seq;
+    }
+
+    // Keep the pipe full with new data, as far as both the receiver and the
+    // network allow. With FEC, each block is followed by its parity as
+    // soon as its last packet is out.
+    size_t cwnd = BTCongestionWindow(&conn->cc),
+           allowed = cwnd < tx->win_size ? cwnd : tx->win_size;
+    uint32_t new_from = tx->next_seq;
+    tx->parity_used = 0;
+    while (tx->next_seq - tx->last_acked < allowed && tx->next_seq - tx->first_seq < tx->total) {
+        if (!BTPacerReady(&tx->pacer, now * 1000)) {
+            held = 1;
+            break;
+        }
+        StagePacket(conn, &tx->hdrs[packet_sent], &tx->iov[2 * packet_sent + 1], tx->data, tx->len,
+                    tx->first_seq, tx->next_seq, 0);
+        PacePacket(conn, packet_sent, now);
+        sent_at[tx->next_seq % max_win] = now;
+        resent[tx->next_seq % max_win] = 0;
+        sacked[tx->next_seq % max_win] = 0;
+        packet_sent++;
+        if (now < earliest)
+            earliest = now;
+        tx->next_seq++;
+        uint32_t index = tx->next_seq - tx->first_seq;
+        if (tx->fec_parity && (index % tx->fec_block == 0 || index == tx->total)) {
+            uint32_t block = index - (index - 1) % tx->fec_block - 1;
+            packet_sent += StageParity(conn, tx->first_seq + block, tx->next_seq, packet_sent, now);
+        }
+    }
+    if (tx->next_seq - new_from == 1)
+        Logf(LOG_DEBUG, "Sent packet seq=%u", new_from);
+    else if (tx->next_seq != new_from)
+        Logf(LOG_DEBUG, "Sent packets seq=%u-%u", new_from, tx->next_seq - 1);
+    FlushPackets(conn, tx->msgs, packet_sent);
+    conn->stats.window_hist[StatsBucket(tx->next_seq - tx->last_acked, STATS_WINDOW_BUCKETS)]++;
+    tx->expires = (earliest == UINT64_MAX ? now : earliest) + rto;
+    tx->resume = 0;
+    if (held) {
+        // Rounded up, waking a little early would find nothing to do
+        tx->resume = (BTPacerResume(&tx->pacer, now * 1000) + 999) / 1000;
+        conn->stats.paced++;
+    }
+}
+
+// When BTSend has to act again without an ACK to wake it
+static inline uint64_t SendWake(const BTcpSendBuffers *tx) {
+    return tx->resume != 0 && tx->resume < tx->expires ? tx->resume : tx->expires;
+}
+
+// Drain every pending ACK, the newest cumulative one wins. Returns the #
+// of ACKs read, -1 if there were none.
+static int SendAcks(BTcpConnection* conn) {
+    BTcpSendBuffers *tx = conn->tx;
+    const int version = conn->state.version;
+    const size_t max_win = tx->max_win;
+    uint64_t *sent_at = tx->sent_at;
+    uint8_t *resent = tx->resent,
+            *sacked = tx->sacked;
+    uint32_t last_acked = tx->last_acked;
+    const uint32_t next_seq = tx->next_seq;
+
+    int count = ReadPackets(conn, tx->ack_msgs, ACK_BATCH);
+    if (count < 0)
+        return -1;
+    conn->stats.packets_received += count;
+    uint32_t sample = 0, acked_before = last_acked;
+    int lost = 0;
+    for (int k = 0; k < count; k++) {
+        BTcpHeaderInfo hdr;
+        const uint8_t *ack = tx->acks + k * ACK_SIZE;
+        if (DecodeHeader(version, ack, tx->ack_msgs[k].msg_len, last_acked, &hdr) != 0 ||
+            !(hdr.flags & F_ACK) ||
+            ((hdr.flags & F_SACK) && hdr.data_off + hdr.data_len > tx->ack_msgs[k].msg_len)) {
+            Log(LOG_WARNING, "Discarded invalid response");
             continue;
-        } else {
-            Logf(LOG_ERROR, "Unknown error: %s", strerror(errno));
+        } else if (CheckPacket(version, ack, ack + tx->hdr_size, tx->ack_msgs[k].msg_len - tx->hdr_size) != 0) {
+            Log(LOG_WARNING, "Discarded response with a bad checksum");
+            conn->stats.corrupted++;
+            continue;
+        } else if (hdr.ack - last_acked > next_seq - last_acked) {
+            Logf(LOG_DEBUG, "Discarded stale response, ack=%u", hdr.ack);
+            continue;
+        }
+        Logf(LOG_DEBUG, "Response received, ack=%u, win=%u, last_ack=%u", hdr.ack, hdr.win_size, last_acked);
+        conn->state.ts_recent = hdr.ts_val;
+        if (hdr.ts_ecr != 0)
+            sample = Timestamp() - hdr.ts_ecr;
+        else if (hdr.ack != last_acked && Unambiguous(resent, max_win, last_acked, hdr.ack))
+            sample = NowUs() - sent_at[(hdr.ack - 1) % max_win];
+        if (hdr.ack != last_acked && sent_at[(hdr.ack - 1) % max_win] > tx->rack_time)
+            tx->rack_time = sent_at[(hdr.ack - 1) % max_win];
+        last_acked = hdr.ack;
+        if (hdr.flags & F_SACK) {
+            tx->sacking = 1;
+            // Exactly what arrived past the holes, and the real window
+            const BTcpSackBlock *blocks = (const BTcpSackBlock *)(ack + hdr.data_off);
+            for (size_t b = 0; b < hdr.data_len / sizeof *blocks; b++) {
+                uint32_t start = ntohl(blocks[b].start), end = ntohl(blocks[b].end);
+                if (start - last_acked >= next_seq - last_acked ||
+                    end - start > next_seq - start)
+                    continue;  // Not in flight
+                for (uint32_t seq = start; seq != end; seq++) {
+                    sacked[seq % max_win] = 1;
+                    if (sent_at[seq % max_win] > tx->rack_time)
+                        tx->rack_time = sent_at[seq % max_win];
+                }
+            }
+            tx->win_size = hdr.win_size < max_win ? hdr.win_size : max_win;
+            if (tx->win_size == 0)
+                tx->win_size = 1;
+            tx->window_known = 1;
+        } else if (!tx->window_known && hdr.ack != tx->first_seq) {
+            // The reply to the first packet tells the full window,
+            // later ones count the packets missing in front of it
+            tx->win_size = hdr.win_size < max_win ? hdr.win_size : max_win;
+            if (tx->win_size == 0)
+                tx->win_size = 1;
+            tx->window_known = 1;
+        } else if (tx->window_known) {
+            // The receiver only speaks up after it went quiet, so the
+            // missing ones that left long enough ago are lost: let them
+            // expire right away instead of waiting for the timeout
+            uint64_t quiet = conn->state.rtt.srtt ? conn->state.rtt.srtt : AckDelay(conn),
+                     now = NowUs();
+            for (uint32_t seq = last_acked; seq != next_seq && seq - last_acked < hdr.win_size; seq++)
+                if (sent_at[seq % max_win] != 0 && now - sent_at[seq % max_win] >= quiet) {
+                    sent_at[seq % max_win] = 0;
+                    lost = 1;
+                }
         }
     }
+    tx->last_acked = last_acked;
+    if (sample != 0)
+        RttSample(conn, sample);
+    if (tx->sacking) {
+        // Allow a quarter of a round trip for reordering
+        uint64_t reorder = conn->state.rtt.srtt / 4;
+        for (uint32_t seq = last_acked; seq != next_seq; seq++)
+            if (!sacked[seq % max_win] && sent_at[seq % max_win] != 0 &&
+                sent_at[seq % max_win] + reorder < tx->rack_time) {
+                sent_at[seq % max_win] = 0;
+                lost = 1;
+            }
+    }
+    if (last_acked != acked_before) {
+        BTCongestionAck(&conn->cc, last_acked - acked_before, NowUs(), conn->state.rtt.srtt);
+        // No use growing past what the receiver lets us send
+        size_t limit = tx->window_known ? tx->win_size : max_win;
+        if (conn->cc.cwnd > limit)
+            conn->cc.cwnd = limit;
+    }
+    if (lost && (int32_t)(last_acked - tx->loss_recover) >= 0) {
+        BTCongestionLoss(&conn->cc, NowUs());
+        conn->stats.loss_events++;
+        tx->loss_recover = next_seq;
+    }
+    return count;
+}
 
-    free(buf);
-    conn->state.packet_sent = last_acked;
+// Wrap up the transfer, returns the bytes acknowledged
+static size_t SendFinish(BTcpConnection* conn) {
+    BTcpSendBuffers *tx = conn->tx;
+    size_t sent_len = (size_t)(tx->last_acked - tx->first_seq) * tx->payload_size;
+    if (sent_len > tx->len)
+        sent_len = tx->len;  // The last packet was a short one
+    conn->stats.bytes_delivered += sent_len;
+    if (conn->config.digest)
+        conn->state.digest = BTCrc32c(conn->state.digest, tx->data, sent_len);
+    conn->state.packet_sent = tx->last_acked;
+    if (conn->state.version >= 2 && tx->window_known)
+        conn->state.peer_window = tx->win_size;
+    tx->active = 0;
     return sent_len;
 }
 
+size_t BTSend(BTcpConnection* conn, const void *data, size_t len) {
+    if (conn->tx->active || conn->rx->active) {
+        Log(LOG_ERROR, "Another transfer is under way");
+        return 0UL;
+    }
+    if (!(conn->state.flags & F_CONNECTED) && Connect(conn) != 0)
+        return 0UL;
+    if (SendStart(conn, data, len) != 0)
+        return 0UL;
+
+    const BTcpSendBuffers *tx = conn->tx;
+    while (!SendComplete(tx)) {
+        uint64_t now = NowUs();
+        SendPump(conn, now);
+
+        // Wait for ACKs until the oldest packet in flight expires, or the
+        // pacer lets more go
+        uint64_t wake = SendWake(tx);
+        int presult = WaitReadable(conn, wake > now ? wake - now : 0);
+        if (presult == 0) {
+            if (NowUs() >= tx->expires) {
+                Log(LOG_DEBUG, "ACK timeout");
+                conn->stats.timeouts++;
+            }
+            continue;
+        } else if (presult < 0) {
+            Logf(LOG_ERROR, "Unknown error: %s", strerror(errno));
+            continue;
+        }
+        SendAcks(conn);
+    }
+    return SendFinish(conn);
+}
+
+// Where the payload for window slot $i goes: straight into the caller's
+// buffer while a full packet still fits there, otherwise the window ring
+static inline uint8_t *SlotPayload(uint8_t *data, size_t recv_len, size_t len,
+                                   const BTcpWindow *win, size_t i) {
+    if (recv_len + (i + 1) * win->slot_size <= len)
+        return data + recv_len + i * win->slot_size;
+    return BTWindowSlot(win, i);
+}
+
+void SendNegotiationReply(BTcpConnection* conn, uint32_t ack, size_t win_size) {
+    uint8_t buf[sizeof(BTcpHeader) + sizeof(BTcpHeaderV2)];
+    BTcpHeaderInfo response = {
+        .sport = conn->config.sport,
+        .dport = conn->config.dport,
+        .ack = ack,
+        .data_off = sizeof(BTcpHeader),
+        .win_size = win_size < MAX_WINDOW_V1 ? win_size : MAX_WINDOW_V1,
+        .flags = F_ACK
+    };
+    size_t len = sizeof(BTcpHeader);
+    if (conn->state.version >= 2) {
+        response.flags |= F_V2;
+        BTcpHeaderInfo params = {
+            .sport = conn->config.sport,
+            .dport = conn->config.dport,
+            .ack = ack,
+            .data_off = sizeof(BTcpHeaderV2),
+            .win_size = win_size,
+            .data_len = conn->state.payload_size,
+            .flags = conn->state.flags & F_FEC ? F_ACK | F_V2 | F_PARITY : F_ACK | F_V2,
+            .ts_val = Timestamp(),
+            .ts_ecr = conn->state.ts_recent
+        };
+        if (conn->state.flags & F_COMPRESSED)
+            params.flags |= F_LZ4;
+        EncodeHeader(2, &params, buf + len);
+        if (conn->config.checksum)
+            SealPacket(buf + len, NULL, 0);
+        len += sizeof(BTcpHeaderV2);
+    }
+    EncodeHeader(1, &response, buf);
+    sendto(conn->socket, buf, len, 0, (struct sockaddr *)&conn->addr, sizeof conn->addr);
+    conn->stats.syscalls++;
+    conn->stats.packets_sent++;
+    conn->stats.bytes_sent += len;
+}
+
+void SendAck(BTcpConnection* conn, const BTcpWindow *win, uint32_t win_start, int sack) {
+    const size_t hdr_size = HeaderSize(conn->state.version),
+                 bufsize = win->size,
+                 missing = BTWindowFirstSet(win);  // Packets missing in front of the rest
+    uint8_t buf[ACK_SIZE];
+    BTcpSackBlock *blocks = (BTcpSackBlock *)(buf + hdr_size);
+    size_t nblocks = 0;
+    for (size_t j = missing; sack && j < bufsize && nblocks < MAX_SACK_BLOCKS; nblocks++) {
+        size_t run = BTWindowRun(win, j, 1);
+        blocks[nblocks].start = htonl(win_start + j);
+        blocks[nblocks].end = htonl(win_start + j + run);
+        j += run;
+        j += BTWindowRun(win, j, 0);
+    }
+    BTcpHeaderInfo response = {
+        .sport = conn->config.sport,
+        .dport = conn->config.dport,
+        .ack = win_start,
+        .data_off = hdr_size,
+        .win_size = sack ? bufsize : missing,
+        .data_len = nblocks * sizeof *blocks,
+        .flags = sack ? F_ACK | F_SACK : F_ACK,
+        .ts_val = Timestamp(),
+        .ts_ecr = conn->state.ts_recent
+    };
+    if (missing == bufsize)
+        Logf(LOG_DEBUG, "Received packets up to %u, sequence is complete", win_start - 1);
+    else
+        Logf(LOG_DEBUG, "Received packets up to %u, %zu missing", win_start - 1, missing);
+    EncodeHeader(conn->state.version, &response, buf);
+    if (Sealing(conn))
+        SealPacket(buf, buf + hdr_size, response.data_len);
+    sendto(conn->socket, buf, hdr_size + response.data_len, 0,
+           (struct sockaddr *)&conn->addr, sizeof conn->addr);
+    conn->stats.syscalls++;
+    conn->stats.packets_sent++;
+    conn->stats.bytes_sent += hdr_size + response.data_len;
+    conn->stats.window_hist[StatsBucket(BTWindowCount(win), STATS_WINDOW_BUCKETS)]++;
+    // Echo each timestamp once, a repeat would measure our idle time
+    conn->state.ts_recent = 0;
+}
+
+// Get ready to receive $len bytes into $data, continuing right behind the
+// last packet handed over
+static int RecvStart(BTcpConnection* conn, void *data, size_t len) {
+    BTcpRecvBuffers *rx = conn->rx;
+    const int version = conn->state.version;
+    rx->data = data;
+    rx->len = len;
+    rx->version = version;
+    rx->hdr_size = HeaderSize(version);
+    rx->bufsize = Smaller(conn->config.recv_buffer_size, MaxWindow(version));
+    rx->batch = conn->config.batch_io ? rx->bufsize : 1;
+    rx->payload_size = conn->state.payload_size;
+    if (rx->bufsize > rx->capacity || rx->batch > rx->max_batch || rx->payload_size > rx->max_payload) {
+        Logf(LOG_ERROR, "Window of %zu packets is past the %zu the connection was opened for", rx->bufsize, rx->capacity);
+        return -1;
+    }
+    BTWindowInitAt(&rx->win, rx->bufsize, rx->payload_size, rx->window);
+    for (size_t i = 0; i < rx->batch; i++) {
+        rx->iov[2 * i].iov_base = &rx->hdrs[i];
+        rx->iov[2 * i].iov_len = rx->hdr_size;
+        rx->iov[2 * i + 1].iov_len = rx->payload_size;
+        rx->msgs[i].msg_hdr.msg_iov = &rx->iov[2 * i];
+        rx->msgs[i].msg_hdr.msg_iovlen = 2;
+        rx->spare[i] = rx->scratch + i * rx->payload_size;
+    }
+    // Only streams read past their first packet in batches, so a v1 sender
+    // never gets its datagrams merged. Once on, the socket keeps it.
+    if (rx->gro == 0 && version >= 2 && conn->config.offload && conn->config.batch_io) {
+        int on = 1;
+        rx->gro = setsockopt(conn->socket, SOL_UDP, UDP_GRO, &on, sizeof on) == 0 ? 1 : -1;
+        conn->stats.syscalls++;
+        if (rx->gro < 0)
+            Logf(LOG_INFO, "No UDP_GRO (%s), reading packets one by one", strerror(errno));
+        for (size_t i = 0; rx->gro > 0 && i < GRO_BATCH; i++) {
+            rx->gro_iov[i].iov_base = rx->gro_buf + i * GRO_BUFSIZE;
+            rx->gro_iov[i].iov_len = GRO_BUFSIZE;
+            rx->gro_msgs[i].msg_hdr.msg_iov = &rx->gro_iov[i];
+            rx->gro_msgs[i].msg_hdr.msg_iovlen = 1;
+            rx->gro_msgs[i].msg_hdr.msg_control = rx->gro_ctrl + i * GRO_SPACE;
+        }
+    }
+    rx->win_start = rx->last_acked = conn->state.packet_sent;
+    rx->recv_len = 0;
+    rx->guess = 0;
+    rx->last_ecr = 0;
+
+    // ACK once $ack_every packets are in, or at once when one arrives out
+    // of order, otherwise when the sender goes quiet. v1 senders expect a
+    // single ACK per window, so they only get the latter. Once everything
+    // that came in has been ACKed, repeat the ACK only when the sender has
+    // had time to notice it went missing.
+    rx->eager = version >= 2;
+    rx->ack_every = rx->eager && conn->config.ack_every > 0 ? conn->config.ack_every : SIZE_MAX;
+    rx->sack = rx->eager && conn->config.sack;
+    rx->unacked = 0;
+    rx->idle = 1;
+    rx->ack_now = 0;
+    rx->since = NowUs();
+    return 0;
+}
+
+// How long to wait for more before ACKing anyway. An idle stream has
+// nothing to repeat, so it waits for as long as the sender takes.
+static uint64_t RecvTimeout(const BTcpConnection* conn) {
+    const BTcpRecvBuffers *rx = conn->rx;
+    return rx->unacked ? AckDelay(conn) : rx->idle ? WAIT_FOREVER : Rto(conn);
+}
+
+// Put the one packet of $group that went missing into its window slot, once
+// the rest of the group and its parity are in
+static void RecvRebuild(BTcpConnection* conn, BTcpFecGroup *group) {
+    BTcpRecvBuffers *rx = conn->rx;
+    BTcpWindow *win = &rx->win;
+    int rebuilt_len = BTFecReady(group);
+    if (rebuilt_len < 0)
+        return;
+    for (uint32_t i = 0, seq = group->key; i < group->count; i++, seq += group->stride) {
+        uint32_t win_ind = seq - rx->win_start;
+        if ((int32_t)win_ind < 0 || (win_ind < win->size && BTWindowTest(win, win_ind)))
+            continue;  // Handed over or here
+        if (win_ind >= win->size || rebuilt_len > rx->payload_size)
+            break;
+        memcpy(SlotPayload(rx->data, rx->recv_len, rx->len, win, win_ind),
+               BTFecAcc(&rx->fec, group), rebuilt_len);
+        BTWindowSet(win, win_ind, rebuilt_len);
+        Logf(LOG_DEBUG, "Rebuilt packet seq=%u from parity", seq);
+        conn->stats.bytes_copied += rebuilt_len;
+        conn->stats.recovered++;
+        rx->ack_now = rx->eager;  // Fills a hole
+        break;
+    }
+    BTFecDone(group);
+}
+
+// Take in a parity packet that made it through validation of its header
+static void RecvParity(BTcpConnection* conn, const BTcpHeaderInfo *hdr,
+                       const uint8_t *payload, size_t packet_len) {
+    BTcpRecvBuffers *rx = conn->rx;
+    const uint16_t count = hdr->ack >> 16;
+    if (!(conn->state.flags & F_FEC) || packet_len != hdr->data_off + hdr->data_len ||
+        hdr->data_off != rx->hdr_size || hdr->data_len > rx->payload_size ||
+        count == 0 || count > FEC_MAX_BLOCK || hdr->win_size == 0) {
+        Log(LOG_WARNING, "Discarded invalid parity packet");
+        return;
+    }
+    BTcpFecGroup *group = BTFecGroup(&rx->fec, hdr->seq);
+    BTFecParity(&rx->fec, group, payload, hdr->data_len, count, hdr->win_size, hdr->ack & 0xFFFF);
+    RecvRebuild(conn, group);
+}
+
+// Read one batch of datagrams without waiting and file them into the
+// window. Returns the # read, 0 if there was nothing, -1 once the sender
+// closed or reading failed.
+static int RecvRead(BTcpConnection* conn) {
+    BTcpRecvBuffers *rx = conn->rx;
+    BTcpWindow *win = &rx->win;
+    uint8_t *data = rx->data, *scratch = rx->scratch;
+    struct iovec *iov = rx->iov;
+    struct mmsghdr *msgs = rx->msgs;
+    const size_t len = rx->len, hdr_size = rx->hdr_size, bufsize = rx->bufsize,
+                 payload_size = rx->payload_size;
+    const int version = rx->version, eager = rx->eager;
+    BTcpHeaderInfo hdr;
+
+    // Drain everything that is pending in one go. Merged datagrams cannot be
+    // scattered, otherwise aim each payload at the slot it will most likely
+    // belong to.
+    int count;
+    if (rx->gro > 0) {
+        count = ReadSegments(conn);
+    } else {
+        for (size_t k = 0; k < rx->batch; k++) {
+            size_t slot = rx->guess + k;
+            if (slot < bufsize && !BTWindowTest(win, slot))
+                iov[2 * k + 1].iov_base = SlotPayload(data, rx->recv_len, len, win, slot);
+            else
+                iov[2 * k + 1].iov_base = scratch + k * payload_size;
+        }
+        count = ReadPackets(conn, msgs, rx->batch);
+    }
+    if (count == -1 && errno == EAGAIN) {
+        return 0;
+    } else if (count == -1) {
+        Log(LOG_WARNING, "Failed to receive packet, closing connection");
+        return -1;
+    }
+    conn->stats.packets_received += count;
+    uint64_t now = NowUs();
+    if (rx->unacked == 0)
+        rx->held_since = now;
+    rx->unacked += count;
+    if (rx->unacked >= rx->ack_every)
+        rx->ack_now = 1;
+    // A paced sender does not go quiet between the packets of a window, so
+    // do not make the first of them wait for its end
+    if (rx->eager && now - rx->held_since >= AckDelay(conn))
+        rx->ack_now = 1;
+
+    // First pass: accept packets that landed where they belong, and
+    // move the rest aside before another packet can claim their slot
+    for (int k = 0; k < count; k++) {
+        ssize_t packet_len = msgs[k].msg_len;
+        rx->deferred[k] = 0;
+        if (packet_len == 0) {
+            // 0-length packet: close
+            Log(LOG_INFO, "Received zero-length packet, closing");
+            conn->state.flags &= ~F_OPEN;
+            return -1;
+        }
+        if (packet_len <= hdr_size)
+            continue;
+        conn->stats.bytes_copied += packet_len - hdr_size;
+        if (DecodeHeader(version, &rx->hdrs[k], packet_len, rx->win_start, &hdr) != 0)
+            continue;
+        uint32_t win_ind = hdr.seq - rx->win_start;
+        uint8_t *landed = iov[2 * k + 1].iov_base;
+        // Parity is no slot's payload, it only has to survive the batch
+        if ((hdr.flags & F_PARITY) ||
+            (win_ind < bufsize && landed != SlotPayload(data, rx->recv_len, len, win, win_ind))) {
+            rx->deferred[k] = 1;
+            if (landed != rx->spare[k]) {
+                memcpy(rx->spare[k], landed, packet_len - hdr_size);
+                conn->stats.bytes_copied += packet_len - hdr_size;
+            }
+        }
+    }
+
+    // Second pass: validate everything and settle deferred payloads
+    for (int k = 0; k < count; k++) {
+        ssize_t packet_len = msgs[k].msg_len;
+        if (packet_len == sizeof(BTcpHeader) &&
+            DecodeHeader(1, &rx->hdrs[k], packet_len, rx->win_start - 1, &hdr) == 0 &&
+            hdr.data_len == 0 && hdr.seq + 1 == rx->win_start) {
+            // An empty v1 packet right behind the window is a
+            // probe whose reply got lost, say it again
+            SendNegotiationReply(conn, rx->win_start, bufsize);
+            continue;
+        }
+        if (DecodeHeader(version, &rx->hdrs[k], packet_len, rx->win_start, &hdr) != 0) {
+            Log(LOG_WARNING, "Discarded packet with invalid header");
+            continue;
+        } else if (CheckPacket(version, &rx->hdrs[k],
+                               rx->deferred[k] ? rx->spare[k] : iov[2 * k + 1].iov_base,
+                               packet_len - hdr_size) != 0) {
+            Log(LOG_WARNING, "Discarded packet with a bad checksum");
+            conn->stats.corrupted++;
+            continue;
+        }
+        if (hdr.flags & F_PARITY) {
+            RecvParity(conn, &hdr, rx->spare[k], packet_len);
+            continue;
+        }
+        uint32_t win_ind = hdr.seq - rx->win_start;
+        if ((int32_t)win_ind < 0 || (win_ind < bufsize && BTWindowTest(win, win_ind))) {
+            // Already received, maybe handed over - ignore, but our ACK
+            // may be lost. Retransmissions that crossed it are routine.
+            Logf(LOG_DEBUG, "Unexpected packet: sequence %u already received", hdr.seq);
+            conn->stats.duplicates++;
+            rx->ack_now = eager;
+            continue;
+        } else if (win_ind >= bufsize) {
+            // Past the window = unexpected packet, our ACK may be lost
+            Log(LOG_WARNING, "Unexpected packet: sequence number not in window");
+            conn->stats.out_of_window++;
+            rx->ack_now = eager;
+            continue;
+        } else if (packet_len != hdr.data_off + hdr.data_len || hdr.data_off != hdr_size ||
+                   hdr.data_len > payload_size) {
+            Logf(LOG_WARNING, "Wrong packet length: Expected %d, got %zd", hdr.data_off + hdr.data_len, packet_len);
+            Log(LOG_WARNING, "Discarded invalid packet");
+            continue;
+        } else {
+            // Save the packet
+            Logf(LOG_DEBUG, "Received packet, len=%zd, seq=%u, saving to slot %u", packet_len, hdr.seq, win_ind);
+            if (rx->deferred[k]) {
+                memcpy(SlotPayload(data, rx->recv_len, len, win, win_ind),
+                       rx->spare[k], hdr.data_len);
+                conn->stats.bytes_copied += hdr.data_len;
+            }
+            if (eager && ((win_ind > 0 && !BTWindowTest(win, win_ind - 1)) ||
+                          (win_ind + 1 < bufsize && BTWindowTest(win, win_ind + 1))))
+                rx->ack_now = 1;  // Opens or fills a hole
+            BTWindowSet(win, win_ind, hdr.data_len);
+            rx->guess = win_ind + 1;
+            rx->idle = 0;
+            if (rx->fec.size > 0 && (hdr.fec_tag >> 8) != 0) {
+                BTcpFecGroup *group = BTFecGroup(&rx->fec, BTFecGroupOf(hdr.seq, hdr.fec_tag));
+                BTFecAdd(&rx->fec, group, SlotPayload(data, rx->recv_len, len, win, win_ind), hdr.data_len);
+                RecvRebuild(conn, group);
+            }
+            // Data echoes the time of our latest ACK, which makes
+            // a sample whenever a new one comes back. Our ACK echoes
+            // the oldest packet it covers (as in RFC 7323), so that
+            // the sender's timeout allows for the ACK being held back.
+            if (conn->state.ts_recent == 0)
+                conn->state.ts_recent = hdr.ts_val;
+            if (hdr.ts_ecr != 0 && hdr.ts_ecr != rx->last_ecr) {
+                rx->last_ecr = hdr.ts_ecr;
+                RttSample(conn, Timestamp() - hdr.ts_ecr);
+            }
+        }
+    }
+    if (eager && !rx->ack_now) {
+        // Don't sit on the end of a message, or on a full buffer
+        size_t run = BTWindowLeadingRun(win);
+        if (run > 0 && (run * payload_size >= len - rx->recv_len ||
+                        BTWindowLen(win, run - 1) < payload_size))
+            rx->ack_now = 1;
+    }
+    return count;
+}
+
+// Hand over complete packets and tell the sender
+static void RecvAck(BTcpConnection* conn) {
+    BTcpRecvBuffers *rx = conn->rx;
+    BTcpWindow *win = &rx->win;
+    uint8_t *data = rx->data;
+    const size_t len = rx->len, base = rx->recv_len,
+                 complete = BTWindowLeadingRun(win);
+    size_t i;
+    int truncated = 0;
+    Log(LOG_DEBUG, "Handling received packets");
+
+    // Complete sequences are mostly in place already, only pull in
+    // those that had to wait in the window ring
+    for (i = 0; i < complete; i++) {
+        uint16_t packet_len = BTWindowLen(win, i);
+        if (rx->recv_len + packet_len > len) {
+            Logf(LOG_ERROR, "No more space in receiver buffer");
+            break;
+        }
+        uint8_t *p = SlotPayload(data, base, len, win, i);
+        if (p != data + rx->recv_len) {
+            memmove(data + rx->recv_len, p, packet_len);
+            conn->stats.bytes_copied += packet_len;
+        }
+        rx->recv_len += packet_len;
+        conn->stats.bytes_delivered += packet_len;
+        if (packet_len < rx->payload_size) {
+            // Slots behind a short packet were laid out for full
+            // ones, so they are dropped and will be retransmitted
+            truncated = 1;
+            i++;
+            break;
+        }
+    }
+    if (i > 0) {
+        if (i == 1)
+            Logf(LOG_DEBUG, "Copied packet [%u] to data+0x%zX", rx->last_acked, rx->recv_len);
+        else
+            Logf(LOG_DEBUG, "Copied packets [%u]-[%u] to data+0x%zX", rx->last_acked, rx->last_acked + (uint32_t)i - 1, rx->recv_len);
+        // Slide the window
+        Logf(LOG_DEBUG, "Advancing window by %zu", i);
+        BTWindowAdvance(win, i);
+        if (truncated)
+            BTWindowClear(win);
+        rx->win_start += i;
+        rx->guess = rx->guess > i ? rx->guess - i : 0;
+    } else {
+        Log(LOG_DEBUG, "No packet available");
+    }
+    if (conn->config.digest)
+        conn->state.digest = BTCrc32c(conn->state.digest, data + base, rx->recv_len - base);
+    rx->last_acked += i;
+    SendAck(conn, win, rx->win_start, rx->sack);
+    rx->unacked = 0;
+    rx->ack_now = 0;
+}
+
+// Wrap up the transfer, returns the bytes handed over
+static size_t RecvFinish(BTcpConnection* conn) {
+    BTcpRecvBuffers *rx = conn->rx;
+    conn->state.packet_sent = rx->last_acked;
+    rx->active = 0;
+    return rx->recv_len;
+}
+
 size_t BTRecv(BTcpConnection* conn, void *data, size_t len) {
     if ((conn->state.flags & F_OPEN) == 0) {
         Log(LOG_ERROR, "Connection already closed");
         return 0;
     }
-
-    const size_t bufsize = conn->config.recv_buffer_size;
-    uint8_t *buf = malloc((1 + bufsize) * conn->config.max_packet_size);
-    if (buf == NULL) {
-        Log(LOG_ERROR, "Failed to allocate memory");
+    if (conn->tx->active || conn->rx->active) {
+        Log(LOG_ERROR, "Another transfer is under way");
         return 0;
     }
-    uint8_t *packet_buf = buf + bufsize * conn->config.max_packet_size;
+
     int socket = conn->socket;
     struct sockaddr *addr = (struct sockaddr *)&conn->addr;
     socklen_t addrlen = sizeof *addr;
-    bind(socket, addr, addrlen);
-
-    uint8_t last_acked = conn->state.packet_sent,
-            win_start = last_acked,
-            *packet_flags = malloc(bufsize);
-    size_t recv_len = 0,
-           payload_size,
-           offset = 0;
+    if (!(conn->state.flags & F_CONNECTED)) {
+        bind(socket, addr, addrlen);
+        conn->stats.syscalls++;
+    }
+
+    uint32_t last_acked = conn->state.packet_sent;
+    size_t recv_len = 0;
     ssize_t received;
-    BTcpHeader hdr, response;
-
-    for (int i = 0; i < bufsize; i++)
-        packet_flags[i] = 0;
-
-    // Fetch the first packet
-    // Sender address will be given by recvfrom(2)
-    Log(LOG_DEBUG, "Waiting for first packet");
-    received = recvfrom(socket, buf, conn->config.max_packet_size, 0, addr, &addrlen);
-    if (received < 0) {
-        Log(LOG_ERROR, "Failed to receive initial packet");
-        goto cleanup;
-    } else if (received == 0) {
-        Log(LOG_INFO, "Sender trying to close connection");
-        conn->state.flags &= ~F_OPEN;
-        goto cleanup;
-    }
-    payload_size = received - sizeof(BTcpHeader);
-    memcpy(&hdr, buf, sizeof hdr);
-    memcpy(data + offset, buf + sizeof(BTcpHeader), payload_size);
-    recv_len += payload_size;
-    Logf(LOG_DEBUG, "Received first packet, len=%d seq=%d", received, hdr.btcp_seq);
+    BTcpHeaderV2 first_hdr;
+    BTcpHeaderInfo hdr, response;
+    uint32_t last_ecr = 0;
 
-    // Send the initial reply
-    win_start = last_acked = hdr.btcp_seq + 1;
-    response.btcp_ack = last_acked;
-    response.win_size = bufsize;
-    response.flags = F_ACK;
-    Logf(LOG_DEBUG, "Responding with ACK=%d", last_acked);
-    sendto(socket, &response, sizeof response, 0, addr, addrlen);
-
-    struct pollfd pfd = {socket, POLLIN, 0};
-    ssize_t presult;
-    while (recv_len < len) {
-        presult = poll(&pfd, 1, conn->config.recv_timeout);
-        if (presult == 1 && pfd.revents == POLLIN) {  // A packet is here
-            ssize_t packet_len = recv(socket, packet_buf, conn->config.max_packet_size, 0);
-            if (packet_len == -1) {
-                Log(LOG_WARNING, "Failed to receive packet, closing connection");
-                break;
-            }
-            if (packet_len == 0) {
-                // 0-length packet: close
-                Log(LOG_INFO, "Received zero-length packet, closing");
+    // A v2 stream goes on right where the previous call left it. Otherwise
+    // every call starts with a first packet and a reply telling the window,
+    // which is also how v1 senders expect it.
+    const int streaming = (conn->state.flags & F_CONNECTED) && conn->state.version >= 2;
+    int negotiating = 0;
+    size_t hdr_size = HeaderSize(conn->state.version);
+    if (streaming) {
+        Logf(LOG_DEBUG, "Continuing stream at seq=%u", last_acked);
+    } else {
+        // Fetch the first packet, its payload goes straight to the caller
+        // Sender address will be given by recvmsg(2)
+        Log(LOG_DEBUG, "Waiting for first packet");
+        struct iovec first_iov[2] = {
+            {&first_hdr, hdr_size},
+            {data, len < MAX_DATAGRAM ? len : MAX_DATAGRAM}
+        };
+        struct msghdr first_msg = {
+            .msg_name = addr,
+            .msg_namelen = addrlen,
+            .msg_iov = first_iov,
+            .msg_iovlen = 2
+        };
+        while (1) {
+            first_msg.msg_namelen = addrlen;
+            received = recvmsg(socket, &first_msg, 0);
+            conn->stats.syscalls++;
+            if (received < 0) {
+                Log(LOG_ERROR, "Failed to receive initial packet");
+                return 0;
+            } else if (received == 0) {
+                Log(LOG_INFO, "Sender trying to close connection");
                 conn->state.flags &= ~F_OPEN;
+                return 0;
+            } else if (DecodeHeader(conn->state.version, &first_hdr, received, last_acked, &hdr) != 0 ||
+                       CheckPacket(conn->state.version, &first_hdr, data, received - hdr_size) != 0) {
+                Log(LOG_WARNING, "Discarded invalid initial packet");
+                continue;
+            } else if (conn->state.version == 0 || hdr.seq == last_acked) {
                 break;
             }
-            // Copy the header and inspect it
-            memcpy(&hdr, packet_buf, sizeof hdr);
-            uint8_t win_ind = hdr.btcp_seq - win_start;
-            if (win_ind >= bufsize) {
-                // Not in window = unexpected packet
-                Log(LOG_WARNING, "Unexpected packet: sequence number not in window");
-                continue;
-            } else if (packet_flags[win_ind]) {
-                // Already received - ignore
-                Logf(LOG_WARNING, "Unexpected packet: sequence %d already received", hdr.btcp_seq);
-                continue;
-            } else if (packet_len != hdr.data_off + hdr.data_len) {
-                Logf(LOG_WARNING, "Wrong packet length: Expected %d, got %d", hdr.data_off + hdr.data_len, packet_len);
-                Log(LOG_WARNING, "Discarded invalid packet");
+            // A straggler from the previous exchange: the sender may still be
+            // waiting for our last ACK, so repeat it
+            Logf(LOG_DEBUG, "Stale packet seq=%u, repeating ACK=%u", hdr.seq, last_acked);
+            conn->stats.duplicates++;
+            uint8_t buf[sizeof(BTcpHeaderV2)];
+            response = (BTcpHeaderInfo){
+                .ack = last_acked,
+                .data_off = hdr_size,
+                .flags = F_ACK,
+                .ts_val = Timestamp(),
+                .ts_ecr = hdr.ts_val
+            };
+            EncodeHeader(conn->state.version, &response, buf);
+            if (Sealing(conn))
+                SealPacket(buf, NULL, 0);
+            sendto(socket, buf, hdr_size, 0, addr, addrlen);
+            conn->stats.syscalls++;
+            conn->stats.packets_sent++;
+            conn->stats.bytes_sent += hdr_size;
+        }
+        conn->stats.packets_received++;
+        conn->stats.bytes_received += received;
+        recv_len += received - hdr_size;
+        conn->stats.bytes_copied += recv_len;
+        conn->stats.bytes_delivered += recv_len;
+        if (conn->config.digest)
+            conn->state.digest = BTCrc32c(conn->state.digest, data, recv_len);
+        Logf(LOG_DEBUG, "Received first packet, len=%zd seq=%u", received, hdr.seq);
+
+        // The first packet we ever see settles the header version
+        negotiating = conn->state.version == 0;
+        if (negotiating)
+            AcceptVersion(conn, hdr.flags);
+        conn->state.flags |= F_CONNECTED;
+        conn->state.ts_recent = hdr.ts_val;
+        last_ecr = hdr.ts_ecr;
+        // The window starts behind the first packet
+        conn->state.packet_sent = hdr.seq + 1;
+    }
+    if (RecvStart(conn, data, len) != 0)
+        return 0;
+    BTcpRecvBuffers *rx = conn->rx;
+
+    // Send the initial reply
+    if (!streaming) {
+        rx->recv_len = recv_len;
+        rx->last_ecr = last_ecr;
+        rx->idle = 0;
+        Logf(LOG_DEBUG, "Responding with ACK=%u", rx->last_acked);
+    }
+    if (negotiating) {
+        SendNegotiationReply(conn, rx->last_acked, rx->bufsize);
+    } else if (!streaming) {
+        hdr_size = rx->hdr_size;
+        uint8_t buf[sizeof(BTcpHeaderV2)];
+        response = (BTcpHeaderInfo){
+            .ack = rx->last_acked,
+            .data_off = hdr_size,
+            .win_size = rx->bufsize,
+            .flags = F_ACK,
+            .ts_val = Timestamp(),
+            .ts_ecr = conn->state.ts_recent
+        };
+        EncodeHeader(rx->version, &response, buf);
+        if (Sealing(conn))
+            SealPacket(buf, NULL, 0);
+        sendto(socket, buf, hdr_size, 0, addr, addrlen);
+        conn->stats.syscalls++;
+        conn->stats.packets_sent++;
+        conn->stats.bytes_sent += hdr_size;
+    }
+
+    while (rx->recv_len < len) {
+        int presult = WaitReadable(conn, RecvTimeout(conn));
+        rx->ack_now = presult == 0;
+        if (presult == 1) {  // Packets are here
+            int count = RecvRead(conn);
+            if (count == 0)
                 continue;
-            } else {
-                // Save the packet
-                Logf(LOG_DEBUG, "Received packet, len=%d, seq=%d, saving to slot %d", packet_len, hdr.btcp_seq, win_ind);
-                packet_flags[win_ind] = 1;
-                memcpy(buf + win_ind * conn->config.max_packet_size, packet_buf, packet_len);
-            }
-        } else if (presult == 0) {
-            // Timeout, handle received packets
-            Log(LOG_DEBUG, "Handling received packets");
-            int i;
-
-            // Copy complete sequences to receiver buffer
-            for (i = 0; i < bufsize; i++) {
-                if (packet_flags[i] == 0) {
-                    // This one's missing, stop
-                    break;
-                }
-                void *p = buf + i * conn->config.max_packet_size;
-                memcpy(&hdr, p, sizeof hdr);
-                if (recv_len + hdr.data_len > len) {
-                    Logf(LOG_ERROR, "No more space in receiver buffer");
-                    break;
-                }
-                memcpy(data + recv_len, p + hdr.data_off, hdr.data_len);
-                recv_len += hdr.data_len;
-            }
-            if (i > 0) {
-                if (i == 1)
-                    Logf(LOG_DEBUG, "Copied packet [%d] to data+0x%X", last_acked, recv_len);
-                else
-                    Logf(LOG_DEBUG, "Copied packets [%d]-[%d] to data+0x%X", last_acked, last_acked + i - 1, recv_len);
-                // Rotate window and buffer
-                Logf(LOG_DEBUG, "Rotating window by %d", i);
-                memmove(buf, buf + i * conn->config.max_packet_size, (bufsize - i) * conn->config.max_packet_size);
-                memmove(packet_flags, packet_flags + i, bufsize - i);
-                for (int j = bufsize - i; j < bufsize; j++)
-                    packet_flags[j] = 0;
-                win_start += i;
-            } else {
-                Log(LOG_WARNING, "No packet available");
-            }
-            last_acked += i;
-
-            // Determine how many packets are missing (selective retransmission)
-            for (i = 0; i < bufsize; i++)
-                if (packet_flags[i])
-                    break;
-
-            // ACK complete ones
-            response.btcp_ack = last_acked;
-            response.win_size = i;
-            response.flags = F_ACK;
-            if (i == bufsize)
-                Logf(LOG_DEBUG, "Received packets up to %hhu, sequence is complete", (unsigned char)last_acked - 1U);
-            else
-                Logf(LOG_DEBUG, "Received packets up to %hhu, %d missing", (unsigned char)last_acked - 1U, i);
-            sendto(socket, &response, sizeof response, 0, addr, addrlen);
-        } else {
+            else if (count < 0)
+                break;
+        } else if (presult < 0) {
             Logf(LOG_ERROR, "Unknown error: %s", strerror(errno));
+            continue;
         }
+        if (rx->ack_now)
+            RecvAck(conn);
+    }
+    return RecvFinish(conn);
+}
+
+int BTSendAsync(BTcpConnection* conn, const void* data, size_t len, BTcpCallback done, void* arg) {
+    BTcpSendBuffers *tx = conn->tx;
+    if (tx->active || conn->rx->active) {
+        Log(LOG_ERROR, "Another transfer is under way");
+        return -1;
+    }
+    if (!(conn->state.flags & F_CONNECTED)) {
+        if (ConnectSocket(conn) != 0)
+            return -1;
+        if (conn->state.version != 0)
+            conn->state.flags |= F_CONNECTED;
+    }
+    tx->done = done;
+    tx->arg = arg;
+    tx->data = data;
+    tx->len = len;
+    // The handshake runs from BTPoll as well, the data follows once it is done
+    tx->negotiating = !(conn->state.flags & F_CONNECTED);
+    if (tx->negotiating) {
+        tx->probe_sent = 0;
+        SendProbe(conn);
+    } else if (SendStart(conn, data, len) != 0) {
+        return -1;
+    } else {
+        SendPump(conn, NowUs());
     }
+    tx->active = 1;
+    return 0;
+}
 
-cleanup:
-    Log(LOG_DEBUG, "Cleaning up");
-    free(buf);
-    free(packet_flags);
-    conn->state.packet_sent = last_acked;
-    return recv_len;
+int BTRecvAsync(BTcpConnection* conn, void* data, size_t len, BTcpCallback done, void* arg) {
+    BTcpRecvBuffers *rx = conn->rx;
+    if ((conn->state.flags & F_OPEN) == 0) {
+        Log(LOG_ERROR, "Connection already closed");
+        return -1;
+    } else if (conn->tx->active || rx->active) {
+        Log(LOG_ERROR, "Another transfer is under way");
+        return -1;
+    } else if (!(conn->state.flags & F_CONNECTED) || conn->state.version < 2) {
+        Log(LOG_ERROR, "Receiving asynchronously needs a v2 connection past its handshake");
+        return -1;
+    }
+    if (RecvStart(conn, data, len) != 0)
+        return -1;
+    rx->done = done;
+    rx->arg = arg;
+    rx->active = 1;
+    return 0;
 }
 
-BTcpConnection* BTOpen(unsigned long addr, unsigned short port) {
-    BTcpConnection* conn = malloc(sizeof(BTcpConnection));
-    BTDefaultConfig(conn);
+static void PollSend(BTcpConnection* conn) {
+    BTcpSendBuffers *tx = conn->tx;
+    uint64_t now = NowUs();
+    if (tx->negotiating) {
+        uint8_t reply[sizeof(BTcpHeader) + sizeof(BTcpHeaderV2)];
+        ssize_t n = recv(conn->socket, reply, sizeof reply, MSG_DONTWAIT);
+        conn->stats.syscalls++;
+        if (n < 0 && errno == EAGAIN) {
+            if (now - tx->probe_sent >= Rto(conn)) {
+                Log(LOG_DEBUG, "Negotiation timeout, retrying");
+                SendProbe(conn);
+            }
+            return;
+        }
+        if (n >= 0) {
+            conn->stats.packets_received++;
+            conn->stats.bytes_received += n;
+        }
+        if (ProbeReply(conn, reply, n) != 0) {
+            SendProbe(conn);
+            return;
+        }
+        tx->negotiating = 0;
+        conn->state.flags |= F_CONNECTED;
+        if (SendStart(conn, tx->data, tx->len) != 0) {
+            tx->active = 0;
+            if (tx->done != NULL)
+                tx->done(conn, 0, tx->arg);
+            return;
+        }
+    } else if (SendAcks(conn) < 0 && now >= tx->expires) {
+        Log(LOG_DEBUG, "ACK timeout");
+        conn->stats.timeouts++;
+    }
+
+    if (SendComplete(tx)) {
+        size_t sent_len = SendFinish(conn);
+        if (tx->done != NULL)
+            tx->done(conn, sent_len, tx->arg);
+        return;
+    }
+    SendPump(conn, now);
+}
+
+static void PollRecv(BTcpConnection* conn) {
+    BTcpRecvBuffers *rx = conn->rx;
+    uint64_t now = NowUs();
+    rx->ack_now = 0;
+    int count = RecvRead(conn);
+    if (count > 0)
+        rx->since = now;
+    else if (count == 0 && now - rx->since >= RecvTimeout(conn))
+        rx->ack_now = 1;
+    if (count >= 0 && rx->ack_now) {
+        RecvAck(conn);
+        rx->since = now;
+    }
+
+    if (count < 0 || rx->recv_len >= rx->len) {
+        size_t recv_len = RecvFinish(conn);
+        if (rx->done != NULL)
+            rx->done(conn, recv_len, rx->arg);
+    }
+}
+
+int BTPoll(BTcpConnection* conn) {
+    // The callbacks may start the next transfer right away
+    if (conn->tx->active)
+        PollSend(conn);
+    else if (conn->rx->active)
+        PollRecv(conn);
+    return conn->tx->active || conn->rx->active;
+}
+
+void BTGetStats(const BTcpConnection* conn, BTcpStats* stats) {
+    // Nothing but 64-bit counters, each changed by a single store
+    const uint64_t *from = (const uint64_t *)&conn->stats;
+    uint64_t *to = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof *stats / sizeof *to; i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+int BTFileno(const BTcpConnection* conn) {
+    return conn->socket;
+}
+
+uint64_t BTNextTimeout(const BTcpConnection* conn) {
+    const BTcpSendBuffers *tx = conn->tx;
+    const BTcpRecvBuffers *rx = conn->rx;
+    uint64_t at = UINT64_MAX;
+    if (tx->active) {
+        at = tx->negotiating ? tx->probe_sent + Rto(conn) : SendWake(tx);
+    } else if (rx->active) {
+        uint64_t timeout = RecvTimeout(conn);
+        if (timeout != WAIT_FOREVER)
+            at = rx->since + timeout;
+    }
+    if (at == UINT64_MAX)
+        return UINT64_MAX;
+    uint64_t now = NowUs();
+    return at > now ? at - now : 0;
+}
+
+BTcpConnection* BTOpen(unsigned long addr, unsigned short port, const BTcpConfig* config) {
+    BTcpConnection* conn = aligned_alloc(CACHE_LINE, sizeof(BTcpConnection));
+    if (config != NULL)
+        conn->config = *config;
+    else
+        BTDefaultConfig(conn);
+    if (BTCongestionInit(&conn->cc, conn->config.congestion) != 0) {
+        Logf(LOG_ERROR, "Unknown congestion control algorithm %d", conn->config.congestion);
+        free(conn);
+        return NULL;
+    }
+    if (BTPacingName(conn->config.pacing) == NULL) {
+        Logf(LOG_ERROR, "Unknown pacing mode %d", conn->config.pacing);
+        free(conn);
+        return NULL;
+    }
+    if (conn->config.fec_block < 0 || conn->config.fec_block > FEC_MAX_BLOCK ||
+        conn->config.fec_parity < 0 || conn->config.fec_parity > conn->config.fec_block) {
+        Logf(LOG_ERROR, "Invalid FEC ratio %d:%d", conn->config.fec_block, conn->config.fec_parity);
+        free(conn);
+        return NULL;
+    }
+
+    // Measure the buffers first, then map them together with their
+    // descriptors so nothing is allocated on the data path any more
+    BTcpArena measure = {0};
+    BTcpSendBuffers tx;
+    BTcpRecvBuffers rx;
+    BTArenaAlloc(&measure, sizeof tx);
+    BTArenaAlloc(&measure, sizeof rx);
+    BTArenaAlloc(&measure, sizeof(BTcpUring));
+    CarveBuffers(&measure, &conn->config, &tx, &rx);
+    if (BTArenaInit(&conn->arena, measure.used, conn->config.hugepages) != 0) {
+        Logf(LOG_ERROR, "Failed to map %zu bytes of packet buffers: %s", measure.used, strerror(errno));
+        free(conn);
+        return NULL;
+    }
+    conn->tx = BTArenaAlloc(&conn->arena, sizeof *conn->tx);
+    conn->rx = BTArenaAlloc(&conn->arena, sizeof *conn->rx);
+    conn->uring = BTArenaAlloc(&conn->arena, sizeof *conn->uring);
+    CarveBuffers(&conn->arena, &conn->config, conn->tx, conn->rx);
+    Logf(LOG_DEBUG, "Mapped %zu bytes of packet buffers%s", conn->arena.size,
+         conn->arena.huge ? " on huge pages" : "");
     conn->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     conn->addr.sin_family = AF_INET;
     conn->addr.sin_addr.s_addr = addr;
     conn->addr.sin_port = htons(port);
     conn->state.flags = F_OPEN;
+    conn->state.version = 0;
     conn->state.packet_sent = 0;
+    conn->state.ts_recent = 0;
+    conn->state.peer_window = 0;
+    conn->state.digest = 0;
+    memset(&conn->state.rtt, 0, sizeof conn->state.rtt);
+    memset(&conn->stats, 0, sizeof conn->stats);
+    conn->stats.allocations = 2;  // The connection and its arena
+
+    if (conn->config.io_uring && conn->config.batch_io && BTUringInit(conn->uring, URING_ENTRIES) == 0) {
+        conn->stats.allocations++;  // Its rings
+    } else {
+        if (conn->config.io_uring && conn->config.batch_io)
+            Logf(LOG_INFO, "No io_uring (%s), using sendmmsg/recvmmsg", strerror(errno));
+        conn->uring = NULL;
+    }
+
+    // The pacer carries on from one call to the next like the rest of the
+    // stream. Departure times are only kept by the fq qdisc, anywhere else
+    // they are ignored and the pacer in BTSend is all there is.
+    BTPacerInit(&conn->tx->pacer);
+    conn->tx->txtime = 0;
+    conn->tx->gso = 0;
+    conn->rx->gro = 0;
+    if (conn->config.pacing == PACING_TXTIME) {
+        struct sock_txtime txtime = {.clockid = CLOCK_MONOTONIC};
+        if (setsockopt(conn->socket, SOL_SOCKET, SO_TXTIME, &txtime, sizeof txtime) == 0)
+            conn->tx->txtime = 1;
+        else
+            Logf(LOG_INFO, "No SO_TXTIME (%s), pacing in user space", strerror(errno));
+    }
+    // The segment size goes with every send, this only asks whether the
+    // kernel knows the option. UDP_GRO waits for the first BTRecv.
+    if (conn->config.offload && conn->config.batch_io) {
+        int off = 0;
+        if (setsockopt(conn->socket, SOL_UDP, UDP_SEGMENT, &off, sizeof off) == 0)
+            conn->tx->gso = 1;
+        else
+            Logf(LOG_INFO, "No UDP_SEGMENT (%s), sending packets one by one", strerror(errno));
+    }
+    return conn;
+}
+
+BTcpConnection* BTConnect(unsigned long addr, unsigned short port, const BTcpConfig* config) {
+    BTcpConnection* conn = BTOpen(addr, port, config);
+    if (conn == NULL)
+        return NULL;
+    if (Connect(conn) != 0) {
+        BTClose(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+BTcpConnection* BTAccept(unsigned long addr, unsigned short port, const BTcpConfig* config) {
+    BTcpConnection* conn = BTOpen(addr, port, config);
+    if (conn == NULL)
+        return NULL;
+    if (bind(conn->socket, (struct sockaddr *)&conn->addr, sizeof conn->addr) == -1) {
+        Logf(LOG_ERROR, "Failed to bind: %s", strerror(errno));
+        BTClose(conn);
+        return NULL;
+    }
+
+    // Peek, so that anything but a probe stays there for BTRecv
+    uint8_t buf[sizeof(BTcpHeader)];
+    socklen_t addrlen = sizeof conn->addr;
+    BTcpHeaderInfo info;
+    ssize_t n = recvfrom(conn->socket, buf, sizeof buf, MSG_PEEK | MSG_TRUNC,
+                         (struct sockaddr *)&conn->addr, &addrlen);
+    conn->stats.syscalls++;
+    if (n < 0) {
+        Logf(LOG_ERROR, "Failed to wait for a sender: %s", strerror(errno));
+        BTClose(conn);
+        return NULL;
+    }
+    if (n != sizeof buf || DecodeHeader(1, buf, n, 0, &info) != 0 ||
+        info.data_len != 0 || (info.flags & F_ACK)) {
+        Log(LOG_INFO, "Sender started without a handshake");
+        return conn;
+    }
+    recv(conn->socket, buf, sizeof buf, 0);
+    conn->stats.syscalls++;
+    conn->stats.packets_received++;
+    conn->stats.bytes_received += sizeof buf;
+    Logf(LOG_INFO, "Accepted %s:%d", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+    AcceptVersion(conn, info.flags);
+    conn->state.packet_sent = info.seq + 1;
+    conn->state.flags |= F_CONNECTED;
+    // Fix the peer as the sender did, so that BTSend works this way too
+    if (connect(conn->socket, (struct sockaddr *)&conn->addr, sizeof conn->addr) == -1)
+        Logf(LOG_WARNING, "Failed to connect back to the sender: %s", strerror(errno));
+    conn->stats.syscalls++;
+    SendNegotiationReply(conn, conn->state.packet_sent,
+                         conn->config.recv_buffer_size < MaxWindow(conn->state.version) ?
+                         conn->config.recv_buffer_size : MaxWindow(conn->state.version));
     return conn;
 }
 
@@ -273,12 +2007,33 @@ void BTClose(BTcpConnection* conn) {
     send(conn->socket, NULL, 0, MSG_NOSIGNAL);
     close(conn->socket);
     conn->state.flags &= ~F_OPEN;
+    if (conn->uring != NULL)
+        BTUringFree(conn->uring);
+    BTArenaFree(&conn->arena);
     free(conn);
 }
 
 void BTDefaultConfig(BTcpConnection* conn) {
-    conn->config.max_packet_size = sizeof(BTcpHeader) + 64;
+    conn->config.max_packet_size = 1472;  // Fits a 1500-byte Ethernet MTU
     conn->config.timeout = 10;  // default to 10 ms - lab requirement
     conn->config.recv_timeout = 5;  // default to 5 ms - optimal value
-    conn->config.recv_buffer_size = 10;  // 10-packet buffer for receiving
+    conn->config.recv_buffer_size = 64;  // 64-packet buffer for receiving
+    conn->config.send_buffer_size = 1024;
+    conn->config.header_version = 2;
+    conn->config.batch_io = 1;
+    conn->config.congestion = CC_CUBIC;
+    conn->config.ack_every = 16;
+    conn->config.sack = 1;
+    conn->config.sport = 0;
+    conn->config.dport = 0;
+    conn->config.hugepages = 0;
+    conn->config.io_uring = 0;
+    conn->config.fec_block = 0;
+    conn->config.fec_parity = 0;
+    conn->config.checksum = 1;
+    conn->config.digest = 0;
+    conn->config.pacing = PACING_USER;
+    conn->config.pacing_rate = 0;
+    conn->config.compress = 0;
+    conn->config.offload = 1;
 }
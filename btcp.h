@@ -5,33 +5,161 @@
 #include <stdint.h>
 #include <netinet/ip.h>
 
+#include "arena.h"
+#include "congestion.h"
+#include "pacing.h"
+
 typedef struct _BTcpConfig {
-    // If ACK is not received within $timeout, consider packet loss
+    // If ACK is not received within $timeout, consider packet loss. Only
+    // for v1 peers, which hold their ACKs back by a time they do not tell,
+    // v2 ones go by the round-trip time measured from the handshake on.
     int timeout;  // In milliseconds
 
     // If no subsequent packets come in within $timeout, ACK received ones
+    // Also an upper bound once the round-trip time is known
     int recv_timeout;  // In milliseconds
 
     // Self-explanatory
-    size_t max_packet_size;  // Expect sizeof(header) + max_payload
+    size_t max_packet_size;  // Largest datagram, header included
     size_t recv_buffer_size;  // # of packets for receiving buffer
+    size_t send_buffer_size;  // # of packets in flight at most
+
+    // Highest header version to offer, the peer may settle for less
+    int header_version;
+
+    // Move a whole window per syscall with sendmmsg(2) / recvmmsg(2)
+    int batch_io;  // Boolean
+
+    // Congestion control for sending, one of CC_*
+    int congestion;
+
+    // ACK after this many packets even if more are coming, 0 to ACK only
+    // when the sender goes quiet. Out-of-order packets are ACKed at once.
+    int ack_every;
+
+    // Tell the sender which packets past a hole have arrived (v2 only)
+    int sack;  // Boolean
+
+    // Stamped on every packet this end sends, so that one address can
+    // carry several flows to a server (see server.h)
+    uint8_t sport;
+    uint8_t dport;
+
+    // Back the connection's packet buffers with huge pages if there are any
+    int hugepages;  // Boolean
+
+    // Submit and reap batches of datagrams through io_uring(7) instead of
+    // sendmmsg(2) / recvmmsg(2), if the kernel allows. Needs $batch_io.
+    int io_uring;  // Boolean
+
+    // Add $fec_parity parity packets to every $fec_block data packets sent,
+    // so that the receiver can rebuild lost ones without waiting for a
+    // retransmission (v2 only, see fec.h). A receiver takes parity packets
+    // whenever $fec_block is set. 0 turns it off.
+    int fec_block;
+    int fec_parity;
+
+    // Seal every v2 packet with a CRC32C of header and payload. Receivers
+    // check whatever comes sealed, this only decides what we send.
+    int checksum;  // Boolean
+
+    // Keep a CRC32C of all data delivered, in order, in state.digest
+    int digest;  // Boolean
+
+    // Spread what the windows allow over the round trip instead of sending
+    // it back to back, one of PACING_* (see pacing.h)
+    int pacing;
+
+    // Pace at this many bytes per second, 0 to follow the congestion
+    // window over the round-trip time
+    uint64_t pacing_rate;
+
+    // Offer to send the stream as LZ4 blocks (sender), or take it so
+    // (receiver). The library only agrees on it, see F_COMPRESSED.
+    int compress;  // Boolean
+
+    // Have the kernel cut runs of equal-sized packets out of one large send
+    // (UDP_SEGMENT) and merge them again on receipt (UDP_GRO), if it can.
+    // Needs $batch_io, and stays off for packets with departure times.
+    int offload;  // Boolean
 } BTcpConfig;
 
+// Smoothed round-trip time as in RFC 6298, all in microseconds
+typedef struct _BTcpRtt {
+    uint32_t srtt;    // 0 until the first sample
+    uint32_t rttvar;
+    uint32_t rto;     // Retransmission timeout
+    uint32_t latest;  // Most recent sample
+} BTcpRtt;
+
 typedef struct _BTcpState {
     uint8_t flags;
-    uint16_t packet_sent;
+    uint8_t version;  // Negotiated header version, 0 until known
+    uint32_t packet_sent;
+    size_t payload_size;  // Negotiated payload per packet
+    uint32_t ts_recent;  // Latest timestamp from the peer, to echo back
+    size_t peer_window;  // Receiver's window in packets, 0 until known (v2 only)
+    uint32_t digest;  // Of the data sent and acknowledged, or received, with config.digest
+    BTcpRtt rtt;
 } BTcpState;
 
+// Counters are kept off the cache lines of anything else, as the thread
+// running a connection updates them all the time
+#define CACHE_LINE 64
+
+// Histogram buckets: bucket $i counts values $i bits long, that is, in
+// [2^(i-1), 2^i), and the last one everything longer
+#define STATS_RTT_BUCKETS 24     // Microseconds, the last one from 4.2 s
+#define STATS_WINDOW_BUCKETS 17  // Packets, up to 65535
+
+// Counters of one connection, plain 64-bit integers only. Written without
+// locks by whichever thread runs the connection, see BTGetStats for
+// reading them from elsewhere.
+typedef struct _BTcpStats {
+    uint64_t packets_sent;
+    uint64_t packets_received;
+    uint64_t bytes_sent;  // Datagrams whole, headers included
+    uint64_t bytes_received;
+    uint64_t syscalls;  // send/recv/poll family calls issued
+    uint64_t bytes_copied;  // Payload bytes moved by the kernel or memcpy
+    uint64_t bytes_delivered;  // Payload bytes acked (sender) or handed over (receiver)
+    uint64_t retransmissions;
+    uint64_t timeouts;  // Waits for an ACK that ran out
+    uint64_t rtt_samples;
+    uint64_t loss_events;  // Congestion window reductions
+    uint64_t allocations;  // Heap or mmap(2) allocations, none after BTOpen
+    uint64_t parity_sent;
+    uint64_t recovered;  // Lost packets rebuilt from parity
+    uint64_t corrupted;  // Dropped for a checksum that did not match
+    uint64_t paced;  // Times the pacer held packets back
+    uint64_t duplicates;  // Data packets that had arrived before, handed over or not
+    uint64_t out_of_window;  // Data packets dropped for a sequence number past the window
+    uint64_t rtt_hist[STATS_RTT_BUCKETS];  // Round-trip samples
+    // Packets in flight after each round of sending (sender), or held past
+    // a hole at each ACK (receiver)
+    uint64_t window_hist[STATS_WINDOW_BUCKETS];
+} __attribute__((aligned(CACHE_LINE))) BTcpStats;
+
 typedef struct _BTcpConnection {
     int socket;
     struct sockaddr_in addr;
     BTcpState state;
     BTcpConfig config;
+    BTcpStats stats;
+    BTcpCongestion cc;
+
+    // Working memory of BTSend and BTRecv, carved once in BTOpen for the
+    // largest window and packets the config allows
+    BTcpArena arena;
+    struct _BTcpSendBuffers *tx;
+    struct _BTcpRecvBuffers *rx;
+    struct _BTcpUring *uring;  // NULL unless config.io_uring is in effect
 } BTcpConnection;
 
+// Version 1 header
 typedef struct _BTcpHeader {
-    uint8_t btcp_sport;  // source port - unused
-    uint8_t btcp_dport;  // destination port - unused
+    uint8_t btcp_sport;  // source port
+    uint8_t btcp_dport;  // destination port
     uint8_t btcp_seq;    // sequence number
     uint8_t btcp_ack;    // acknowledgement number
     uint8_t data_off;    // data offset in bytes
@@ -40,20 +168,79 @@ typedef struct _BTcpHeader {
     uint8_t data_len;    // data length (excl. header)
 } BTcpHeader;
 
+// Version 2 header, multi-byte fields are in network byte order
+typedef struct _BTcpHeaderV2 {
+    uint8_t btcp_sport;  // source port
+    uint8_t btcp_dport;  // destination port
+    uint8_t version;     // header version, 2
+    uint8_t flags;       // flags
+    uint32_t btcp_seq;   // sequence number
+    uint32_t btcp_ack;   // acknowledgement number
+    uint16_t data_off;   // data offset in bytes
+    uint16_t win_size;   // window size
+    uint16_t data_len;   // data length (excl. header)
+    uint16_t fec_tag;    // position in an FEC block (see fec.h), 0 if none
+    uint32_t ts_val;     // sender's clock in microseconds
+    uint32_t ts_ecr;     // latest ts_val seen from the peer, 0 if none
+    uint32_t checksum;   // CRC32C of header and payload with this field 0 (F_CRC)
+} BTcpHeaderV2;
+
+// An ACK flagged F_SACK carries up to MAX_SACK_BLOCKS of these as payload,
+// each telling that packets [start, end) arrived. Network byte order.
+typedef struct _BTcpSackBlock {
+    uint32_t start;
+    uint32_t end;
+} BTcpSackBlock;
+
+#define MAX_SACK_BLOCKS 16
+
+// Header fields in host byte order, whatever the version on the wire
+typedef struct _BTcpHeaderInfo {
+    uint8_t sport;
+    uint8_t dport;
+    uint32_t seq;
+    uint32_t ack;
+    uint16_t data_off;
+    uint16_t win_size;
+    uint16_t data_len;
+    uint16_t fec_tag;  // 0 when the version has none
+    uint8_t flags;
+    uint32_t ts_val;  // 0 when the version has no timestamps
+    uint32_t ts_ecr;
+} BTcpHeaderInfo;
+
 /********
 * Flags *
 ********/
 
 #define F_RETRANSMISSION 0x01
 #define F_EOT            0x02
+#define F_V2             0x04  // Sender offers (or receiver accepts) header v2
+#define F_SACK           0x08  // ACK with SACK blocks, win_size is the window
+// Parity packet (v2 only), or in a negotiation reply: parity is welcome.
+// A parity packet has the first packet of its group in seq, the distance
+// between group members in win_size, and their count and XORed lengths
+// in the upper and lower half of ack.
+#define F_PARITY         0x10
+#define F_CRC            0x20  // The checksum is filled in (v2 only)
 #define F_ACK            0x40
+// Probe: the sender would send LZ4 blocks, negotiation reply: so be it
+#define F_LZ4            0x80
 
-#define F_OPEN 0x01
+#define F_OPEN      0x01
+#define F_CONNECTED 0x02  // Handshake done, the peer and its parameters are known
+#define F_FEC       0x04  // Parity packets are in use on this connection
+#define F_COMPRESSED 0x08  // The application's data goes as LZ4 blocks,
+                           // framed and unpacked by the application
 
 /*****************
 * Main Functions *
 *****************/
 
+// Called once an asynchronous transfer is over with the # of bytes it
+// moved, which falls short if the peer closed or the socket failed
+typedef void (*BTcpCallback)(BTcpConnection* conn, size_t len, void* arg);
+
 // Send a stream of data
 size_t BTSend(BTcpConnection* conn, const void* data, size_t len);
 
@@ -61,11 +248,51 @@ size_t BTSend(BTcpConnection* conn, const void* data, size_t len);
 size_t BTRecv(BTcpConnection* conn, void* data, size_t len);
 
 // Open a backTCP connection - both for connecting to server and listening
-BTcpConnection* BTOpen(unsigned long addr, unsigned short port);
+// $config may be NULL for defaults
+// The handshake then happens in the first BTSend or BTRecv
+BTcpConnection* BTOpen(unsigned long addr, unsigned short port, const BTcpConfig* config);
+
+// Open a connection to a receiver at $addr:$port and shake hands with it
+// right away. Later BTSend calls continue one stream, each picking up the
+// window, round-trip time and congestion state where the last one ended.
+BTcpConnection* BTConnect(unsigned long addr, unsigned short port, const BTcpConfig* config);
+
+// Listen at $addr:$port and wait for a sender to shake hands. A v1 sender
+// that starts with data right away is left to the first BTRecv. Once
+// shaken hands, BTSend works this way as well, taking turns with the
+// sender's BTRecv.
+BTcpConnection* BTAccept(unsigned long addr, unsigned short port, const BTcpConfig* config);
 
 // Close a backTCP connection
 void BTClose(BTcpConnection* conn);
 
+// Start sending $len bytes from $data and return at once. BTPoll moves the
+// transfer along and calls $done when all of it has been acknowledged.
+// $data has to stay put until then. One transfer per connection at a time.
+// Returns 0, or -1 if the transfer could not be started.
+int BTSendAsync(BTcpConnection* conn, const void* data, size_t len, BTcpCallback done, void* arg);
+
+// Start receiving $len bytes into $data and return at once, see
+// BTSendAsync. Needs a v2 connection that finished its handshake
+// (BTAccept, or a blocking BTRecv before).
+int BTRecvAsync(BTcpConnection* conn, void* data, size_t len, BTcpCallback done, void* arg);
+
+// Do whatever the transfer under way can do without blocking: read what
+// arrived, answer it, run the timers and send. Completion callbacks are
+// called from here. Returns 1 while a transfer is still under way, else 0.
+int BTPoll(BTcpConnection* conn);
+
+// For an external event loop: call BTPoll whenever this descriptor turns
+// readable (level-triggered), or BTNextTimeout() microseconds from now,
+// whichever comes first. UINT64_MAX means only traffic can move things on.
+int BTFileno(const BTcpConnection* conn);
+uint64_t BTNextTimeout(const BTcpConnection* conn);
+
+// Copy the counters of $conn to $stats. Safe from any thread while the
+// connection is in use: each counter is read whole, though they may be a
+// packet or two apart from each other.
+void BTGetStats(const BTcpConnection* conn, BTcpStats* stats);
+
 // Reset a backTCP config to default
 void BTDefaultConfig(BTcpConnection* config);
 
@@ -0,0 +1,145 @@
+#include "congestion.h"
+
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+
+// Initial window as in RFC 6928
+#define INITIAL_WINDOW 10.0
+#define MIN_WINDOW 2.0
+#define UNLIMITED 1e9
+
+// CUBIC constants from RFC 8312
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+/*******
+* None *
+*******/
+
+static void NoneInit(BTcpCongestion *cc) {
+    cc->cwnd = UNLIMITED;
+    cc->ssthresh = UNLIMITED;
+}
+
+static void NoneAck(BTcpCongestion *cc, uint32_t acked, uint64_t now, uint32_t srtt) {
+}
+
+static void NoneLoss(BTcpCongestion *cc, uint64_t now) {
+}
+
+/*******
+* Reno *
+*******/
+
+static void RenoInit(BTcpCongestion *cc) {
+    cc->cwnd = INITIAL_WINDOW;
+    cc->ssthresh = UNLIMITED;
+}
+
+static void RenoAck(BTcpCongestion *cc, uint32_t acked, uint64_t now, uint32_t srtt) {
+    if (cc->cwnd < cc->ssthresh)
+        cc->cwnd += acked;  // Slow start
+    else
+        cc->cwnd += acked / cc->cwnd;  // Congestion avoidance
+}
+
+static void RenoLoss(BTcpCongestion *cc, uint64_t now) {
+    cc->ssthresh = fmax(cc->cwnd / 2, MIN_WINDOW);
+    cc->cwnd = cc->ssthresh;
+}
+
+static void RenoTimeout(BTcpCongestion *cc, uint64_t now) {
+    cc->ssthresh = fmax(cc->cwnd / 2, MIN_WINDOW);
+    cc->cwnd = 1.0;
+}
+
+/********
+* CUBIC *
+********/
+
+static void CubicInit(BTcpCongestion *cc) {
+    RenoInit(cc);
+    cc->w_max = 0;
+    cc->k = 0;
+    cc->origin = 0;
+    cc->w_est = 0;
+    cc->epoch = 0;
+}
+
+static void CubicAck(BTcpCongestion *cc, uint32_t acked, uint64_t now, uint32_t srtt) {
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += acked;
+        return;
+    }
+    if (cc->epoch == 0) {
+        cc->epoch = now;
+        if (cc->cwnd < cc->w_max) {
+            cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+            cc->origin = cc->w_max;
+        } else {
+            cc->k = 0;
+            cc->origin = cc->cwnd;
+        }
+        cc->w_est = cc->cwnd;
+    }
+
+    // Aim for where the cubic function will be one RTT from now
+    double t = (now - cc->epoch + srtt) * 1e-6 - cc->k,
+           target = cc->origin + CUBIC_C * t * t * t;
+    if (target > cc->cwnd)
+        cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+    else
+        cc->cwnd += 0.01 * acked / cc->cwnd;
+
+    // Never grow slower than Reno would (TCP-friendly region)
+    cc->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cc->cwnd;
+    if (cc->w_est > cc->cwnd)
+        cc->cwnd = cc->w_est;
+}
+
+static void CubicLoss(BTcpCongestion *cc, uint64_t now) {
+    // Fast convergence: give way if the last plateau was not reached
+    if (cc->cwnd < cc->w_max)
+        cc->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    else
+        cc->w_max = cc->cwnd;
+    cc->ssthresh = fmax(cc->cwnd * CUBIC_BETA, MIN_WINDOW);
+    cc->cwnd = cc->ssthresh;
+    cc->epoch = 0;
+}
+
+static void CubicTimeout(BTcpCongestion *cc, uint64_t now) {
+    CubicLoss(cc, now);
+    cc->cwnd = 1.0;
+}
+
+static const BTcpCongestionOps algorithms[] = {
+    [CC_NONE] = {"none", NoneInit, NoneAck, NoneLoss, NoneLoss},
+    [CC_RENO] = {"reno", RenoInit, RenoAck, RenoLoss, RenoTimeout},
+    [CC_CUBIC] = {"cubic", CubicInit, CubicAck, CubicLoss, CubicTimeout},
+};
+
+#define ALGORITHMS (int)(sizeof algorithms / sizeof *algorithms)
+
+int BTCongestionInit(BTcpCongestion *cc, int algorithm) {
+    if (algorithm < 0 || algorithm >= ALGORITHMS)
+        return -1;
+    memset(cc, 0, sizeof *cc);
+    cc->ops = &algorithms[algorithm];
+    cc->ops->init(cc);
+    return 0;
+}
+
+int BTCongestionLookup(const char *name) {
+    for (int i = 0; i < ALGORITHMS; i++)
+        if (strcasecmp(name, algorithms[i].name) == 0)
+            return i;
+    return -1;
+}
+
+const char *BTCongestionName(int algorithm) {
+    if (algorithm < 0 || algorithm >= ALGORITHMS)
+        return NULL;
+    return algorithms[algorithm].name;
+}
@@ -0,0 +1,67 @@
+#ifndef __CONGESTION_H
+#define __CONGESTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Congestion control algorithms
+#define CC_NONE 0  // Receiver window only
+#define CC_RENO 1
+#define CC_CUBIC 2
+
+typedef struct _BTcpCongestion BTcpCongestion;
+
+// One algorithm, windows are counted in packets and times in microseconds
+typedef struct _BTcpCongestionOps {
+    const char *name;
+    void (*init)(BTcpCongestion *cc);
+
+    // $acked packets were newly acknowledged, $srtt is 0 while unknown
+    void (*on_ack)(BTcpCongestion *cc, uint32_t acked, uint64_t now, uint32_t srtt);
+
+    // Packets were found lost from the receiver's hints, once per window
+    void (*on_loss)(BTcpCongestion *cc, uint64_t now);
+
+    // Packets were found lost by the retransmission timer
+    void (*on_timeout)(BTcpCongestion *cc, uint64_t now);
+} BTcpCongestionOps;
+
+struct _BTcpCongestion {
+    const BTcpCongestionOps *ops;
+    double cwnd;
+    double ssthresh;
+
+    // CUBIC only
+    double w_max;     // Window before the last reduction
+    double k;         // Time to get back to $w_max, in seconds
+    double origin;    // Window the cubic function plateaus at
+    double w_est;     // What Reno would have by now
+    uint64_t epoch;   // Start of the current growth period, 0 if none
+};
+
+// Set up $cc to run $algorithm, -1 if there is no such algorithm
+int BTCongestionInit(BTcpCongestion *cc, int algorithm);
+
+// Algorithm by name, -1 if unknown
+int BTCongestionLookup(const char *name);
+
+const char *BTCongestionName(int algorithm);
+
+static inline void BTCongestionAck(BTcpCongestion *cc, uint32_t acked, uint64_t now, uint32_t srtt) {
+    cc->ops->on_ack(cc, acked, now, srtt);
+}
+
+static inline void BTCongestionLoss(BTcpCongestion *cc, uint64_t now) {
+    cc->ops->on_loss(cc, now);
+}
+
+static inline void BTCongestionTimeout(BTcpCongestion *cc, uint64_t now) {
+    cc->ops->on_timeout(cc, now);
+}
+
+// Packets that may be in flight, at least 1
+static inline size_t BTCongestionWindow(const BTcpCongestion *cc) {
+    return cc->cwnd >= 1.0 ? (size_t)cc->cwnd : 1;
+}
+
+#endif // __CONGESTION_H
@@ -0,0 +1,169 @@
+#include "crc32c.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// Castagnoli polynomial, bit-reversed
+#define POLY 0x82F63B78
+
+// Long buffers are cut into three streams of this many bytes each, run
+// side by side to hide the latency of the CRC instruction
+#define STRIDE 4096
+
+static uint32_t table[8][256];
+static uint32_t stride_shift;  // x^(8 * STRIDE) mod POLY
+static uint32_t (*update)(uint32_t crc, const uint8_t *p, size_t len);
+static const char *update_name;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+// $a * $b modulo POLY, both bit-reversed like the CRC itself
+static uint32_t MultModP(uint32_t a, uint32_t b) {
+    uint32_t m = 1U << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+// Slicing-by-8: eight table lookups per 8 bytes instead of one per byte
+static uint32_t UpdateTable(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;  // Little-endian only, as is the rest of the code
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+              table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+              table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+    }
+    while (len--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t UpdateSerial(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t UpdateHardware(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 3 * STRIDE; p += 3 * STRIDE, len -= 3 * STRIDE) {
+        uint64_t a = crc, b = 0, c = 0;
+        for (size_t i = 0; i < STRIDE; i += 8) {
+            uint64_t va, vb, vc;
+            memcpy(&va, p + i, 8);
+            memcpy(&vb, p + STRIDE + i, 8);
+            memcpy(&vc, p + 2 * STRIDE + i, 8);
+            a = _mm_crc32_u64(a, va);
+            b = _mm_crc32_u64(b, vb);
+            c = _mm_crc32_u64(c, vc);
+        }
+        // Running over STRIDE more bytes multiplies by stride_shift
+        crc = MultModP(stride_shift, MultModP(stride_shift, a) ^ b) ^ c;
+    }
+    return UpdateSerial(crc, p, len);
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t UpdateSerial(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+__attribute__((target("+crc")))
+static uint32_t UpdateHardware(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 3 * STRIDE; p += 3 * STRIDE, len -= 3 * STRIDE) {
+        uint32_t a = crc, b = 0, c = 0;
+        for (size_t i = 0; i < STRIDE; i += 8) {
+            uint64_t va, vb, vc;
+            memcpy(&va, p + i, 8);
+            memcpy(&vb, p + STRIDE + i, 8);
+            memcpy(&vc, p + 2 * STRIDE + i, 8);
+            a = __crc32cd(a, va);
+            b = __crc32cd(b, vb);
+            c = __crc32cd(c, vc);
+        }
+        crc = MultModP(stride_shift, MultModP(stride_shift, a) ^ b) ^ c;
+    }
+    return UpdateSerial(crc, p, len);
+}
+#endif
+
+static void Init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+
+    // x^8 is a byte's worth of shifting
+    uint32_t x8 = 1U << 23;
+    stride_shift = 1U << 31;  // x^0
+    for (int i = 0; i < STRIDE; i++)
+        stride_shift = MultModP(stride_shift, x8);
+
+    update = UpdateTable;
+    update_name = "table";
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        update = UpdateHardware;
+        update_name = "sse4.2";
+    }
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        update = UpdateHardware;
+        update_name = "armv8";
+    }
+#endif
+}
+
+uint32_t BTCrc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&once, Init);
+    return ~update(~crc, data, len);
+}
+
+uint32_t BTCrc32cPortable(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&once, Init);
+    return ~UpdateTable(~crc, data, len);
+}
+
+const char *BTCrc32cName(void) {
+    pthread_once(&once, Init);
+    return update_name;
+}
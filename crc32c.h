@@ -0,0 +1,18 @@
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of $len bytes at $data, continuing from $crc, which
+// is 0 to start with. Runs on the CPU's CRC instructions where there are
+// any (SSE4.2, ARMv8 CRC), checked once at run time.
+uint32_t BTCrc32c(uint32_t crc, const void *data, size_t len);
+
+// Same from lookup tables only, what BTCrc32c falls back to
+uint32_t BTCrc32cPortable(uint32_t crc, const void *data, size_t len);
+
+// What BTCrc32c runs on: "sse4.2", "armv8" or "table"
+const char *BTCrc32cName(void);
+
+#endif // __CRC32C_H
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "emulator.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define QUEUE_SIZE 8192
+#define MAX_DATAGRAM 65536
+
+// How often the relay thread looks at $stop when the link is idle
+#define IDLE_WAIT 10000
+
+static uint64_t NowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// xorshift64*, reproducible from run to run
+static double Random(Emulator *emu) {
+    emu->rng ^= emu->rng >> 12;
+    emu->rng ^= emu->rng << 25;
+    emu->rng ^= emu->rng >> 27;
+    return (emu->rng * 0x2545F4914F6CDD1DULL >> 11) * 0x1.0p-53;
+}
+
+static int QueueInit(EmulatorQueue *q) {
+    memset(q, 0, sizeof *q);
+    q->packets = calloc(QUEUE_SIZE, sizeof *q->packets);
+    q->size = QUEUE_SIZE;
+    return q->packets == NULL ? -1 : 0;
+}
+
+static void QueueFree(EmulatorQueue *q) {
+    for (size_t i = 0; i < q->count; i++)
+        free(q->packets[i].data);
+    free(q->packets);
+    q->packets = NULL;
+}
+
+static inline int Before(const EmulatorPacket *a, const EmulatorPacket *b) {
+    return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static void HeapPush(EmulatorQueue *q, EmulatorPacket packet) {
+    size_t i = q->count++;
+    packet.order = q->order++;
+    while (i > 0 && Before(&packet, &q->packets[(i - 1) / 2])) {
+        q->packets[i] = q->packets[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    q->packets[i] = packet;
+}
+
+static void HeapPop(EmulatorQueue *q) {
+    EmulatorPacket last = q->packets[--q->count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= q->count)
+            break;
+        if (child + 1 < q->count && Before(&q->packets[child + 1], &q->packets[child]))
+            child++;
+        if (!Before(&q->packets[child], &last))
+            break;
+        q->packets[i] = q->packets[child];
+        i = child;
+    }
+    q->packets[i] = last;
+}
+
+// Put a datagram on the link, or lose it
+static void Enqueue(Emulator *emu, EmulatorQueue *q, const uint8_t *data, size_t len, uint64_t now) {
+    const EmulatorConfig *config = &emu->config;
+    if (Random(emu) < config->loss || q->count == q->size) {
+        emu->dropped++;
+        return;
+    }
+    int copies = 1;
+    if (config->duplicate > 0 && Random(emu) < config->duplicate && q->count + 1 < q->size) {
+        copies = 2;
+        emu->duplicated++;
+    }
+    uint64_t due = now;
+    if (config->rate != 0) {
+        // Wait behind the backlog, drop-tail once the queue is full
+        uint64_t start = q->busy_until > now ? q->busy_until : now;
+        if (start - now > config->queue) {
+            emu->dropped++;
+            return;
+        }
+        q->busy_until = start + len * 1000000ULL / config->rate;
+        due = q->busy_until;
+    }
+    if (config->reorder > 0 && Random(emu) < config->reorder)
+        emu->reordered++;
+    else {
+        due += config->delay;
+        if (config->jitter > 0)
+            due += (uint64_t)(Random(emu) * config->jitter);
+    }
+    for (int i = 0; i < copies; i++) {
+        EmulatorPacket p = {due, 0, len, malloc(len ? len : 1)};
+        if (p.data == NULL) {
+            emu->dropped++;
+            return;
+        }
+        memcpy(p.data, data, len);
+        HeapPush(q, p);
+    }
+}
+
+// Send everything whose time has come
+static void Deliver(Emulator *emu, EmulatorQueue *q, int socket,
+                    const struct sockaddr_in *to, uint64_t now) {
+    while (q->count > 0 && q->packets[0].due <= now) {
+        EmulatorPacket *p = &q->packets[0];
+        sendto(socket, p->data, p->len, 0, (const struct sockaddr *)to, sizeof *to);
+        free(p->data);
+        HeapPop(q);
+        emu->forwarded++;
+    }
+}
+
+static void *EmulatorThread(void *arg) {
+    Emulator *emu = arg;
+    uint8_t *buf = malloc(MAX_DATAGRAM);
+    struct sockaddr_in sender = {0}, receiver;
+    socklen_t addrlen = sizeof receiver;
+    getpeername(emu->back, (struct sockaddr *)&receiver, &addrlen);
+    int have_sender = 0;
+
+    while (!emu->stop) {
+        uint64_t now = NowUs(), wait = IDLE_WAIT;
+        if (emu->forward.count > 0) {
+            uint64_t due = emu->forward.packets[0].due;
+            if (due < now + wait)
+                wait = due > now ? due - now : 0;
+        }
+        if (emu->reverse.count > 0) {
+            uint64_t due = emu->reverse.packets[0].due;
+            if (due < now + wait)
+                wait = due > now ? due - now : 0;
+        }
+        struct pollfd pfd[2] = {{emu->front, POLLIN, 0}, {emu->back, POLLIN, 0}};
+        struct timespec ts = {wait / 1000000, wait % 1000000 * 1000};
+        ppoll(pfd, 2, &ts, NULL);
+
+        now = NowUs();
+        ssize_t n;
+        while (1) {
+            addrlen = sizeof sender;
+            n = recvfrom(emu->front, buf, MAX_DATAGRAM, MSG_DONTWAIT, (struct sockaddr *)&sender, &addrlen);
+            if (n < 0)
+                break;
+            have_sender = 1;
+            Enqueue(emu, &emu->forward, buf, n, now);
+        }
+        while ((n = recv(emu->back, buf, MAX_DATAGRAM, MSG_DONTWAIT)) >= 0 || errno == ECONNREFUSED)
+            if (n >= 0)
+                Enqueue(emu, &emu->reverse, buf, n, now);
+
+        now = NowUs();
+        Deliver(emu, &emu->forward, emu->back, &receiver, now);
+        if (have_sender)
+            Deliver(emu, &emu->reverse, emu->front, &sender, now);
+    }
+    free(buf);
+    return NULL;
+}
+
+int EmulatorStart(Emulator *emu, unsigned short front_port, unsigned short back_port,
+                  const EmulatorConfig *config) {
+    memset(emu, 0, sizeof *emu);
+    emu->config = *config;
+    emu->rng = config->seed != 0 ? config->seed : 0x9E3779B97F4A7C15ULL ^ front_port;
+    struct sockaddr_in front = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+        .sin_port = htons(front_port)
+    }, back = front;
+    back.sin_port = htons(back_port);
+
+    emu->front = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    emu->back = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (emu->front < 0 || emu->back < 0 ||
+        bind(emu->front, (struct sockaddr *)&front, sizeof front) != 0 ||
+        connect(emu->back, (struct sockaddr *)&back, sizeof back) != 0) {
+        Logf(LOG_ERROR, "Failed to set up emulator sockets: %s", strerror(errno));
+        goto fail;
+    }
+    if (QueueInit(&emu->forward) != 0 || QueueInit(&emu->reverse) != 0) {
+        Log(LOG_ERROR, "Failed to allocate memory");
+        goto fail;
+    }
+    if (pthread_create(&emu->thread, NULL, EmulatorThread, emu) != 0) {
+        Log(LOG_ERROR, "Failed to start emulator thread");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (emu->front >= 0)
+        close(emu->front);
+    if (emu->back >= 0)
+        close(emu->back);
+    QueueFree(&emu->forward);
+    QueueFree(&emu->reverse);
+    return -1;
+}
+
+void EmulatorStop(Emulator *emu) {
+    emu->stop = 1;
+    pthread_join(emu->thread, NULL);
+    close(emu->front);
+    close(emu->back);
+    QueueFree(&emu->forward);
+    QueueFree(&emu->reverse);
+}
@@ -0,0 +1,53 @@
+#ifndef __EMULATOR_H
+#define __EMULATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Link conditions, applied to both directions independently
+typedef struct _EmulatorConfig {
+    double loss;         // Probability of dropping a datagram
+    uint32_t delay;      // One-way delay, in microseconds
+    uint64_t rate;       // Bytes per second, 0 for unlimited
+    uint32_t queue;      // Longest a datagram may wait for the link, in microseconds
+    uint32_t jitter;     // Extra delay picked uniformly up to this, in microseconds,
+                         // so datagrams may overtake each other
+    double reorder;      // Probability of a datagram skipping the delay and jitter,
+                         // overtaking whatever is in flight
+    double duplicate;    // Probability of delivering a datagram twice
+    uint64_t seed;       // Of the random choices, 0 to derive one from the port
+} EmulatorConfig;
+
+typedef struct _EmulatorPacket {
+    uint64_t due;        // When it leaves the link
+    uint64_t order;      // Keeps datagrams due at once in the order they came
+    size_t len;
+    uint8_t *data;
+} EmulatorPacket;
+
+// Datagrams on their way in one direction, a min-heap on when they are due
+typedef struct _EmulatorQueue {
+    EmulatorPacket *packets;
+    size_t size, count;
+    uint64_t order;
+    uint64_t busy_until;  // When the link finishes its current backlog
+} EmulatorQueue;
+
+// UDP relay in a thread of its own. The sender talks to $front_port, the
+// relay passes everything on to $back_port and the answers back again.
+typedef struct _Emulator {
+    EmulatorConfig config;
+    int front, back;      // Sockets facing the sender and the receiver
+    EmulatorQueue forward, reverse;
+    uint64_t rng;
+    uint64_t forwarded, dropped, duplicated, reordered;
+    volatile int stop;
+    pthread_t thread;
+} Emulator;
+
+int EmulatorStart(Emulator *emu, unsigned short front_port, unsigned short back_port,
+                  const EmulatorConfig *config);
+void EmulatorStop(Emulator *emu);
+
+#endif // __EMULATOR_H
@@ -0,0 +1,61 @@
+#include "fec.h"
+
+#include <string.h>
+
+// 32 bytes at a time: two SSE2 registers on a baseline x86-64 build, one
+// AVX2 register with -mavx2, NEON on arm64
+typedef uint8_t XorVector __attribute__((vector_size(32)));
+
+void BTFecXor(uint8_t *restrict dst, const uint8_t *restrict src, size_t len) {
+    size_t i = 0;
+    for (; i + sizeof(XorVector) <= len; i += sizeof(XorVector)) {
+        XorVector a, b;
+        memcpy(&a, dst + i, sizeof a);
+        memcpy(&b, src + i, sizeof b);
+        a ^= b;
+        memcpy(dst + i, &a, sizeof a);
+    }
+    for (; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+size_t BTFecBytes(size_t size, size_t payload_size) {
+    return size * sizeof(BTcpFecGroup) + size * payload_size;
+}
+
+void BTFecInitAt(BTcpFec *fec, size_t size, size_t payload_size, void *mem) {
+    fec->size = size;
+    fec->payload_size = payload_size;
+    fec->groups = mem;
+    fec->acc = (uint8_t *)mem + size * sizeof(BTcpFecGroup);
+    // An empty slot is as good as a fresh group, whichever key it gets
+    memset(mem, 0, BTFecBytes(size, payload_size));
+}
+
+BTcpFecGroup *BTFecGroup(BTcpFec *fec, uint32_t key) {
+    BTcpFecGroup *group = &fec->groups[key % fec->size];
+    if (group->key != key) {
+        group->key = key;
+        group->have = group->count = group->stride = group->len_xor = 0;
+        memset(BTFecAcc(fec, group), 0, fec->payload_size);
+    }
+    return group;
+}
+
+void BTFecAdd(BTcpFec *fec, BTcpFecGroup *group, const uint8_t *payload, uint16_t len) {
+    if (group->have == UINT16_MAX)
+        return;
+    BTFecXor(BTFecAcc(fec, group), payload, len);
+    group->len_xor ^= len;
+    group->have++;
+}
+
+void BTFecParity(BTcpFec *fec, BTcpFecGroup *group, const uint8_t *payload, uint16_t len,
+                 uint16_t count, uint16_t stride, uint16_t len_xor) {
+    if (group->have == UINT16_MAX || group->count != 0)
+        return;
+    BTFecXor(BTFecAcc(fec, group), payload, len);
+    group->len_xor ^= len_xor;
+    group->count = count;
+    group->stride = stride;
+}
@@ -0,0 +1,82 @@
+#ifndef __FEC_H
+#define __FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Forward error correction by interleaved XOR parity. The sender cuts a
+// message into blocks of N data packets and adds K parity packets to each:
+// parity j is the XOR of the data packets at block positions j, j+K, j+2K...
+// Any K losses in a row within a block, or more generally at most one per
+// parity group, can then be rebuilt without a retransmission.
+//
+// A data packet tells where it stands in its block with a tag, K in the
+// upper byte and its position in the lower one (0 without FEC). A group is
+// known by the sequence number of its first packet.
+
+#define FEC_MAX_BLOCK 255
+
+static inline uint16_t BTFecTag(size_t parity, size_t index) {
+    return (uint16_t)(parity << 8 | index);
+}
+
+// First packet of the group that packet $seq with tag $tag belongs to
+static inline uint32_t BTFecGroupOf(uint32_t seq, uint16_t tag) {
+    uint32_t index = tag & 0xFF, parity = tag >> 8;
+    return seq - index + index % parity;
+}
+
+// $dst ^= $src, $len bytes
+void BTFecXor(uint8_t *restrict dst, const uint8_t *restrict src, size_t len);
+
+// What the receiver knows about one parity group so far
+typedef struct _BTcpFecGroup {
+    uint32_t key;       // First packet of the group
+    uint16_t have;      // Data packets folded in
+    uint16_t count;     // Data packets in the group, 0 until its parity is in
+    uint16_t stride;
+    uint16_t len_xor;   // Of the data lengths folded in, and of the parity's
+} BTcpFecGroup;
+
+// Groups in flight, one slot per sequence number modulo $size, each with
+// an accumulator of $payload_size bytes. Groups of a window never share a
+// slot if $size is at least the window.
+typedef struct _BTcpFec {
+    size_t size;
+    size_t payload_size;
+    BTcpFecGroup *groups;
+    uint8_t *acc;
+} BTcpFec;
+
+// Bytes BTFecInitAt needs, laid out like BTWindowInitAt
+size_t BTFecBytes(size_t size, size_t payload_size);
+void BTFecInitAt(BTcpFec *fec, size_t size, size_t payload_size, void *mem);
+
+// The slot of group $key, emptied first if another group had it
+BTcpFecGroup *BTFecGroup(BTcpFec *fec, uint32_t key);
+
+static inline uint8_t *BTFecAcc(const BTcpFec *fec, const BTcpFecGroup *group) {
+    return fec->acc + (group - fec->groups) * fec->payload_size;
+}
+
+// Fold a data packet into its group
+void BTFecAdd(BTcpFec *fec, BTcpFecGroup *group, const uint8_t *payload, uint16_t len);
+
+// Fold in the group's parity: $count data packets $stride apart, whose
+// lengths XOR to $len_xor
+void BTFecParity(BTcpFec *fec, BTcpFecGroup *group, const uint8_t *payload, uint16_t len,
+                 uint16_t count, uint16_t stride, uint16_t len_xor);
+
+// Once the parity and all but one data packet are in, the accumulator
+// holds the missing one: returns its length, or -1 if it is not there yet
+static inline int BTFecReady(const BTcpFecGroup *group) {
+    return group->count != 0 && group->have + 1 == group->count ? group->len_xor : -1;
+}
+
+// Forget the group, after it has been rebuilt
+static inline void BTFecDone(BTcpFecGroup *group) {
+    group->count = 0;
+    group->have = UINT16_MAX;  // Never ready again
+}
+
+#endif // __FEC_H
@@ -1,14 +1,77 @@
 #include "help.h"
 
 const char *HELP =
-"Usage: btsend [-a address] [-p port] [-l log_level] <file>\n"
-"       btrecv [-a address] [-p port] [-l log_level] <file>\n"
+"Usage: btsend [-a address] [-p port] [-c algorithm]\n"
+"              [-s [-k] | -R [-k] | -n streams | -z]\n"
+"              [-f block[:parity]] [-r mode[:rate]] [-u] [-i seconds]\n"
+"              [-j file] [-l log_level] <file>\n"
+"       btrecv [-a address] [-p port] [-s [-k] | -R [-k] | -m count | -n streams]\n"
+"              [-t threads] [-P cpus] [-f block] [-u] [-i seconds] [-j file]\n"
+"              [-l log_level] <file>\n"
 "Options:\n"
 "  -a <address>, --address=<address>\n"
 "            Send to or listen at the specified address\n"
 "            Default: 127.0.0.1\n"
 "  -p <port>, --port=<port>\n"
 "            Specify the port number, default 6666\n"
+"  -c <algorithm>, --congestion=<algorithm>\n"
+"            Congestion control for sending, valid algorithms are\n"
+"              none, reno, cubic (default)\n"
+"  -s, --stream\n"
+"            Send the whole file as one stream through a memory mapping,\n"
+"            both ends must agree on this\n"
+"  -R, --resume\n"
+"            Like -s, and the receiver notes what arrived in <file>.btresume\n"
+"            as it goes, so that a transfer cut short and run again with -R\n"
+"            only sends what is missing. Starts over if the file changed.\n"
+"            Both ends must agree on this\n"
+"  -k, --verify\n"
+"            With -s, end the stream with a CRC32C of all of it, which the\n"
+"            receiver checks against its own. With -R the same for the\n"
+"            whole file. Both ends must agree on this\n"
+"  -n <streams>, --streams=<streams>\n"
+"            Split the file into this many ranges and send them at once,\n"
+"            each over a connection of its own, up to 255. Both ends must\n"
+"            agree on this\n"
+"  -z, --compress\n"
+"            Send the file as LZ4-compressed blocks of 64 KiB, unpacked by\n"
+"            the receiver on a thread of its own. Blocks that do not\n"
+"            shrink go as they are. Receivers take them unless run with -s,\n"
+"            -m or -n, else the file goes uncompressed (btsend only)\n"
+"  -m <count>, --multi=<count>\n"
+"            Take uploads from many senders at once, each saved as\n"
+"              <file>.<address>-<port>-<sport>\n"
+"            and exit after <count> of them, 0 for never (btrecv only)\n"
+"  -t <threads>, --threads=<threads>\n"
+"            With -m or -n, share the port among this many threads, each\n"
+"            serving its own set of senders. Default 1\n"
+"  -P <cpus>, --pin=<cpus>\n"
+"            With -m or -n, pin the threads to these CPUs in turn, given as a\n"
+"            comma-separated list such as 0,2,4\n"
+"  -f <block>[:<parity>], --fec=<block>[:<parity>]\n"
+"            Follow every <block> packets with <parity> (default 1) parity\n"
+"            packets, up to 255, so that as many lost in a row can be\n"
+"            rebuilt without a retransmission. The receiver needs -f as well\n"
+"            (any <block>), else nothing changes. Not with btrecv -m or -n\n"
+"  -r <mode>[:<rate>], --pacing=<mode>[:<rate>]\n"
+"            Spread the packets a window allows over the round trip\n"
+"            instead of sending them back to back (btsend only):\n"
+"              off\n"
+"              user    hold them back until due (default)\n"
+"              txtime  also hand their departure times to the kernel,\n"
+"                      which needs the fq qdisc on the outgoing device\n"
+"            at <rate> Mbit/s if given, else following the congestion\n"
+"            window\n"
+"  -u, --io-uring\n"
+"            Submit and reap datagrams in batches through io_uring where\n"
+"            the kernel allows it. The multi-flow receiver (btrecv -m or -n)\n"
+"            stays on recvmmsg\n"
+"  -i <seconds>, --interval=<seconds>\n"
+"            Print a summary of the connection's counters to stderr this\n"
+"            often. Not with btrecv -m or -n\n"
+"  -j <file>, --json=<file>\n"
+"            Write all counters of every connection and their sum to\n"
+"            <file> as JSON at exit, - for stdout. Not with btrecv -m or -n\n"
 "  -l <level>, --log-level=<level>\n"
 "            Set logging level (verbosity), valid levels are\n"
 "              debug, info, warn (default), error, critical\n"
@@ -1,10 +1,21 @@
+#define _GNU_SOURCE
 #include "logging.h"
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
-static int log_level = LOG_WARNING; // Default logging level
+int log_level = LOG_WARNING; // Default logging level
 static int log_color = 1; // Log with color
 static FILE *log_file = NULL;
 static const struct {
@@ -18,6 +29,38 @@ static const struct {
     {"\e[35m[F]\e[0m", "[F]"}
 };
 
+// One message waiting for the logging thread: the format as it was passed
+// (a string literal, so it outlives the call) and the raw arguments behind
+// it, 8 bytes each, strings copied in
+typedef struct _LogRecord {
+    uint32_t seq;        // Which lap of the ring the record belongs to
+    uint8_t level;
+    uint8_t truncated;   // Arguments that did not fit are left out
+    uint16_t count;      // # of conversions with their arguments in data
+    const char *format;  // NULL if data is the message itself
+    uint8_t data[240];
+} __attribute__((aligned(64))) LogRecord;
+
+// Many producers, one consumer, without locks: a producer claims a record
+// by moving tail, fills it in and marks it ready through its seq
+static struct {
+    LogRecord *records;
+    uint32_t tail __attribute__((aligned(64)));  // Next record to claim
+    uint32_t waiting;                            // The thread sleeps on tail
+    size_t dropped;
+    uint32_t head __attribute__((aligned(64)));  // Next record to write out
+    int stopping;
+    pthread_t thread;
+} ring;
+static int log_async = 0;
+
+// How long the thread lets messages pile up after a batch, in nanoseconds,
+// so that busy producers rarely have to wake it
+#define LOG_BATCH_DELAY 1000000
+
+// Bytes the thread collects before writing them out
+#define LOG_BATCH_BYTES 65536
+
 void SetLogLevel(int level) {
     log_level = level;
 }
@@ -35,22 +78,418 @@ static inline const char *GetLogPrefix(int level) {
     }
 }
 
-void Log(int level, const char* message) {
+// One conversion of a printf format
+typedef struct _LogSpec {
+    const char *start;   // The '%'
+    const char *length;  // Where the length modifier is, or would be
+    const char *end;     // Past the conversion character
+    char size;           // 'H' for hh, 'q' for ll, else the modifier or 0
+    char conv;
+    int stars;           // * widths and precisions, an int argument each
+} LogSpec;
+
+// The first conversion at or after $p, NULL if there is none
+static const char *NextSpec(const char *p, LogSpec *spec) {
+    while (*p != '\0' && *p != '%')
+        p++;
+    if (*p == '\0')
+        return NULL;
+    spec->start = p++;
+    spec->stars = 0;
+    while (*p != '\0' && strchr("-+ #0123456789.*", *p) != NULL)
+        spec->stars += *p++ == '*';
+    spec->length = p;
+    spec->size = 0;
+    if (p[0] == 'h' && p[1] == 'h') {
+        spec->size = 'H';
+        p += 2;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        spec->size = 'q';
+        p += 2;
+    } else if (*p != '\0' && strchr("hlzjtL", *p) != NULL)
+        spec->size = *p++;
+    spec->conv = *p;
+    if (*p != '\0')
+        p++;
+    spec->end = p;
+    return spec->start;
+}
+
+static int Put(LogRecord *rec, size_t *len, const void *value, size_t n) {
+    if (*len + n > sizeof rec->data)
+        return -1;
+    memcpy(rec->data + *len, value, n);
+    *len += n;
+    return 0;
+}
+
+// Returns 1 if only the start of $s fits, -1 if none of it does
+static int PutString(LogRecord *rec, size_t *len, const char *s) {
+    if (s == NULL)
+        s = "(null)";
+    size_t n = strlen(s) + 1;
+    if (*len + n > sizeof rec->data) {
+        // Keep what fits, the argument is the last one anyway
+        n = sizeof rec->data - *len;
+        if (n < 2)
+            return -1;
+        memcpy(rec->data + *len, s, n - 1);
+        rec->data[*len + n - 1] = '\0';
+        *len += n;
+        return 1;
+    }
+    memcpy(rec->data + *len, s, n);
+    *len += n;
+    return 0;
+}
+
+// Copy the arguments of $format into $rec, as far as they fit
+static void Pack(LogRecord *rec, const char *format, va_list ap, int saved_errno) {
+    LogSpec spec;
+    size_t len = 0;
+    rec->format = format;
+    rec->count = 0;
+    rec->truncated = 0;
+    for (const char *p = format; NextSpec(p, &spec) != NULL; p = spec.end, rec->count++) {
+        int fits = 0;
+        for (int i = 0; i < spec.stars && fits == 0; i++) {
+            int64_t v = va_arg(ap, int);
+            fits = Put(rec, &len, &v, sizeof v);
+        }
+        if (fits != 0) {
+            rec->truncated = 1;
+            return;
+        }
+        int64_t i;
+        uint64_t u;
+        double d;
+        switch (spec.conv) {
+            case 'd': case 'i':
+                switch (spec.size) {
+                    case 'H': i = (signed char)va_arg(ap, int); break;
+                    case 'h': i = (short)va_arg(ap, int); break;
+                    case 'l': i = va_arg(ap, long); break;
+                    case 'q': i = va_arg(ap, long long); break;
+                    case 'z': i = va_arg(ap, ssize_t); break;
+                    case 'j': i = va_arg(ap, intmax_t); break;
+                    case 't': i = va_arg(ap, ptrdiff_t); break;
+                    default: i = va_arg(ap, int); break;
+                }
+                fits = Put(rec, &len, &i, sizeof i);
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                switch (spec.size) {
+                    case 'H': u = (unsigned char)va_arg(ap, unsigned); break;
+                    case 'h': u = (unsigned short)va_arg(ap, unsigned); break;
+                    case 'l': u = va_arg(ap, unsigned long); break;
+                    case 'q': u = va_arg(ap, unsigned long long); break;
+                    case 'z': u = va_arg(ap, size_t); break;
+                    case 'j': u = va_arg(ap, uintmax_t); break;
+                    case 't': u = va_arg(ap, ptrdiff_t); break;
+                    default: u = va_arg(ap, unsigned); break;
+                }
+                fits = Put(rec, &len, &u, sizeof u);
+                break;
+            case 'c':
+                i = va_arg(ap, int);
+                fits = Put(rec, &len, &i, sizeof i);
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                d = spec.size == 'L' ? va_arg(ap, long double) : va_arg(ap, double);
+                fits = Put(rec, &len, &d, sizeof d);
+                break;
+            case 'p':
+                u = (uintptr_t)va_arg(ap, void *);
+                fits = Put(rec, &len, &u, sizeof u);
+                break;
+            case 's':
+                fits = PutString(rec, &len, va_arg(ap, const char *));
+                break;
+            case 'm':
+                fits = PutString(rec, &len, strerror(saved_errno));
+                break;
+            case 'n':
+                va_arg(ap, void *);  // Nothing to store to later
+                break;
+            case '%':
+                break;
+            default:
+                fits = -1;
+                break;
+        }
+        if (fits != 0) {
+            rec->truncated = 1;
+            if (fits > 0)
+                rec->count++;  // With what fitted of the string
+            return;
+        }
+    }
+}
+
+// Append to $out what fits, like snprintf
+static size_t Append(char *out, size_t size, size_t len, const char *format, ...) {
+    if (len >= size)
+        return len;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(out + len, size - len, format, args);
+    va_end(args);
+    if (n < 0)
+        return len;
+    return len + n < size ? len + n : size - 1;
+}
+
+// Format $rec into $out as one line, the way LogFormat would have
+static size_t Render(const LogRecord *rec, char *out, size_t size) {
+    size_t len = Append(out, size, 0, "%s ", GetLogPrefix(rec->level));
+    if (rec->format == NULL) {
+        len = Append(out, size, len, "%s%s\n", (const char *)rec->data, rec->truncated ? "..." : "");
+        return len;
+    }
+
+    const uint8_t *data = rec->data;
+    const char *p = rec->format;
+    LogSpec spec;
+    for (int n = 0; n < rec->count && NextSpec(p, &spec) != NULL; n++, p = spec.end) {
+        len = Append(out, size, len, "%.*s", (int)(spec.start - p), p);
+
+        // The conversion without its length modifier, which the stored
+        // arguments no longer need, "ll" for all the integers
+        char fmt[32];
+        size_t flags = spec.length - spec.start;
+        if (flags > sizeof fmt - 4)
+            flags = sizeof fmt - 4;
+        memcpy(fmt, spec.start, flags);
+        char conv = spec.conv == 'm' ? 's' : spec.conv;
+        if (strchr("diuoxX", conv) != NULL) {
+            fmt[flags++] = 'l';
+            fmt[flags++] = 'l';
+        }
+        fmt[flags++] = conv;
+        fmt[flags] = '\0';
+
+        int star[2] = {0, 0};
+        for (int i = 0; i < spec.stars && i < 2; i++, data += 8) {
+            int64_t v;
+            memcpy(&v, data, sizeof v);
+            star[i] = v;
+        }
+        int64_t v;
+        double d;
+        switch (conv) {
+            case '%':
+                len = Append(out, size, len, "%%");
+                continue;
+            case 'n':
+                continue;
+            case 's':
+                len = spec.stars == 0 ? Append(out, size, len, fmt, (const char *)data) :
+                      spec.stars == 1 ? Append(out, size, len, fmt, star[0], (const char *)data) :
+                                        Append(out, size, len, fmt, star[0], star[1], (const char *)data);
+                data += strlen((const char *)data) + 1;
+                continue;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                memcpy(&d, data, sizeof d);
+                data += sizeof d;
+                len = spec.stars == 0 ? Append(out, size, len, fmt, d) :
+                      spec.stars == 1 ? Append(out, size, len, fmt, star[0], d) :
+                                        Append(out, size, len, fmt, star[0], star[1], d);
+                continue;
+            case 'p':
+                memcpy(&v, data, sizeof v);
+                data += sizeof v;
+                len = spec.stars == 0 ? Append(out, size, len, fmt, (void *)(uintptr_t)v) :
+                                        Append(out, size, len, fmt, star[0], (void *)(uintptr_t)v);
+                continue;
+            case 'c':
+                memcpy(&v, data, sizeof v);
+                data += sizeof v;
+                len = spec.stars == 0 ? Append(out, size, len, fmt, (int)v) :
+                                        Append(out, size, len, fmt, star[0], (int)v);
+                continue;
+            default:
+                memcpy(&v, data, sizeof v);
+                data += sizeof v;
+                len = spec.stars == 0 ? Append(out, size, len, fmt, (long long)v) :
+                      spec.stars == 1 ? Append(out, size, len, fmt, star[0], (long long)v) :
+                                        Append(out, size, len, fmt, star[0], star[1], (long long)v);
+                continue;
+        }
+    }
+    if (rec->truncated)
+        len = Append(out, size, len, "...");
+    else
+        len = Append(out, size, len, "%s", p);
+    len = Append(out, size, len, "\n");
+    out[len - 1] = '\n';  // Even if the line was cut short
+    return len;
+}
+
+// A record for the caller to fill in, NULL if the ring is full
+static LogRecord *Claim(uint32_t *pos) {
+    uint32_t at = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+    for (;;) {
+        LogRecord *rec = &ring.records[at & (LOG_RING_SIZE - 1)];
+        int32_t lap = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - at;
+        if (lap == 0) {
+            if (__atomic_compare_exchange_n(&ring.tail, &at, at + 1, 1,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                *pos = at;
+                return rec;
+            }
+        } else if (lap < 0) {
+            // Still holds a message from the last lap
+            __atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else
+            at = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+    }
+}
+
+static void Publish(LogRecord *rec, uint32_t pos) {
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&ring.waiting, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &ring.tail, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Write out every record that is ready, in order. Returns how many.
+static size_t Drain(void) {
+    static char out[LOG_BATCH_BYTES];
+    size_t len = 0, n = 0;
+    for (;;) {
+        uint32_t pos = ring.head;
+        LogRecord *rec = &ring.records[pos & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            // Claimed but not filled in yet, it will not take long
+            if (__atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST) != pos) {
+                sched_yield();
+                continue;
+            }
+            break;
+        }
+        if (len > sizeof out - 1024) {
+            fwrite(out, 1, len, log_file);
+            len = 0;
+        }
+        len += Render(rec, out + len, 1024);
+        __atomic_store_n(&rec->seq, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring.head, pos + 1, __ATOMIC_RELAXED);
+        n++;
+    }
+    if (len > 0) {
+        fwrite(out, 1, len, log_file);
+        fflush(log_file);
+    }
+    return n;
+}
+
+static void *LogThread(void *arg) {
+    const struct timespec delay = {0, LOG_BATCH_DELAY};
+    for (;;) {
+        // Keep going while the ring is busy, else let it fill up a little
+        size_t n = Drain();
+        if (n >= LOG_RING_SIZE / 4)
+            continue;
+        if (n > 0) {
+            nanosleep(&delay, NULL);
+            continue;
+        }
+        if (__atomic_load_n(&ring.stopping, __ATOMIC_ACQUIRE))
+            break;
+        uint32_t seen = ring.head;
+        __atomic_store_n(&ring.waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST) == seen &&
+            !__atomic_load_n(&ring.stopping, __ATOMIC_ACQUIRE))
+            syscall(SYS_futex, &ring.tail, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+        __atomic_store_n(&ring.waiting, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int StartLogThread(void) {
+    if (log_async)
+        return 0;
+    if (log_file == NULL)
+        SetLogStream(stderr);
+    ring.records = aligned_alloc(64, LOG_RING_SIZE * sizeof(LogRecord));
+    if (ring.records == NULL)
+        return -1;
+    for (uint32_t i = 0; i < LOG_RING_SIZE; i++)
+        ring.records[i].seq = i;
+    ring.head = ring.tail = ring.waiting = 0;
+    ring.stopping = 0;
+    ring.dropped = 0;
+    if (pthread_create(&ring.thread, NULL, LogThread, NULL) != 0) {
+        free(ring.records);
+        ring.records = NULL;
+        return -1;
+    }
+    static int registered = 0;
+    if (!registered) {
+        atexit(StopLogThread);
+        registered = 1;
+    }
+    __atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void StopLogThread(void) {
+    if (!log_async)
+        return;
+    __atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring.stopping, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &ring.tail, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    pthread_join(ring.thread, NULL);
+    free(ring.records);
+    ring.records = NULL;
+    if (ring.dropped > 0)
+        Logf(LOG_WARNING, "%zu log messages dropped, the ring was full", ring.dropped);
+}
+
+size_t LogDropped(void) {
+    return __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+}
+
+void LogMessage(int level, const char* message) {
     if (level < log_level)
         return;
+    if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+        uint32_t pos;
+        LogRecord *rec = Claim(&pos);
+        if (rec != NULL) {
+            rec->level = level;
+            rec->format = NULL;
+            size_t len = 0;
+            rec->truncated = PutString(rec, &len, message) != 0;
+            Publish(rec, pos);
+        }
+        return;
+    }
     if (log_file == NULL)
         SetLogStream(stderr);
     fprintf(log_file, "%s %s\n", GetLogPrefix(level), message);
 }
 
-void Logf(int level, const char* format, ...) {
+void LogFormat(int level, const char* format, ...) {
     if (level < log_level)
         return;
+    int saved_errno = errno;
+    va_list args;
+    va_start(args, format);
+    if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+        uint32_t pos;
+        LogRecord *rec = Claim(&pos);
+        if (rec != NULL) {
+            rec->level = level;
+            Pack(rec, format, args, saved_errno);
+            Publish(rec, pos);
+        }
+        va_end(args);
+        return;
+    }
     if (log_file == NULL)
         SetLogStream(stderr);
     fprintf(log_file, "%s ", GetLogPrefix(level));
-    va_list args;
-    va_start(args, format);
     vfprintf(log_file, format, args);
     va_end(args);
     fputc('\n', log_file);
@@ -2,6 +2,7 @@
 #define __LOGGING_H
 
 #include <stdio.h>
+#include <stddef.h>
 
 #define LOG_DEBUG 0
 #define LOG_INFO 1
@@ -11,10 +12,44 @@
 #define LOG_FATAL 4
 #define LOG_CRITICAL 4
 
+// Messages below this level are compiled out, arguments and all. Build with
+// e.g. CFLAGS+=-DLOG_MIN_LEVEL=LOG_INFO to drop the per-packet tracing.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+// Records held for the logging thread, a power of 2
+#define LOG_RING_SIZE 4096
+
+extern int log_level;
+
+// Whether a message of $level would go anywhere. Log and Logf check this
+// before evaluating their arguments.
+#define LogEnabled(level) ((level) >= LOG_MIN_LEVEL && (level) >= log_level)
+
+#define Log(level, message) \
+    do { if (LogEnabled(level)) LogMessage(level, message); } while (0)
+#define Logf(level, ...) \
+    do { if (LogEnabled(level)) LogFormat(level, __VA_ARGS__); } while (0)
+
 void SetLogLevel(int level);
 void SetLogStream(FILE* stream);
 
-void Log(int level, const char* message);
-void Logf(int level, const char* format, ...);
+void LogMessage(int level, const char* message);
+void LogFormat(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// Hand messages to a thread of their own from now on. Callers only copy
+// the format and its arguments into a lock-free ring, and the thread does
+// the formatting and writing. Messages that find the ring full are dropped
+// and counted. Returns -1 if the thread cannot be started, logging then
+// stays synchronous.
+int StartLogThread(void);
+
+// Write out what is left in the ring and go back to logging synchronously.
+// Also runs at exit.
+void StopLogThread(void);
+
+// Messages lost to a full ring since StartLogThread
+size_t LogDropped(void);
 
 #endif // __LOGGING_H
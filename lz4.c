@@ -0,0 +1,199 @@
+#include "lz4.h"
+
+#include <string.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // Every block ends on this many literals,
+#define MF_LIMIT 12      // and no match starts closer to its end than this
+#define MAX_OFFSET 65535
+
+#define HASH_LOG 12
+
+// Misses in a row, as a power of 2, before the search starts stepping
+// over more than a byte at a time. Incompressible data goes by quickly.
+#define SKIP_TRIGGER 6
+
+static inline uint32_t Read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t Read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t Hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Copy 8 bytes at a time from $s to $d up to $stop, overrunning it by up
+// to 7 bytes on both ends. Cheaper than memcpy for the short runs at hand.
+static inline void WildCopy(uint8_t *d, const uint8_t *s, const uint8_t *stop) {
+    do {
+        memcpy(d, s, 8);
+        d += 8;
+        s += 8;
+    } while (d < stop);
+}
+
+// Bytes $a and $b have in common, $a going no further than $end
+static size_t MatchLength(const uint8_t *a, const uint8_t *b, const uint8_t *end) {
+    const uint8_t *start = a;
+    while (a + 8 <= end) {
+        uint64_t diff = Read64(a) ^ Read64(b);
+        if (diff != 0)
+            return a - start + (__builtin_ctzll(diff) >> 3);  // Little-endian
+        a += 8;
+        b += 8;
+    }
+    while (a < end && *a == *b)
+        a++, b++;
+    return a - start;
+}
+
+// The part of a length beyond the 15 that fit in the token
+static uint8_t *PutLength(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+// A sequence: $lit literals from $anchor, then a match of $match bytes
+// $offset back, or none if $match is 0. NULL if it overruns $end.
+static uint8_t *PutSequence(uint8_t *op, uint8_t *end, const uint8_t *anchor, size_t lit,
+                            size_t offset, size_t match) {
+    if ((size_t)(end - op) < 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1)
+        return NULL;
+    uint8_t *token = op++;
+    if (lit >= 15) {
+        *token = 15 << 4;
+        op = PutLength(op, lit - 15);
+    } else {
+        *token = lit << 4;
+    }
+    if (match == 0) {
+        memcpy(op, anchor, lit);
+        return op + lit;
+    }
+    // Literals before a match end MF_LIMIT bytes short of the input
+    if ((size_t)(end - op) >= lit + 8)
+        WildCopy(op, anchor, op + lit);
+    else
+        memcpy(op, anchor, lit);
+    op += lit;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    match -= MIN_MATCH;
+    if (match >= 15) {
+        *token |= 15;
+        op = PutLength(op, match - 15);
+    } else {
+        *token |= match;
+    }
+    return op;
+}
+
+size_t BTLz4Compress(const void *src, size_t len, void *dst, size_t size) {
+    const uint8_t *const base = src, *const end = base + len;
+    const uint8_t *ip = base, *anchor = base;
+    uint8_t *op = dst, *const op_end = op + size;
+
+    if (len > MF_LIMIT) {
+        const uint8_t *const mf_limit = end - MF_LIMIT;
+        const uint8_t *const match_limit = end - LAST_LITERALS;
+        uint32_t table[1 << HASH_LOG];  // Last position of each hash
+        memset(table, 0, sizeof table);
+        ip++;
+        while (ip < mf_limit) {
+            const uint8_t *match;
+            unsigned attempts = 1 << SKIP_TRIGGER;
+            for (;;) {
+                uint32_t h = Hash(Read32(ip));
+                match = base + table[h];
+                table[h] = ip - base;
+                if (match < ip && ip - match <= MAX_OFFSET && Read32(match) == Read32(ip))
+                    break;
+                ip += attempts++ >> SKIP_TRIGGER;
+                if (ip >= mf_limit)
+                    goto last;
+            }
+            while (ip > anchor && match > base && ip[-1] == match[-1])
+                ip--, match--;
+            size_t length = MIN_MATCH + MatchLength(ip + MIN_MATCH, match + MIN_MATCH, match_limit);
+            op = PutSequence(op, op_end, anchor, ip - anchor, ip - match, length);
+            if (op == NULL)
+                return 0;
+            ip += length;
+            anchor = ip;
+            if (ip < mf_limit)
+                table[Hash(Read32(ip - 2))] = ip - 2 - base;
+        }
+    }
+last:
+    op = PutSequence(op, op_end, anchor, end - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+    return op - (uint8_t *)dst;
+}
+
+// Add the extra bytes of a length to $len, -1 if the block ends first
+static int GetLength(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    unsigned b;
+    do {
+        if (*ip >= end)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int BTLz4Decompress(const void *src, size_t len, void *dst, size_t size) {
+    const uint8_t *ip = src, *const end = ip + len;
+    uint8_t *const base = dst, *op = base, *const op_end = base + size;
+
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && GetLength(&ip, end, &lit) != 0)
+            return -1;
+        if (lit > (size_t)(end - ip) || lit > (size_t)(op_end - op))
+            return -1;
+        if ((size_t)(end - ip) >= lit + 8 && (size_t)(op_end - op) >= lit + 8)
+            WildCopy(op, ip, op + lit);
+        else
+            memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == end)
+            break;  // The last sequence has literals only
+
+        if (end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && GetLength(&ip, end, &match) != 0)
+            return -1;
+        match += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - base) || match > (size_t)(op_end - op))
+            return -1;
+        const uint8_t *from = op - offset;
+        if (offset >= 8 && (size_t)(op_end - op) >= match + 8) {
+            // Even overlapping, each 8-byte step reads what is already there
+            WildCopy(op, from, op + match);
+            op += match;
+        } else if (offset >= match) {
+            memcpy(op, from, match);
+            op += match;
+        } else {
+            for (size_t i = 0; i < match; i++)
+                *op++ = *from++;
+        }
+    }
+    return op == op_end ? 0 : -1;
+}
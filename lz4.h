@@ -0,0 +1,25 @@
+#ifndef __LZ4_H
+#define __LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Independent blocks in the LZ4 block format, greedy and single pass, for
+// data that has to keep up with the link rather than shrink the most.
+// Blocks refer to nothing outside themselves, so any number of them can
+// be unpacked side by side.
+
+// Bytes a block of $len bytes takes at most, compressed
+#define BT_LZ4_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Compress $len bytes at $src into at most $size bytes at $dst. Returns
+// the compressed length, 0 if it does not fit: pass $len - 1 or less as
+// $size to give up on data that will not shrink.
+size_t BTLz4Compress(const void *src, size_t len, void *dst, size_t size);
+
+// Expand the $len byte block at $src into exactly $size bytes at $dst.
+// Returns -1 on anything malformed or of another size, never reading or
+// writing out of bounds.
+int BTLz4Decompress(const void *src, size_t len, void *dst, size_t size);
+
+#endif // __LZ4_H
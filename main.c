@@ -1,4 +1,9 @@
+#define _GNU_SOURCE
 #include "btcp.h"
+#include "crc32c.h"
+#include "lz4.h"
+#include "server.h"
+#include "ring.h"
 #include "logging.h"
 #include "help.h"
 
@@ -6,75 +11,1370 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
 #include <getopt.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
 
 #define ACTION_MAIN 0
 #define ACTION_HELP 1
 #define ACTION_VERSION 2
 
+// Chunked mode: bytes per BTSend/BTRecv, and how many chunks the disk
+// thread may run ahead or behind
+#define CHUNK_SIZE (1UL << 16)
+#define RING_BUFFERS 16
+
+// With -z chunks go as blocks of their own: the chunk LZ4-compressed, or
+// as it is if that does not save a 1/MIN_SAVING of it. A chunk that fails
+// to shrink has the next 1, 2, 4... up to MAX_BYPASS chunks go as they
+// are untried, so incompressible data costs little.
+//
+// A BTRecv has to ask for exactly what the BTSend on the other end gave,
+// so each block is sent followed by the header of the next one, and the
+// receiver always knows how much comes. The first BTSend is a lone
+// header, the last block is followed by one of all zeros.
+typedef struct _BlockHeader {
+    uint32_t len;      // Bytes of the block, big-endian, BLOCK_LZ4 if compressed
+    uint32_t raw_len;  // Bytes of the chunk, big-endian
+} BlockHeader;
+
+#define BLOCK_LZ4 0x80000000U
+#define BLOCK_SIZE (CHUNK_SIZE + 2 * sizeof(BlockHeader))  // With both headers
+#define MIN_SAVING 32
+#define MAX_BYPASS 16
+
+// With -R the receiver keeps a bit per segment of the file in
+// <file>.btresume, set once the segment is synced to disk, and sends the
+// bits to the sender first thing, so a transfer run again only moves the
+// segments missing. The rest goes in pieces of up to RESUME_PIECE bytes,
+// each checkpointed as it completes.
+#define RESUME_SEGMENT (1UL << 20)
+#define RESUME_PIECE (64 * RESUME_SEGMENT)
+#define RESUME_SUFFIX ".btresume"
+#define RESUME_MAGIC "BTRESUM1"
+
 static struct _GlobalOptions {
     int action;
     in_addr_t addr;
     unsigned short port;
     const char *filename;
     int logLevel;
+    int congestion;
+    int stream;
+    int uring;
+    int fec_block, fec_parity;
+    int pacing;
+    uint64_t pacing_rate;  // Bytes per second, 0 to follow the window
+    int verify;
+    int compress;
+    int resume;
+    double interval;  // Seconds between summaries, 0 for none
+    const char *json;  // Where to dump the counters at exit, NULL for nowhere
+    int multi;
+    unsigned long streams;  // Striped over this many connections, 0 for off
+    unsigned long flows;  // Uploads to take before exiting, 0 for no limit
+    unsigned long threads;
+    int cpus[CPU_SETSIZE];
+    size_t ncpus;
 } GlobalOptions = {
     .action = ACTION_MAIN,
     .addr = 0,
     .port = 6666,
-    .logLevel = LOG_WARNING
+    .logLevel = LOG_WARNING,
+    .congestion = CC_CUBIC,
+    .pacing = PACING_USER,
+    .threads = 1
 };
 
-static const char *const cliArgs = "A:a:hl:p:Vv";
+static const char *const cliArgs = "A:a:c:f:hi:j:kl:m:n:P:p:Rr:st:uVvz";
 static const struct option cliLongArgs[] = {
     {"address", required_argument, NULL, 'a'},
+    {"congestion", required_argument, NULL, 'c'},
+    {"fec", required_argument, NULL, 'f'},
     {"port", required_argument, NULL, 'p'},
     {"help", no_argument, NULL, 'h'},
+    {"interval", required_argument, NULL, 'i'},
+    {"json", required_argument, NULL, 'j'},
+    {"verify", no_argument, NULL, 'k'},
     {"log-level", required_argument, NULL, 'l'},
+    {"multi", required_argument, NULL, 'm'},
+    {"pin", required_argument, NULL, 'P'},
+    {"pacing", required_argument, NULL, 'r'},
+    {"resume", no_argument, NULL, 'R'},
+    {"streams", required_argument, NULL, 'n'},
+    {"stream", no_argument, NULL, 's'},
+    {"threads", required_argument, NULL, 't'},
+    {"io-uring", no_argument, NULL, 'u'},
     {"version", no_argument, NULL, 'v'},
+    {"compress", no_argument, NULL, 'z'},
     {NULL, 0, NULL, 0}  // Terminator
 };
 
+// Connections that -i and -j report on, as many as a striped transfer
+// has. Counters of closed ones are kept until the end.
+#define MAX_WATCHED 256
+
+static struct _Watched {
+    pthread_mutex_t lock;  // Only taken to add, close or read connections
+    size_t count;
+    BTcpConnection *conns[MAX_WATCHED];  // NULL once closed
+    BTcpStats final[MAX_WATCHED];
+} Watched = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void Watch(BTcpConnection *conn) {
+    pthread_mutex_lock(&Watched.lock);
+    if (Watched.count < MAX_WATCHED)
+        Watched.conns[Watched.count++] = conn;
+    pthread_mutex_unlock(&Watched.lock);
+}
+
+static void CloseConnection(BTcpConnection *conn) {
+    pthread_mutex_lock(&Watched.lock);
+    for (size_t i = 0; i < Watched.count; i++)
+        if (Watched.conns[i] == conn) {
+            BTGetStats(conn, &Watched.final[i]);
+            Watched.conns[i] = NULL;
+        }
+    pthread_mutex_unlock(&Watched.lock);
+    BTClose(conn);
+}
+
+// Counters of watched connection $i, or all of them added up for -1.
+// Call with the lock held.
+static void WatchedStats(long i, BTcpStats *stats) {
+    if (i >= 0) {
+        if (Watched.conns[i] != NULL)
+            BTGetStats(Watched.conns[i], stats);
+        else
+            *stats = Watched.final[i];
+        return;
+    }
+    memset(stats, 0, sizeof *stats);
+    for (size_t k = 0; k < Watched.count; k++) {
+        BTcpStats one;
+        WatchedStats(k, &one);
+        uint64_t *to = (uint64_t *)stats;
+        const uint64_t *from = (const uint64_t *)&one;
+        for (size_t j = 0; j < sizeof one / sizeof *from; j++)
+            to[j] += from[j];
+    }
+}
+
+// Upper bound of the histogram bucket that sample $p (0 to 1) falls in
+static uint64_t Percentile(const uint64_t *hist, size_t buckets, double p) {
+    uint64_t total = 0, seen = 0;
+    for (size_t i = 0; i < buckets; i++)
+        total += hist[i];
+    for (size_t i = 0; i < buckets; i++) {
+        seen += hist[i];
+        if (total > 0 && seen >= p * total)
+            return 1ULL << i;
+    }
+    return 0;
+}
+
+static double Seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The thread behind -i
+static struct _Reporter {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    int stopping;
+    double start;
+} Reporter = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// One line per interval on stderr, over all watched connections
+static void *Report(void *arg) {
+    uint64_t delivered = 0;
+    double last = Reporter.start;
+    pthread_mutex_lock(&Reporter.lock);
+    while (!Reporter.stopping) {
+        double wake = last + GlobalOptions.interval;
+        struct timespec until = {wake, (wake - (time_t)wake) * 1e9};
+        if (pthread_cond_timedwait(&Reporter.stop, &Reporter.lock, &until) == 0 || Reporter.stopping)
+            break;
+
+        BTcpStats stats;
+        pthread_mutex_lock(&Watched.lock);
+        WatchedStats(-1, &stats);
+        pthread_mutex_unlock(&Watched.lock);
+        double now = Seconds();
+        fprintf(stderr, "%8.2fs %10.2f MB/s  %llu/%llu packets out/in  %llu resent  %llu timeouts  "
+                "%llu dup  %llu out of window  rtt p50/p99 < %llu/%llu us\n",
+                now - Reporter.start, (stats.bytes_delivered - delivered) / (now - last) / 1e6,
+                (unsigned long long)stats.packets_sent, (unsigned long long)stats.packets_received,
+                (unsigned long long)stats.retransmissions, (unsigned long long)stats.timeouts,
+                (unsigned long long)stats.duplicates, (unsigned long long)stats.out_of_window,
+                (unsigned long long)Percentile(stats.rtt_hist, STATS_RTT_BUCKETS, 0.5),
+                (unsigned long long)Percentile(stats.rtt_hist, STATS_RTT_BUCKETS, 0.99));
+        delivered = stats.bytes_delivered;
+        last = now;
+    }
+    pthread_mutex_unlock(&Reporter.lock);
+    return NULL;
+}
+
+static void StartReporter(void) {
+    Reporter.start = Seconds();
+    if (GlobalOptions.interval <= 0)
+        return;
+    // Timed waits on the same clock as Seconds()
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&Reporter.stop, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&Reporter.thread, NULL, Report, NULL) != 0) {
+        Log(LOG_WARNING, "Failed to start the reporting thread");
+        GlobalOptions.interval = 0;
+    }
+}
+
+#define STATS_FIELD(name) {#name, offsetof(BTcpStats, name)}
+
+static const struct {
+    const char *name;
+    size_t offset;
+} StatsFields[] = {
+    STATS_FIELD(packets_sent), STATS_FIELD(packets_received),
+    STATS_FIELD(bytes_sent), STATS_FIELD(bytes_received),
+    STATS_FIELD(syscalls), STATS_FIELD(bytes_copied), STATS_FIELD(bytes_delivered),
+    STATS_FIELD(retransmissions), STATS_FIELD(timeouts), STATS_FIELD(rtt_samples),
+    STATS_FIELD(loss_events), STATS_FIELD(allocations), STATS_FIELD(parity_sent),
+    STATS_FIELD(recovered), STATS_FIELD(corrupted), STATS_FIELD(paced),
+    STATS_FIELD(duplicates), STATS_FIELD(out_of_window)
+};
+
+static void PrintHistogram(FILE *fp, const char *name, const uint64_t *hist, size_t buckets) {
+    fprintf(fp, ", \"%s\": [", name);
+    for (size_t i = 0; i < buckets; i++)
+        fprintf(fp, i ? ", %llu" : "%llu", (unsigned long long)hist[i]);
+    fprintf(fp, "]");
+}
+
+static void PrintStatsJson(FILE *fp, const BTcpStats *stats) {
+    for (size_t i = 0; i < sizeof StatsFields / sizeof *StatsFields; i++)
+        fprintf(fp, "%s\"%s\": %llu", i ? ", " : "{", StatsFields[i].name,
+                (unsigned long long)*(const uint64_t *)((const uint8_t *)stats + StatsFields[i].offset));
+    PrintHistogram(fp, "rtt_hist", stats->rtt_hist, STATS_RTT_BUCKETS);
+    PrintHistogram(fp, "window_hist", stats->window_hist, STATS_WINDOW_BUCKETS);
+    fprintf(fp, "}");
+}
+
+// Stop the summaries, and with -j write out every watched connection and
+// their sum. Histogram bucket $i holds values $i bits long.
+static void StopReporter(void) {
+    if (GlobalOptions.interval > 0) {
+        pthread_mutex_lock(&Reporter.lock);
+        Reporter.stopping = 1;
+        pthread_cond_signal(&Reporter.stop);
+        pthread_mutex_unlock(&Reporter.lock);
+        pthread_join(Reporter.thread, NULL);
+    }
+    if (GlobalOptions.json == NULL)
+        return;
+    FILE *fp = strcmp(GlobalOptions.json, "-") == 0 ? stdout : fopen(GlobalOptions.json, "w");
+    if (fp == NULL) {
+        Logf(LOG_ERROR, "Cannot open %s: %s", GlobalOptions.json, strerror(errno));
+        return;
+    }
+    BTcpStats stats;
+    pthread_mutex_lock(&Watched.lock);
+    fprintf(fp, "{\"seconds\": %.6f, \"connections\": [", Seconds() - Reporter.start);
+    for (size_t i = 0; i < Watched.count; i++) {
+        fprintf(fp, i ? ", " : "");
+        WatchedStats(i, &stats);
+        PrintStatsJson(fp, &stats);
+    }
+    fprintf(fp, "], \"total\": ");
+    WatchedStats(-1, &stats);
+    PrintStatsJson(fp, &stats);
+    fprintf(fp, "}\n");
+    pthread_mutex_unlock(&Watched.lock);
+    if (fp != stdout)
+        fclose(fp);
+}
+
+// Shake hands with the receiver ($send) or wait for a sender to. $sport
+// tells apart the streams of one sender.
+static BTcpConnection* OpenConnection(int send, uint8_t sport) {
+    BTcpConnection defaults;
+    BTDefaultConfig(&defaults);
+    defaults.config.congestion = GlobalOptions.congestion;
+    defaults.config.io_uring = GlobalOptions.uring;
+    defaults.config.fec_block = GlobalOptions.fec_block;
+    defaults.config.fec_parity = GlobalOptions.fec_parity;
+    defaults.config.pacing = GlobalOptions.pacing;
+    defaults.config.pacing_rate = GlobalOptions.pacing_rate;
+    defaults.config.digest = GlobalOptions.verify;
+    // Only the chunked mode frames blocks, and its receivers take them
+    // whenever offered
+    if (!GlobalOptions.stream && !GlobalOptions.resume && GlobalOptions.streams == 0)
+        defaults.config.compress = send ? GlobalOptions.compress : 1;
+    defaults.config.sport = sport;
+    BTcpConnection *conn = send ? BTConnect(GlobalOptions.addr, GlobalOptions.port, &defaults.config)
+                                : BTAccept(GlobalOptions.addr, GlobalOptions.port, &defaults.config);
+    if (conn != NULL)
+        Watch(conn);
+    return conn;
+}
+
+// Map all of $filename for reading, $map is NULL for an empty file
+static int MapInput(const char *filename, int *fd, void **map, size_t *filesize) {
+    struct stat st;
+    *fd = open(filename, O_RDONLY);
+    if (*fd < 0 || fstat(*fd, &st) != 0) {
+        Logf(LOG_FATAL, "Cannot open %s: %s", filename, strerror(errno));
+        if (*fd >= 0)
+            close(*fd);
+        return -1;
+    }
+    *filesize = st.st_size;
+    *map = NULL;
+    if (*filesize > 0) {
+        *map = mmap(NULL, *filesize, PROT_READ, MAP_PRIVATE, *fd, 0);
+        if (*map == MAP_FAILED) {
+            Logf(LOG_FATAL, "Cannot map %s: %s", filename, strerror(errno));
+            close(*fd);
+            return -1;
+        }
+        madvise(*map, *filesize, MADV_SEQUENTIAL);
+    }
+    return 0;
+}
+
+// Claim $filesize bytes for $fd, so a full disk shows up at once and not
+// in the middle of the transfer
+static int Preallocate(int fd, size_t filesize) {
+    if (filesize == 0 || fallocate(fd, 0, 0, filesize) == 0)
+        return 0;
+    if (errno == EOPNOTSUPP && ftruncate(fd, filesize) == 0)
+        return 0;
+    return -1;
+}
+
+// Map the whole file and send it as one stream, preceded by its size and
+// with -k followed by the CRC32C of both
+static int btsend_stream(const char *filename) {
+    int fd;
+    void *map;
+    size_t filesize;
+    if (MapInput(filename, &fd, &map, &filesize) != 0)
+        return 1;
+
+    int status = 0;
+    uint64_t header = htobe64(filesize);
+    BTcpConnection *conn = OpenConnection(1, 0);
+    if (conn == NULL || BTSend(conn, &header, sizeof header) != sizeof header ||
+        (filesize > 0 && BTSend(conn, map, filesize) != filesize)) {
+        Log(LOG_ERROR, "Transfer failed");
+        status = 1;
+    } else if (GlobalOptions.verify) {
+        uint32_t digest = htonl(conn->state.digest);
+        Logf(LOG_INFO, "CRC32C of the stream is %08x", conn->state.digest);
+        if (BTSend(conn, &digest, sizeof digest) != sizeof digest) {
+            Log(LOG_ERROR, "Transfer failed");
+            status = 1;
+        }
+    }
+    if (conn != NULL)
+        CloseConnection(conn);
+    if (map != NULL)
+        munmap(map, filesize);
+    close(fd);
+    return status;
+}
+
+// Receive a stream from btsend_stream straight into a mapping of the file
+static int btrecv_stream(const char *filename) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        Logf(LOG_FATAL, "Cannot open %s: %s", filename, strerror(errno));
+        return 1;
+    }
+    BTcpConnection *conn = OpenConnection(0, 0);
+    if (conn == NULL) {
+        close(fd);
+        return 1;
+    }
+    uint64_t header;
+    if (BTRecv(conn, &header, sizeof header) != sizeof header) {
+        Log(LOG_ERROR, "Missing stream header");
+        CloseConnection(conn);
+        close(fd);
+        return 1;
+    }
+    size_t filesize = be64toh(header), received = 0;
+    Logf(LOG_INFO, "Receiving %zu bytes", filesize);
+
+    // Claim the space now, or a full disk would raise SIGBUS in the
+    // middle of the transfer
+    void *map = NULL;
+    if (filesize > 0) {
+        if (Preallocate(fd, filesize) != 0) {
+            Logf(LOG_FATAL, "Cannot allocate %zu bytes for %s: %s", filesize, filename, strerror(errno));
+            CloseConnection(conn);
+            close(fd);
+            return 1;
+        }
+        map = mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            Logf(LOG_FATAL, "Cannot map %s: %s", filename, strerror(errno));
+            CloseConnection(conn);
+            close(fd);
+            return 1;
+        }
+        madvise(map, filesize, MADV_SEQUENTIAL);
+        received = BTRecv(conn, map, filesize);
+        munmap(map, filesize);
+    }
+    int status = received < filesize;
+    if (status) {
+        Logf(LOG_ERROR, "Transfer ended after %zu of %zu bytes", received, filesize);
+        ftruncate(fd, received);
+    } else if (GlobalOptions.verify) {
+        // Compare with what the sender made of the same bytes
+        uint32_t digest = conn->state.digest, expected;
+        if (BTRecv(conn, &expected, sizeof expected) != sizeof expected) {
+            Log(LOG_ERROR, "Missing stream checksum");
+            status = 1;
+        } else if (ntohl(expected) != digest) {
+            Logf(LOG_ERROR, "CRC32C of the stream is %08x, the sender's %08x", digest, ntohl(expected));
+            status = 1;
+        } else {
+            Logf(LOG_INFO, "CRC32C of the stream is %08x, as sent", digest);
+        }
+    }
+
+    // Stay around until the sender has heard our last ACK and closes
+    uint8_t spare[4096];
+    while (BTRecv(conn, spare, sizeof spare) > 0);
+    CloseConnection(conn);
+    close(fd);
+    return status;
+}
+
+// What btsend -R offers first, big-endian
+typedef struct _ResumeOffer {
+    uint64_t filesize;
+    uint64_t identity;  // FileIdentity of the file
+} ResumeOffer;
+
+// <file>.btresume, mapped. In host byte order, it stays on this machine.
+typedef struct _Checkpoint {
+    char magic[8];  // RESUME_MAGIC
+    uint64_t filesize;
+    uint64_t identity;
+    uint64_t segment;   // RESUME_SEGMENT
+    uint8_t bitmap[];   // Segment i in bit i % 8 of byte i / 8
+} Checkpoint;
+
+static inline size_t Segments(uint64_t filesize) {
+    return (filesize + RESUME_SEGMENT - 1) / RESUME_SEGMENT;
+}
+
+static inline int SegmentHere(const uint8_t *bitmap, size_t i) {
+    return bitmap[i / 8] >> (i % 8) & 1;
+}
+
+// Tells a file from its edited self without reading all of it: the
+// CRC32C of its size and modification time, then of 16 samples of 4 KiB
+// spread over it
+static uint64_t FileIdentity(int fd, const uint8_t *map, size_t filesize) {
+    struct stat st;
+    uint64_t meta[3] = {filesize, 0, 0};
+    if (fstat(fd, &st) == 0) {
+        meta[1] = st.st_mtim.tv_sec;
+        meta[2] = st.st_mtim.tv_nsec;
+    }
+    uint32_t content = 0;
+    const size_t sample = 4096;
+    for (int i = 0; i < 16 && filesize > 0; i++) {
+        size_t at = filesize > sample ? (filesize - sample) / 15 * i : 0;
+        content = BTCrc32c(content, map + at, filesize - at < sample ? filesize - at : sample);
+    }
+    return (uint64_t)BTCrc32c(0, meta, sizeof meta) << 32 | content;
+}
+
+// The next piece from segment $*at on: segments missing from $bitmap in
+// a row, RESUME_PIECE bytes at most. Both ends walk the same bits, so
+// they agree on every piece. Returns 0 once there are no more.
+static int NextPiece(const uint8_t *bitmap, uint64_t filesize, size_t *at,
+                     uint64_t *offset, uint64_t *len) {
+    const size_t segments = Segments(filesize);
+    size_t i = *at, j;
+    while (i < segments && SegmentHere(bitmap, i))
+        i++;
+    if (i == segments)
+        return 0;
+    for (j = i; j < segments && !SegmentHere(bitmap, j) &&
+                (j - i) * RESUME_SEGMENT < RESUME_PIECE; j++);
+    uint64_t end = (uint64_t)j * RESUME_SEGMENT;
+    *offset = (uint64_t)i * RESUME_SEGMENT;
+    *len = (end < filesize ? end : filesize) - *offset;
+    *at = j;
+    return 1;
+}
+
+// Map the checkpoint at $path, keeping what it says if it is about the
+// same file and $keep allows, otherwise starting it over. Sets $resumed
+// to which it was.
+static Checkpoint *OpenCheckpoint(const char *path, uint64_t filesize, uint64_t identity,
+                                  int keep, size_t *size, int *resumed) {
+    *size = sizeof(Checkpoint) + (Segments(filesize) + 7) / 8;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        Logf(LOG_FATAL, "Cannot open %s: %s", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    *resumed = keep && st.st_size == *size;
+    if (!*resumed && ftruncate(fd, *size) != 0) {
+        Logf(LOG_FATAL, "Cannot resize %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    Checkpoint *cp = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cp == MAP_FAILED) {
+        Logf(LOG_FATAL, "Cannot map %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    *resumed = *resumed && memcmp(cp->magic, RESUME_MAGIC, sizeof cp->magic) == 0 &&
+               cp->filesize == filesize && cp->identity == identity &&
+               cp->segment == RESUME_SEGMENT;
+    if (!*resumed) {
+        // Cleared for good before the file is
+        memset(cp, 0, *size);
+        memcpy(cp->magic, RESUME_MAGIC, sizeof cp->magic);
+        cp->filesize = filesize;
+        cp->identity = identity;
+        cp->segment = RESUME_SEGMENT;
+        msync(cp, *size, MS_SYNC);
+    }
+    return cp;
+}
+
+// Pieces received, for the checkpoint thread to sync and mark
+typedef struct _CheckpointJob {
+    Checkpoint *cp;
+    size_t size;
+    uint8_t *map;
+    BTcpRing ring;  // Offset and length of each piece, an empty one ends
+} CheckpointJob;
+
+// Sync each piece, then set its bits and sync those, so the bits never
+// claim data a crash could still take. Runs behind the connection, which
+// goes on receiving meanwhile.
+static void *SyncCheckpoint(void *arg) {
+    CheckpointJob *job = arg;
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    uint8_t *buf;
+    size_t n;
+    while ((buf = BTRingPeek(&job->ring, &n)), n > 0) {
+        uint64_t piece[2];
+        memcpy(piece, buf, sizeof piece);
+        BTRingRelease(&job->ring);
+        uint64_t start = piece[0] & ~(page - 1), end = piece[0] + piece[1];
+        if (msync(job->map + start, end - start, MS_SYNC) != 0) {
+            Logf(LOG_WARNING, "Cannot sync the file: %s", strerror(errno));
+            continue;
+        }
+        for (size_t i = piece[0] / RESUME_SEGMENT; (uint64_t)i * RESUME_SEGMENT < end; i++)
+            job->cp->bitmap[i / 8] |= 1 << (i % 8);
+        msync(job->cp, job->size, MS_SYNC);
+    }
+    BTRingRelease(&job->ring);
+    return NULL;
+}
+
+// Send only what the receiver does not have yet, see RESUME_SEGMENT
+static int btsend_resume(const char *filename) {
+    int fd;
+    void *map;
+    size_t filesize;
+    if (MapInput(filename, &fd, &map, &filesize) != 0)
+        return 1;
+    const size_t bytes = (Segments(filesize) + 7) / 8;
+    uint8_t *bitmap = malloc(bytes + 1);
+    if (bitmap == NULL) {
+        Log(LOG_FATAL, "Failed to allocate memory");
+        if (map != NULL)
+            munmap(map, filesize);
+        close(fd);
+        return 1;
+    }
+    ResumeOffer offer = {
+        .filesize = htobe64(filesize),
+        .identity = htobe64(FileIdentity(fd, map, filesize))
+    };
+
+    int status = 1;
+    uint64_t sent = 0;
+    BTcpConnection *conn = OpenConnection(1, 0);
+    if (conn == NULL || BTSend(conn, &offer, sizeof offer) != sizeof offer) {
+        Log(LOG_ERROR, "Transfer failed");
+    } else if (bytes > 0 && BTRecv(conn, bitmap, bytes) != bytes) {
+        Log(LOG_ERROR, "The receiver did not say what it has");
+    } else {
+        size_t at = 0;
+        uint64_t offset, len;
+        status = 0;
+        while (status == 0 && NextPiece(bitmap, filesize, &at, &offset, &len)) {
+            if (BTSend(conn, (uint8_t *)map + offset, len) != len) {
+                Log(LOG_ERROR, "Transfer failed");
+                status = 1;
+            }
+            sent += len;
+        }
+        Logf(LOG_INFO, "Sent %llu of %zu bytes, the receiver had the rest",
+             (unsigned long long)sent, filesize);
+    }
+    if (status == 0 && GlobalOptions.verify) {
+        // Of the whole file, as the stream is only part of it
+        uint32_t digest = htonl(BTCrc32c(0, map, filesize));
+        if (BTSend(conn, &digest, sizeof digest) != sizeof digest) {
+            Log(LOG_ERROR, "Transfer failed");
+            status = 1;
+        }
+    }
+    if (conn != NULL)
+        CloseConnection(conn);
+    free(bitmap);
+    if (map != NULL)
+        munmap(map, filesize);
+    close(fd);
+    return status;
+}
+
+// Receive into a mapping of the file what it is still missing, noting in
+// <file>.btresume what arrived
+static int btrecv_resume(const char *filename) {
+    BTcpConnection *conn = OpenConnection(0, 0);
+    if (conn == NULL)
+        return 1;
+    ResumeOffer offer;
+    if (BTRecv(conn, &offer, sizeof offer) != sizeof offer) {
+        Log(LOG_ERROR, "Missing resume offer");
+        CloseConnection(conn);
+        return 1;
+    }
+    const uint64_t filesize = be64toh(offer.filesize), identity = be64toh(offer.identity);
+    const size_t bytes = (Segments(filesize) + 7) / 8;
+
+    // Only trust the checkpoint if the file it speaks of is still there
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s" RESUME_SUFFIX, filename);
+    struct stat st;
+    int keep = stat(filename, &st) == 0 && st.st_size == filesize, resumed;
+    CheckpointJob job = {0};
+    job.cp = OpenCheckpoint(path, filesize, identity, keep, &job.size, &resumed);
+    if (job.cp == NULL) {
+        CloseConnection(conn);
+        return 1;
+    }
+    int fd = open(filename, O_RDWR | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        Logf(LOG_FATAL, "Cannot open %s: %s", filename, strerror(errno));
+        munmap(job.cp, job.size);
+        CloseConnection(conn);
+        return 1;
+    }
+    uint8_t *map = NULL, *bitmap = malloc(bytes + 1);
+    if (filesize > 0) {
+        if (Preallocate(fd, filesize) != 0) {
+            Logf(LOG_FATAL, "Cannot allocate %llu bytes for %s: %s",
+                 (unsigned long long)filesize, filename, strerror(errno));
+            map = MAP_FAILED;
+        } else {
+            map = mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED)
+                Logf(LOG_FATAL, "Cannot map %s: %s", filename, strerror(errno));
+        }
+    }
+    if (map == MAP_FAILED || bitmap == NULL ||
+        BTRingInit(&job.ring, RING_BUFFERS, 2 * sizeof(uint64_t)) != 0) {
+        if (bitmap == NULL)
+            Log(LOG_FATAL, "Failed to allocate memory");
+        free(bitmap);
+        if (map != NULL && map != MAP_FAILED)
+            munmap(map, filesize);
+        munmap(job.cp, job.size);
+        close(fd);
+        CloseConnection(conn);
+        return 1;
+    }
+    job.map = map;
+
+    // Walk the bits as sent, the thread sets more of them meanwhile
+    memcpy(bitmap, job.cp->bitmap, bytes);
+    size_t here = 0;
+    for (size_t i = 0; i < Segments(filesize); i++)
+        here += SegmentHere(bitmap, i);
+    if (resumed)
+        Logf(LOG_INFO, "Resuming with %zu of %zu segments here", here, Segments(filesize));
+    else
+        Logf(LOG_INFO, "Receiving %llu bytes", (unsigned long long)filesize);
+
+    int status = 0;
+    pthread_t syncer;
+    if (pthread_create(&syncer, NULL, SyncCheckpoint, &job) != 0) {
+        Log(LOG_FATAL, "Failed to start checkpoint thread");
+        status = 1;
+    } else {
+        if (bytes > 0 && BTSend(conn, bitmap, bytes) != bytes) {
+            Log(LOG_ERROR, "Failed to tell the sender what is here");
+            status = 1;
+        }
+        size_t at = 0;
+        uint64_t piece[2];
+        while (status == 0 && NextPiece(bitmap, filesize, &at, &piece[0], &piece[1])) {
+            size_t received = BTRecv(conn, map + piece[0], piece[1]);
+            if (received != piece[1]) {
+                Logf(LOG_ERROR, "Transfer ended %zu bytes into the piece at %llu",
+                     received, (unsigned long long)piece[0]);
+                status = 1;
+                break;
+            }
+            memcpy(BTRingAcquire(&job.ring), piece, sizeof piece);
+            BTRingCommit(&job.ring, sizeof piece);
+        }
+        BTRingAcquire(&job.ring);
+        BTRingCommit(&job.ring, 0);
+        pthread_join(syncer, NULL);
+    }
+
+    if (status == 0 && GlobalOptions.verify) {
+        uint32_t digest = BTCrc32c(0, map, filesize), expected;
+        if (BTRecv(conn, &expected, sizeof expected) != sizeof expected) {
+            Log(LOG_ERROR, "Missing file checksum");
+            status = 1;
+        } else if (ntohl(expected) != digest) {
+            // Resuming again would not fix it, the checkpoint goes anyway
+            Logf(LOG_ERROR, "CRC32C of the file is %08x, the sender's %08x", digest, ntohl(expected));
+            status = 1;
+            unlink(path);
+        } else {
+            Logf(LOG_INFO, "CRC32C of the file is %08x, as sent", digest);
+        }
+    }
+    if (status == 0) {
+        unlink(path);
+        // Stay around until the sender has heard our last ACK and closes
+        uint8_t spare[4096];
+        while (BTRecv(conn, spare, sizeof spare) > 0);
+    } else if (access(path, F_OK) == 0) {
+        Logf(LOG_ERROR, "Run again with -R to pick up from where %s says", path);
+    }
+    CloseConnection(conn);
+    BTRingFree(&job.ring);
+    free(bitmap);
+    if (map != NULL)
+        munmap(map, filesize);
+    munmap(job.cp, job.size);
+    close(fd);
+    return status;
+}
+
+// Each stream of a striped transfer starts with the size of the whole
+// file and the offset of its range, both big-endian
+typedef struct _StripeHeader {
+    uint64_t filesize;
+    uint64_t offset;
+} StripeHeader;
+
+typedef struct _Stripe {
+    const uint8_t *data;
+    size_t filesize, offset, len;
+    uint8_t index;
+    int status;
+} Stripe;
+
+static void *SendStripe(void *arg) {
+    Stripe *stripe = arg;
+    StripeHeader header = {htobe64(stripe->filesize), htobe64(stripe->offset)};
+    BTcpConnection *conn = OpenConnection(1, stripe->index);
+    if (conn == NULL || BTSend(conn, &header, sizeof header) != sizeof header ||
+        (stripe->len > 0 && BTSend(conn, stripe->data + stripe->offset, stripe->len) != stripe->len)) {
+        Logf(LOG_ERROR, "Stream %u failed", stripe->index);
+        stripe->status = 1;
+    }
+    if (conn != NULL)
+        CloseConnection(conn);
+    return NULL;
+}
+
+// Split the file into one range per stream and send them all at once,
+// each over a connection and thread of its own
+static int btsend_striped(const char *filename) {
+    int fd;
+    void *map;
+    size_t filesize, streams = GlobalOptions.streams;
+    if (MapInput(filename, &fd, &map, &filesize) != 0)
+        return 1;
+    Stripe *stripes = calloc(streams, sizeof *stripes);
+    pthread_t *threads = calloc(streams, sizeof *threads);
+    if (stripes == NULL || threads == NULL) {
+        Log(LOG_FATAL, "Failed to allocate memory");
+        free(stripes);
+        free(threads);
+        if (map != NULL)
+            munmap(map, filesize);
+        close(fd);
+        return 1;
+    }
+
+    // Every stream is started even with nothing to carry, the receiver
+    // counts them
+    const size_t range = (filesize + streams - 1) / streams;
+    int status = 0;
+    for (size_t i = 0; i < streams; i++) {
+        Stripe *stripe = &stripes[i];
+        stripe->data = map;
+        stripe->filesize = filesize;
+        stripe->offset = i * range < filesize ? i * range : filesize;
+        stripe->len = filesize - stripe->offset < range ? filesize - stripe->offset : range;
+        stripe->index = i;
+        if (pthread_create(&threads[i], NULL, SendStripe, stripe) != 0) {
+            Log(LOG_FATAL, "Failed to start sending thread");
+            streams = i;
+            status = 1;
+            break;
+        }
+    }
+    for (size_t i = 0; i < streams; i++) {
+        pthread_join(threads[i], NULL);
+        status |= stripes[i].status;
+    }
+    free(stripes);
+    free(threads);
+    if (map != NULL)
+        munmap(map, filesize);
+    close(fd);
+    return status;
+}
+
+// File I/O thread on the other side of a ring from the protocol
+typedef struct _DiskJob {
+    FILE *fp;
+    BTcpRing ring;
+    int status;
+} DiskJob;
+
+// Read the file into the ring until EOF, then pass on an empty buffer
+static void *ReadChunks(void *arg) {
+    DiskJob *job = arg;
+    size_t n;
+    do {
+        uint8_t *buf = BTRingAcquire(&job->ring);
+        n = fread(buf, 1, job->ring.size, job->fp);
+        BTRingCommit(&job->ring, n);
+    } while (n > 0);
+    job->status = ferror(job->fp) != 0;
+    return NULL;
+}
+
+// Write what comes out of the ring until an empty buffer arrives. Keeps
+// draining after an error so the other side never blocks.
+static void *WriteChunks(void *arg) {
+    DiskJob *job = arg;
+    uint8_t *buf;
+    size_t n;
+    while ((buf = BTRingPeek(&job->ring, &n)), n > 0) {
+        if (job->status == 0 && fwrite(buf, n, 1, job->fp) != 1) {
+            Logf(LOG_ERROR, "Write failed: %s", strerror(errno));
+            job->status = 1;
+        }
+        BTRingRelease(&job->ring);
+    }
+    BTRingRelease(&job->ring);
+    return NULL;
+}
+
+// Start $job on $filename with its own thread
+static int StartDiskJob(DiskJob *job, pthread_t *thread, const char *filename, int writing) {
+    job->status = 0;
+    job->fp = fopen(filename, writing ? "wb" : "rb");
+    if (job->fp == NULL) {
+        Logf(LOG_FATAL, "Cannot open %s: %s", filename, strerror(errno));
+        return -1;
+    }
+    if (BTRingInit(&job->ring, RING_BUFFERS, CHUNK_SIZE) != 0) {
+        Log(LOG_FATAL, "Failed to allocate memory");
+        fclose(job->fp);
+        return -1;
+    }
+    if (pthread_create(thread, NULL, writing ? WriteChunks : ReadChunks, job) != 0) {
+        Log(LOG_FATAL, "Failed to start disk thread");
+        BTRingFree(&job->ring);
+        fclose(job->fp);
+        return -1;
+    }
+    return 0;
+}
+
+static int FinishDiskJob(DiskJob *job, pthread_t thread) {
+    pthread_join(thread, NULL);
+    BTRingFree(&job->ring);
+    if (fclose(job->fp) != 0)
+        job->status = 1;
+    return job->status;
+}
+
+// Compression stage between a disk thread's ring of chunks and the
+// connection, one block per chunk
+typedef struct _BlockJob {
+    BTcpRing *chunks;  // The disk thread's
+    BTcpRing blocks;   // The connection's, a block and its header in each
+    uint8_t *pending;  // Packing: the block waiting for the next header
+    int status;
+    uint64_t raw_bytes;     // Chunks in all blocks
+    uint64_t packed_bytes;  // What they made, headers aside
+    size_t count, bypassed;
+} BlockJob;
+
+// Turn chunks into blocks until the empty chunk, then pass that on. What
+// goes into the ring is ready for BTSend: a block, then the next header.
+static void *PackBlocks(void *arg) {
+    BlockJob *job = arg;
+    unsigned bypass = 0, skip = 0;
+    size_t n, pending = 0;
+    do {
+        uint8_t *chunk = BTRingPeek(job->chunks, &n);
+        BlockHeader header = {0, 0};
+        uint8_t *frame = BTRingAcquire(&job->blocks);
+        memcpy(frame, job->pending, pending);
+        if (n > 0) {
+            size_t len = 0;
+            if (skip > 0)
+                skip--;
+            else if ((len = BTLz4Compress(chunk, n, job->pending, n - n / MIN_SAVING - 1)) > 0)
+                bypass = 0;
+            else
+                skip = bypass = bypass == 0 ? 1 : bypass < MAX_BYPASS ? bypass * 2 : MAX_BYPASS;
+            if (len > 0) {
+                header.len = htonl(len | BLOCK_LZ4);
+            } else {
+                len = n;
+                memcpy(job->pending, chunk, n);
+                header.len = htonl(len);
+                job->bypassed++;
+            }
+            header.raw_len = htonl(n);
+            job->raw_bytes += n;
+            job->packed_bytes += len;
+            job->count++;
+        }
+        memcpy(frame + pending, &header, sizeof header);
+        BTRingCommit(&job->blocks, pending + sizeof header);
+        pending = ntohl(header.len) & ~BLOCK_LZ4;
+        BTRingRelease(job->chunks);
+    } while (n > 0);
+    BTRingAcquire(&job->blocks);
+    BTRingCommit(&job->blocks, 0);
+    return NULL;
+}
+
+// Turn blocks back into chunks until the empty block, then pass that on.
+// Keeps draining after an error so the other side never blocks.
+static void *UnpackBlocks(void *arg) {
+    BlockJob *job = arg;
+    uint8_t *block;
+    size_t n;
+    while ((block = BTRingPeek(&job->blocks, &n)), n > 0) {
+        // RecvBlock checked the header
+        const BlockHeader *header = (const BlockHeader *)block;
+        uint32_t len = ntohl(header->len), raw_len = ntohl(header->raw_len);
+        const uint8_t *data = block + sizeof *header;
+        if (job->status == 0) {
+            uint8_t *chunk = BTRingAcquire(job->chunks);
+            if (!(len & BLOCK_LZ4)) {
+                memcpy(chunk, data, raw_len);
+            } else if (BTLz4Decompress(data, len & ~BLOCK_LZ4, chunk, raw_len) != 0) {
+                Logf(LOG_ERROR, "Block %zu does not decompress", job->count);
+                job->status = 1;
+                raw_len = 0;  // Ends the stream early
+            }
+            BTRingCommit(job->chunks, raw_len);
+        }
+        BTRingRelease(&job->blocks);
+        job->raw_bytes += raw_len;
+        job->packed_bytes += len & ~BLOCK_LZ4;
+        job->count++;
+        job->bypassed += !(len & BLOCK_LZ4);
+    }
+    BTRingRelease(&job->blocks);
+    if (job->status == 0) {
+        BTRingAcquire(job->chunks);
+        BTRingCommit(job->chunks, 0);
+    }
+    return NULL;
+}
+
+// Start $job on the $chunks of a disk job with its own thread, $packing
+// them into blocks for sending or else unpacking blocks received
+static int StartBlockJob(BlockJob *job, pthread_t *thread, BTcpRing *chunks, int packing) {
+    memset(job, 0, sizeof *job);
+    job->chunks = chunks;
+    if (packing && (job->pending = malloc(CHUNK_SIZE)) == NULL) {
+        Log(LOG_FATAL, "Failed to allocate memory");
+        return -1;
+    }
+    if (BTRingInit(&job->blocks, RING_BUFFERS, BLOCK_SIZE) != 0) {
+        Log(LOG_FATAL, "Failed to allocate memory");
+        free(job->pending);
+        return -1;
+    }
+    if (pthread_create(thread, NULL, packing ? PackBlocks : UnpackBlocks, job) != 0) {
+        Log(LOG_FATAL, "Failed to start compression thread");
+        BTRingFree(&job->blocks);
+        free(job->pending);
+        return -1;
+    }
+    return 0;
+}
+
+static int FinishBlockJob(BlockJob *job, pthread_t thread) {
+    pthread_join(thread, NULL);
+    BTRingFree(&job->blocks);
+    free(job->pending);
+    Logf(LOG_INFO, "%llu bytes in %zu blocks as %llu, %zu of them uncompressed",
+         (unsigned long long)job->raw_bytes, job->count,
+         (unsigned long long)job->packed_bytes, job->bypassed);
+    return job->status;
+}
+
+// The block $next announced into $buf, behind its header, and the
+// header of the one after it into $next. Returns the bytes of both
+// headers and the block, 0 at the end of the stream, -1 if it is broken.
+static ssize_t RecvBlock(BTcpConnection *conn, uint8_t *buf, BlockHeader *next) {
+    uint32_t len = ntohl(next->len) & ~BLOCK_LZ4, raw_len = ntohl(next->raw_len);
+    int packed = (ntohl(next->len) & BLOCK_LZ4) != 0;
+    if (len == 0 && raw_len == 0 && !packed)
+        return 0;
+    if (len == 0 || raw_len > CHUNK_SIZE || len > raw_len || (!packed && len != raw_len)) {
+        Log(LOG_ERROR, "Broken block header");
+        return -1;
+    }
+    memcpy(buf, next, sizeof *next);
+    size_t frame = len + sizeof *next;
+    if (BTRecv(conn, buf + sizeof *next, frame) != frame) {
+        Log(LOG_ERROR, "Transfer ended in the middle of a block");
+        return -1;
+    }
+    memcpy(next, buf + frame, sizeof *next);
+    return frame + sizeof *next;
+}
+
 int btsend(int argc, char **argv) {
     Log(LOG_DEBUG, "Sending via backTCP");
-    FILE *fp = fopen(argv[0], "rb");
-    fseek(fp, 0L, SEEK_END);
-    size_t filesize = ftell(fp), bufsize;
-    fseek(fp, 0L, SEEK_SET);
-    void *buf = malloc(1UL << 16);
-    BTcpConnection *conn = BTOpen(GlobalOptions.addr, GlobalOptions.port);
-    while (filesize > 0) {
-        bufsize = filesize;
-        if (bufsize > (1UL << 16))
-            bufsize = 1UL << 16;
-        filesize -= bufsize;
-        fread(buf, bufsize, 1, fp);
-        BTSend(conn, buf, bufsize);
-    }
-    fclose(fp);
-    BTClose(conn);
-    free(buf);
+    if (GlobalOptions.streams > 0)
+        return btsend_striped(argv[0]);
+    if (GlobalOptions.resume)
+        return btsend_resume(argv[0]);
+    if (GlobalOptions.stream)
+        return btsend_stream(argv[0]);
+
+    // The disk thread reads ahead while we send
+    DiskJob job;
+    pthread_t reader;
+    if (StartDiskJob(&job, &reader, argv[0], 0) != 0)
+        return 1;
+    BTcpConnection *conn = OpenConnection(1, 0);
+
+    // With -z a thread of its own packs what the reader reads into blocks
+    BTcpRing *ring = &job.ring;
+    BlockJob blocks;
+    pthread_t packer;
+    int packing = conn != NULL && (conn->state.flags & F_COMPRESSED);
+    if (GlobalOptions.compress && conn != NULL && !packing)
+        Log(LOG_WARNING, "The receiver takes no compressed blocks, sending the file as it is");
+    if (packing) {
+        if (StartBlockJob(&blocks, &packer, &job.ring, 1) == 0) {
+            ring = &blocks.blocks;
+        } else {
+            // The receiver expects blocks, there is no going back
+            CloseConnection(conn);
+            conn = NULL;
+            packing = 0;
+        }
+    }
+
+    uint8_t *buf;
+    size_t n;
+    while ((buf = BTRingPeek(ring, &n)), n > 0) {
+        if (conn != NULL)  // Otherwise just let the reader finish
+            BTSend(conn, buf, n);
+        BTRingRelease(ring);
+    }
+    BTRingRelease(ring);
+    if (packing)
+        FinishBlockJob(&blocks, packer);
+    if (conn == NULL) {
+        FinishDiskJob(&job, reader);
+        return 1;
+    }
+    CloseConnection(conn);
+    return FinishDiskJob(&job, reader);
+}
+
+// One upload to the multi-flow receiver
+typedef struct _Upload {
+    int fd;
+    char name[PATH_MAX];
+} Upload;
+
+static void *UploadOpen(void *arg, const struct sockaddr_in *addr, uint8_t sport, uint8_t dport) {
+    Upload *upload = malloc(sizeof *upload);
+    if (upload == NULL)
+        return NULL;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof ip);
+    snprintf(upload->name, sizeof upload->name, "%s.%s-%u-%u",
+             (const char *)arg, ip, ntohs(addr->sin_port), sport);
+    upload->fd = open(upload->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (upload->fd < 0) {
+        Logf(LOG_ERROR, "Cannot open %s: %s", upload->name, strerror(errno));
+        free(upload);
+        return NULL;
+    }
+    return upload;
+}
+
+static int UploadData(void *ctx, const void *data, size_t len, uint64_t offset) {
+    Upload *upload = ctx;
+    if (pwrite(upload->fd, data, len, offset) != len) {
+        Logf(LOG_ERROR, "Cannot write %s: %s", upload->name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void UploadClose(void *ctx, uint64_t total, int complete) {
+    Upload *upload = ctx;
+    Logf(complete ? LOG_INFO : LOG_WARNING, "%s %s with %llu bytes", upload->name,
+         complete ? "done" : "incomplete", (unsigned long long)total);
+    close(upload->fd);
+    free(upload);
+}
+
+// Run the receiving server until $flows flows are done, 0 for never
+static int Serve(const BTcpServerOps *ops, void *arg, uint64_t flows) {
+    BTcpConnection defaults;
+    BTDefaultConfig(&defaults);
+    if (GlobalOptions.threads > 1 || GlobalOptions.ncpus > 0) {
+        BTcpServerPool *pool = BTListenPool(GlobalOptions.addr, GlobalOptions.port, &defaults.config,
+                                            ops, arg, GlobalOptions.threads,
+                                            GlobalOptions.cpus, GlobalOptions.ncpus);
+        if (pool == NULL)
+            return 1;
+        if (flows > 0)
+            BTServerPoolWait(pool, flows);
+        else
+            pause();
+        BTServerPoolClose(pool);
+        return 0;
+    }
+    BTcpServer *server = BTListen(GlobalOptions.addr, GlobalOptions.port, &defaults.config, ops, arg);
+    if (server == NULL)
+        return 1;
+    int status = BTServe(server, flows) != 0;
+    BTServerClose(server);
+    return status;
+}
+
+// Take uploads from any number of senders at once, each into a file of
+// its own named after the sender
+static int btrecv_multi(const char *prefix) {
+    static const BTcpServerOps ops = {UploadOpen, UploadData, UploadClose};
+    return Serve(&ops, (void *)prefix, GlobalOptions.flows);
+}
+
+// The output of a striped transfer, written to by every stream
+typedef struct _StripedFile {
+    int fd;
+    const char *name;
+    pthread_mutex_t lock;
+    int sized;            // Preallocated to $filesize, under $lock
+    uint64_t filesize;
+    uint64_t received;    // Payload of streams that finished, under $lock
+    int failed;
+} StripedFile;
+
+typedef struct _StripeFlow {
+    StripedFile *file;
+    uint8_t header[sizeof(StripeHeader)];
+    uint64_t offset;  // Start of the range in the file
+} StripeFlow;
+
+static void *StripeOpen(void *arg, const struct sockaddr_in *addr, uint8_t sport, uint8_t dport) {
+    StripeFlow *flow = calloc(1, sizeof *flow);
+    if (flow != NULL)
+        flow->file = arg;
+    return flow;
+}
+
+static int StripeData(void *ctx, const void *data, size_t len, uint64_t offset) {
+    StripeFlow *flow = ctx;
+    StripedFile *file = flow->file;
+    if (offset < sizeof flow->header) {
+        size_t n = sizeof flow->header - offset < len ? sizeof flow->header - offset : len;
+        memcpy(flow->header + offset, data, n);
+        data = (const uint8_t *)data + n;
+        len -= n;
+        offset += n;
+        if (offset < sizeof flow->header)
+            return 0;
+
+        StripeHeader header;
+        memcpy(&header, flow->header, sizeof header);
+        uint64_t filesize = be64toh(header.filesize);
+        flow->offset = be64toh(header.offset);
+        pthread_mutex_lock(&file->lock);
+        int ok = 1;
+        if (!file->sized) {
+            ok = Preallocate(file->fd, filesize) == 0;
+            if (!ok)
+                Logf(LOG_FATAL, "Cannot allocate %llu bytes for %s: %s",
+                     (unsigned long long)filesize, file->name, strerror(errno));
+            file->filesize = filesize;
+            file->sized = 1;
+        } else if (filesize != file->filesize) {
+            Log(LOG_ERROR, "Streams disagree on the file size");
+            ok = 0;
+        }
+        pthread_mutex_unlock(&file->lock);
+        if (!ok || flow->offset > filesize)
+            return -1;
+    }
+    uint64_t at = flow->offset + offset - sizeof flow->header;
+    if (at + len > file->filesize) {
+        Log(LOG_ERROR, "Stream runs past the end of the file");
+        return -1;
+    }
+    if (pwrite(file->fd, data, len, at) != len) {
+        Logf(LOG_ERROR, "Cannot write %s: %s", file->name, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
+static void StripeClose(void *ctx, uint64_t total, int complete) {
+    StripeFlow *flow = ctx;
+    StripedFile *file = flow->file;
+    pthread_mutex_lock(&file->lock);
+    if (complete && total >= sizeof flow->header)
+        file->received += total - sizeof flow->header;
+    else
+        file->failed = 1;
+    pthread_mutex_unlock(&file->lock);
+    free(flow);
+}
+
+// Put a file from btsend_striped back together by offset
+static int btrecv_striped(const char *filename) {
+    static const BTcpServerOps ops = {StripeOpen, StripeData, StripeClose};
+    StripedFile file = {.name = filename};
+    file.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file.fd < 0) {
+        Logf(LOG_FATAL, "Cannot open %s: %s", filename, strerror(errno));
+        return 1;
+    }
+    pthread_mutex_init(&file.lock, NULL);
+    int status = Serve(&ops, &file, GlobalOptions.streams);
+    if (status == 0 && (file.failed || file.received != file.filesize)) {
+        Logf(LOG_ERROR, "Transfer ended after %llu of %llu bytes",
+             (unsigned long long)file.received, (unsigned long long)file.filesize);
+        status = 1;
+    }
+    pthread_mutex_destroy(&file.lock);
+    close(file.fd);
+    return status;
+}
+
 int btrecv(int argc, char **argv) {
     Log(LOG_DEBUG, "Receiving via backTCP");
-    FILE *fp = fopen(argv[0], "wb");
-    const size_t bufsize = 1UL << 16;
-    void *buf = malloc(bufsize);
-    BTcpConnection *conn = BTOpen(GlobalOptions.addr, GlobalOptions.port);
-    size_t recv_size;
-    do {
-        recv_size = BTRecv(conn, buf, bufsize);
-        fwrite(buf, recv_size, 1, fp);
-    } while (recv_size > 0);
-    BTClose(conn);
-    free(buf);
-    fclose(fp);
-    return 0;
+    if (GlobalOptions.streams > 0)
+        return btrecv_striped(argv[0]);
+    if (GlobalOptions.multi)
+        return btrecv_multi(argv[0]);
+    if (GlobalOptions.resume)
+        return btrecv_resume(argv[0]);
+    if (GlobalOptions.stream)
+        return btrecv_stream(argv[0]);
+
+    // The disk thread writes behind while we receive
+    DiskJob job;
+    pthread_t writer;
+    if (StartDiskJob(&job, &writer, argv[0], 1) != 0)
+        return 1;
+    BTcpConnection *conn = OpenConnection(0, 0);
+    if (conn == NULL) {
+        BTRingAcquire(&job.ring);
+        BTRingCommit(&job.ring, 0);
+        FinishDiskJob(&job, writer);
+        return 1;
+    }
+    int status = 0;
+    if (conn->state.flags & F_COMPRESSED) {
+        // Blocks go to a thread of their own to be unpacked for the writer
+        BlockJob blocks;
+        pthread_t unpacker;
+        if (StartBlockJob(&blocks, &unpacker, &job.ring, 0) != 0) {
+            CloseConnection(conn);
+            BTRingAcquire(&job.ring);
+            BTRingCommit(&job.ring, 0);
+            FinishDiskJob(&job, writer);
+            return 1;
+        }
+        BlockHeader next;
+        ssize_t n;
+        if (BTRecv(conn, &next, sizeof next) != sizeof next) {
+            Log(LOG_ERROR, "Missing block header");
+            memset(&next, 0, sizeof next);  // Nothing to unpack then
+            status = 1;
+        }
+        do {
+            uint8_t *buf = BTRingAcquire(&blocks.blocks);
+            n = RecvBlock(conn, buf, &next);
+            if (n < 0) {
+                status = 1;
+                n = 0;
+            }
+            BTRingCommit(&blocks.blocks, n);
+        } while (n > 0);
+        status |= FinishBlockJob(&blocks, unpacker);
+
+        // Stay around until the sender has heard our last ACK and closes
+        uint8_t spare[4096];
+        while (status == 0 && BTRecv(conn, spare, sizeof spare) > 0);
+    } else {
+        size_t n;
+        do {
+            uint8_t *buf = BTRingAcquire(&job.ring);
+            n = BTRecv(conn, buf, job.ring.size);
+            BTRingCommit(&job.ring, n);
+        } while (n > 0);
+    }
+    CloseConnection(conn);
+    return FinishDiskJob(&job, writer) | status;
 }
 
 int main(int argc, char **argv) {
@@ -95,6 +1395,27 @@ int main(int argc, char **argv) {
                     }
                     GlobalOptions.addr = addr.s_addr;
                 } break;
+            case 'c':
+                GlobalOptions.congestion = BTCongestionLookup(optarg);
+                if (GlobalOptions.congestion < 0) {
+                    Logf(LOG_ERROR, "Unknown congestion control '%s', valid values are\n\tnone, reno, cubic\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                {
+                    // <block>[:<parity>], one parity packet if not told
+                    char *endptr;
+                    long block = strtol(optarg, &endptr, 10), parity = 1;
+                    if (*endptr == ':')
+                        parity = strtol(endptr + 1, &endptr, 10);
+                    if (*endptr || block < 1 || block > 255 || parity < 1 || parity > block) {
+                        Logf(LOG_ERROR, "Invalid FEC ratio '%s'", optarg);
+                        return 1;
+                    }
+                    GlobalOptions.fec_block = block;
+                    GlobalOptions.fec_parity = parity;
+                } break;
             case 'p':
                 {
                     char *endptr;
@@ -103,7 +1424,7 @@ int main(int argc, char **argv) {
                         Logf(LOG_ERROR, "Invalid port number '%s'", optarg);
                         return 1;
                     } else if (result < 0 || result >= (1 << 16)) {
-                        Logf(LOG_ERROR, "Port number '%d' out of range", result);
+                        Logf(LOG_ERROR, "Port number '%ld' out of range", result);
                         return 1;
                     }
                     GlobalOptions.port = result;
@@ -124,14 +1445,103 @@ int main(int argc, char **argv) {
                     return 1;
                 }
                 break;
+            case 'm':
+                {
+                    char *endptr;
+                    GlobalOptions.flows = strtoul(optarg, &endptr, 10);
+                    if (*endptr || optarg[0] == '-') {
+                        Logf(LOG_ERROR, "Invalid number of uploads '%s'", optarg);
+                        return 1;
+                    }
+                    GlobalOptions.multi = 1;
+                } break;
+            case 'n':
+                {
+                    char *endptr;
+                    GlobalOptions.streams = strtoul(optarg, &endptr, 10);
+                    if (*endptr || GlobalOptions.streams == 0 || GlobalOptions.streams > 255) {
+                        Logf(LOG_ERROR, "Invalid number of streams '%s'", optarg);
+                        return 1;
+                    }
+                } break;
+            case 'P':
+                {
+                    // Comma-separated list of CPUs
+                    char *p = optarg, *endptr;
+                    GlobalOptions.ncpus = 0;
+                    while (*p) {
+                        long cpu = strtol(p, &endptr, 10);
+                        if (endptr == p || cpu < 0 || cpu >= CPU_SETSIZE ||
+                            (*endptr && *endptr != ',') || GlobalOptions.ncpus == CPU_SETSIZE) {
+                            Logf(LOG_ERROR, "Invalid CPU list '%s'", optarg);
+                            return 1;
+                        }
+                        GlobalOptions.cpus[GlobalOptions.ncpus++] = cpu;
+                        p = *endptr ? endptr + 1 : endptr;
+                    }
+                } break;
+            case 'r':
+                {
+                    // <mode>[:<Mbit/s>], following the window if no rate
+                    char *colon = strchr(optarg, ':'), *endptr = "";
+                    double rate = 0;
+                    if (colon != NULL) {
+                        *colon = '\0';
+                        rate = strtod(colon + 1, &endptr);
+                    }
+                    GlobalOptions.pacing = BTPacingLookup(optarg);
+                    if (GlobalOptions.pacing < 0 || *endptr || rate < 0 ||
+                        (rate > 0 && GlobalOptions.pacing == PACING_OFF)) {
+                        Logf(LOG_ERROR, "Invalid pacing '%s', valid modes are\n\toff, user, txtime\n", optarg);
+                        return 1;
+                    }
+                    GlobalOptions.pacing_rate = rate * 1e6 / 8;
+                } break;
+            case 's':
+                GlobalOptions.stream = 1;
+                break;
+            case 'u':
+                GlobalOptions.uring = 1;
+                break;
+            case 't':
+                {
+                    char *endptr;
+                    GlobalOptions.threads = strtoul(optarg, &endptr, 10);
+                    if (*endptr || optarg[0] == '-' || GlobalOptions.threads == 0) {
+                        Logf(LOG_ERROR, "Invalid number of threads '%s'", optarg);
+                        return 1;
+                    }
+                } break;
             case 'h':
                 GlobalOptions.action = ACTION_HELP;
                 break;
+            case 'i':
+                {
+                    char *endptr;
+                    GlobalOptions.interval = strtod(optarg, &endptr);
+                    if (*endptr || !(GlobalOptions.interval > 0)) {
+                        Logf(LOG_ERROR, "Invalid interval '%s'", optarg);
+                        return 1;
+                    }
+                } break;
+            case 'j':
+                GlobalOptions.json = optarg;
+                break;
+            case 'k':
+                GlobalOptions.verify = 1;
+                break;
+            case 'z':
+                GlobalOptions.compress = 1;
+                break;
+            case 'R':
+                GlobalOptions.resume = 1;
+                break;
             case 'v':
                 GlobalOptions.action = ACTION_VERSION;
                 break;
             case '?':
-                if (optopt == 'l')
+                if (optopt == 'l' || optopt == 'c' || optopt == 'f' || optopt == 'm' || optopt == 'n' || optopt == 'P' || optopt == 'r' || optopt == 't' ||
+                    optopt == 'i' || optopt == 'j')
                     Logf(LOG_ERROR, "Option -%c requires an argument.\n", optopt);
                 else if (isprint (optopt))
                     Logf(LOG_ERROR, "Unknown option '-%c'.\n", optopt);
@@ -151,13 +1561,26 @@ int main(int argc, char **argv) {
             Log(LOG_FATAL, "Missing filename");
             return 1;
         }
+        if (GlobalOptions.compress && (GlobalOptions.stream || GlobalOptions.resume || GlobalOptions.streams > 0))
+            Log(LOG_WARNING, "Ignoring -z, which does not go with -s, -R or -n");
+        if (GlobalOptions.resume && (GlobalOptions.multi || GlobalOptions.streams > 0))
+            Log(LOG_WARNING, "Ignoring -R, which does not go with -m or -n");
 
         char *progname = basename(argv[0]);
-        if (strcmp(progname, "btsend") == 0)
-            return btsend(argc - optind, argv + optind);
-        if (strcmp(progname, "btrecv") == 0)
-            return btrecv(argc - optind, argv + optind);
-        Logf(LOG_ERROR, "Unknown command `%s`", progname);
+        int (*action)(int, char **) = strcmp(progname, "btsend") == 0 ? btsend :
+                                      strcmp(progname, "btrecv") == 0 ? btrecv : NULL;
+        if (action == NULL) {
+            Logf(LOG_ERROR, "Unknown command `%s`", progname);
+            return 1;
+        }
+        // Formatting and writing happen on a thread of their own from here
+        if (StartLogThread() != 0)
+            Log(LOG_WARNING, "Failed to start the logging thread");
+        StartReporter();
+        int status = action(argc - optind, argv + optind);
+        StopReporter();
+        StopLogThread();
+        return status;
     } else if (GlobalOptions.action == ACTION_HELP) {
         printf("%s", HELP);
         return 0;
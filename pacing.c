@@ -0,0 +1,29 @@
+#include "pacing.h"
+
+#include <strings.h>
+
+static const char *const names[] = {"off", "user", "txtime"};
+
+#define MODES (sizeof names / sizeof *names)
+
+int BTPacingLookup(const char *name) {
+    for (int i = 0; i < MODES; i++)
+        if (strcasecmp(name, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *BTPacingName(int mode) {
+    if (mode < 0 || mode >= MODES)
+        return NULL;
+    return names[mode];
+}
+
+uint64_t BTPacerSpend(BTcpPacer *pacer, uint64_t now, size_t len) {
+    uint64_t at = pacer->next > now ? pacer->next : now;
+    if (pacer->rate > 0)
+        pacer->next = at + (uint64_t)(len * 1e9 / pacer->rate);
+    else
+        pacer->next = at;
+    return at;
+}
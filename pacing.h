@@ -0,0 +1,54 @@
+#ifndef __PACING_H
+#define __PACING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// How the sender spreads a window over the round trip
+#define PACING_OFF 0     // Send whatever the windows allow at once
+#define PACING_USER 1    // Hold packets back until they are due
+#define PACING_TXTIME 2  // Also stamp each one with its departure time for
+                         // the fq qdisc (SO_TXTIME), falls back to PACING_USER
+
+// Mode by name, -1 if unknown
+int BTPacingLookup(const char *name);
+
+const char *BTPacingName(int mode);
+
+// Share of the estimated bandwidth to pace at, above 1 so that the window
+// can still grow (as in Linux)
+#define PACING_GAIN_SS 2.0  // Slow start
+#define PACING_GAIN_CA 1.2  // Congestion avoidance
+
+// How far ahead of their time packets may go in one burst, in nanoseconds.
+// Bursts this short fit any queue and keep the syscalls batched.
+#define PACING_QUANTUM 1000000
+
+// Departure times of the packets of one connection, each one rate-spaced
+// from the one before, on CLOCK_MONOTONIC in nanoseconds. Idle time earns
+// no credit: a packet never departs before it is sent.
+typedef struct _BTcpPacer {
+    double rate;    // Bytes per second, 0 for no pacing
+    uint64_t next;  // Departure time of the next packet
+} BTcpPacer;
+
+static inline void BTPacerInit(BTcpPacer *pacer) {
+    pacer->rate = 0;
+    pacer->next = 0;
+}
+
+// Whether a packet may leave at $now, that is, it is due within a quantum
+static inline int BTPacerReady(const BTcpPacer *pacer, uint64_t now) {
+    return pacer->rate == 0 || pacer->next <= now + PACING_QUANTUM;
+}
+
+// Departure time of a packet of $len bytes sent at $now, the next one
+// is pushed back by its share of the rate
+uint64_t BTPacerSpend(BTcpPacer *pacer, uint64_t now, size_t len);
+
+// When the packets already sent are through, and a new burst may start
+static inline uint64_t BTPacerResume(const BTcpPacer *pacer, uint64_t now) {
+    return pacer->next > now ? pacer->next : now;
+}
+
+#endif // __PACING_H
@@ -0,0 +1,98 @@
+#ifndef __PROTOCOL_H
+#define __PROTOCOL_H
+
+// Wire format and timers shared by the connection API and the server,
+// not meant for applications
+
+#include "btcp.h"
+#include "window.h"
+
+// Largest window each header version can describe
+#define MAX_WINDOW_V1 255
+#define MAX_WINDOW_V2 65535
+
+// Largest UDP payload over IPv4
+#define MAX_DATAGRAM 65507
+
+// Payload per packet that v1 peers are built for
+#define PAYLOAD_V1 64
+
+// Bounds for the adaptive timers, in microseconds
+#define MIN_RTO 1000
+#define MAX_RTO 1000000
+#define INITIAL_RTO 1000000  // Before the first sample (RFC 6298, section 2.1)
+#define MIN_ACK_DELAY 200
+
+// Largest ACK, with all its SACK blocks
+#define ACK_SIZE (sizeof(BTcpHeaderV2) + MAX_SACK_BLOCKS * sizeof(BTcpSackBlock))
+
+uint64_t NowUs(void);
+
+// Timestamp for the wire, never 0 as that means "no timestamp"
+static inline uint32_t Timestamp(void) {
+    uint32_t ts = NowUs();
+    return ts ? ts : 1;
+}
+
+// Feed a round-trip sample into the estimator (RFC 6298, section 2)
+void RttSample(BTcpConnection* conn, uint32_t sample);
+
+// Retransmission timeout. Until the first sample comes in, which is
+// normally the handshake, it is a conservative INITIAL_RTO: a fixed guess
+// below the round trip would resend the first flight for nothing and have
+// the congestion control take it for loss. v1 receivers hold their ACKs for
+// a fixed time they cannot tell us about, so for them config.timeout is
+// the timeout, and stays as a floor.
+static inline uint64_t Rto(const BTcpConnection* conn) {
+    uint64_t fixed = conn->config.timeout * 1000ULL;
+    if (conn->state.version == 1 && (conn->state.rtt.srtt == 0 || conn->state.rtt.rto < fixed))
+        return fixed;
+    if (conn->state.rtt.srtt == 0)
+        return INITIAL_RTO;
+    return conn->state.rtt.rto;
+}
+
+// How long the receiver waits for more packets before it ACKs
+uint64_t AckDelay(const BTcpConnection* conn);
+
+// Histogram bucket of $value, its bit length up to the last of $buckets
+static inline size_t StatsBucket(uint64_t value, size_t buckets) {
+    size_t bits = value != 0 ? 64 - __builtin_clzll(value) : 0;
+    return bits < buckets ? bits : buckets - 1;
+}
+
+static inline size_t HeaderSize(int version) {
+    return version >= 2 ? sizeof(BTcpHeaderV2) : sizeof(BTcpHeader);
+}
+
+static inline size_t MaxWindow(int version) {
+    return version >= 2 ? MAX_WINDOW_V2 : MAX_WINDOW_V1;
+}
+
+// Payload carried by a full packet of $version
+size_t PayloadSize(int version, size_t max_packet_size);
+
+// Write $info as a header of $version, HeaderSize(version) bytes
+void EncodeHeader(int version, const BTcpHeaderInfo *info, void *buf);
+
+// Stamp a v2 header that EncodeHeader wrote with a CRC32C over itself and
+// $len bytes of payload, which may be NULL for none
+void SealPacket(void *hdr, const void *payload, size_t len);
+
+// 0 unless a header of $version came sealed and the CRC32C over it and
+// its $len bytes of payload does not match
+int CheckPacket(int version, const void *hdr, const void *payload, size_t len);
+
+// Read a header of $version out of $len bytes. Narrow sequence numbers are
+// widened to the first matching value at or after $ref.
+int DecodeHeader(int version, const void *buf, size_t len, uint32_t ref, BTcpHeaderInfo *info);
+
+// Answer a negotiation probe: a v1 ACK, followed by our v2 parameters if
+// we settled on v2
+void SendNegotiationReply(BTcpConnection* conn, uint32_t ack, size_t win_size);
+
+// ACK everything in front of $win_start, with $sack also every run of
+// packets that arrived past the first hole
+void SendAck(BTcpConnection* conn, const BTcpWindow *win, uint32_t win_start, int sack);
+
+#endif // __PROTOCOL_H
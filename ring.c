@@ -0,0 +1,74 @@
+#define _GNU_SOURCE
+#include "ring.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+int BTRingInit(BTcpRing *ring, size_t count, size_t size) {
+    // Round up to a power of 2 so positions can wrap around freely
+    size_t n = 1;
+    while (n < count)
+        n *= 2;
+    ring->count = n;
+    ring->size = size;
+    ring->buffers = malloc(n * size);
+    ring->lens = calloc(n, sizeof *ring->lens);
+    ring->head = ring->tail = 0;
+    ring->consumer_waiting = ring->producer_waiting = 0;
+    if (ring->buffers == NULL || ring->lens == NULL) {
+        BTRingFree(ring);
+        return -1;
+    }
+    return 0;
+}
+
+void BTRingFree(BTcpRing *ring) {
+    free(ring->buffers);
+    free(ring->lens);
+    ring->buffers = NULL;
+    ring->lens = NULL;
+}
+
+// Sleep until *$pos moves away from $seen. $waiting tells the other side
+// to wake us, and is raised before the last look so no wakeup gets lost.
+static void Wait(uint32_t *pos, uint32_t *waiting, uint32_t seen) {
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(pos, __ATOMIC_SEQ_CST) == seen)
+        syscall(SYS_futex, pos, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+static void Wake(uint32_t *pos, uint32_t *waiting) {
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, pos, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+uint8_t *BTRingAcquire(BTcpRing *ring) {
+    const uint32_t tail = ring->tail;
+    uint32_t head;
+    while (tail - (head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) >= ring->count)
+        Wait(&ring->head, &ring->producer_waiting, head);
+    return ring->buffers + (tail & (ring->count - 1)) * ring->size;
+}
+
+void BTRingCommit(BTcpRing *ring, size_t len) {
+    ring->lens[ring->tail & (ring->count - 1)] = len;
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+    Wake(&ring->tail, &ring->consumer_waiting);
+}
+
+uint8_t *BTRingPeek(BTcpRing *ring, size_t *len) {
+    const uint32_t head = ring->head;
+    uint32_t tail;
+    while ((tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) == head)
+        Wait(&ring->tail, &ring->consumer_waiting, tail);
+    *len = ring->lens[head & (ring->count - 1)];
+    return ring->buffers + (head & (ring->count - 1)) * ring->size;
+}
+
+void BTRingRelease(BTcpRing *ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+    Wake(&ring->head, &ring->producer_waiting);
+}
@@ -0,0 +1,40 @@
+#ifndef __RING_H
+#define __RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Buffers passed from exactly one producer thread to exactly one consumer
+// thread, without locks. Either side only sleeps when the ring is empty
+// (consumer) or full (producer).
+typedef struct _BTcpRing {
+    size_t count;      // # of buffers, a power of 2
+    size_t size;       // Bytes per buffer
+    uint8_t *buffers;
+    size_t *lens;      // Bytes filled in each buffer
+
+    // Both only ever count up, each written by one side only. Kept apart
+    // so the two threads do not fight over one cache line.
+    uint32_t head __attribute__((aligned(64)));  // Next buffer to consume
+    uint32_t consumer_waiting;
+    uint32_t tail __attribute__((aligned(64)));  // Next buffer to fill
+    uint32_t producer_waiting;
+} BTcpRing;
+
+int BTRingInit(BTcpRing *ring, size_t count, size_t size);
+void BTRingFree(BTcpRing *ring);
+
+// Producer: the next free buffer, waits while all of them are taken
+uint8_t *BTRingAcquire(BTcpRing *ring);
+
+// Producer: pass on the buffer from BTRingAcquire with $len bytes in it.
+// A length of 0 ends the stream.
+void BTRingCommit(BTcpRing *ring, size_t len);
+
+// Consumer: the oldest filled buffer, waits while there is none
+uint8_t *BTRingPeek(BTcpRing *ring, size_t *len);
+
+// Consumer: give the buffer from BTRingPeek back to the producer
+void BTRingRelease(BTcpRing *ring);
+
+#endif // __RING_H
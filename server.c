@@ -0,0 +1,583 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "protocol.h"
+#include "crc32c.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+// Max # of datagrams read per syscall
+#define SERVER_BATCH 64
+
+// Flow table size to start with, doubled whenever it gets half full
+#define INITIAL_FLOWS 64
+
+// Many senders share one socket, so give the kernel room to queue for them
+#define SOCKET_BUFFER (8 << 20)
+
+// A flow that stays silent this long is dropped, in microseconds
+#define FLOW_IDLE 30000000
+
+// How often pool threads look at $stop when there is no traffic
+#define POOL_TICK 100000
+
+static inline uint64_t FlowKey(const struct sockaddr_in *addr, uint8_t sport, uint8_t dport) {
+    return (uint64_t)addr->sin_addr.s_addr << 32 | (uint32_t)addr->sin_port << 16 |
+           (uint32_t)sport << 8 | dport;
+}
+
+static inline size_t FlowHome(const BTcpServer *server, uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ULL >> 32) & (server->size - 1);
+}
+
+static const char *FlowName(const BTcpFlow *flow, char *buf, size_t size) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &flow->conn.addr.sin_addr, ip, sizeof ip);
+    // Our ports are the sender's the other way round
+    snprintf(buf, size, "%s:%u/%u", ip, ntohs(flow->conn.addr.sin_port), flow->conn.config.dport);
+    return buf;
+}
+
+static BTcpFlow *FlowFind(const BTcpServer *server, uint64_t key) {
+    const size_t mask = server->size - 1;
+    for (size_t i = FlowHome(server, key); server->flows[i] != NULL; i = (i + 1) & mask)
+        if (server->flows[i]->key == key)
+            return server->flows[i];
+    return NULL;
+}
+
+static void FlowPlace(BTcpServer *server, BTcpFlow *flow) {
+    const size_t mask = server->size - 1;
+    size_t i = FlowHome(server, flow->key);
+    while (server->flows[i] != NULL)
+        i = (i + 1) & mask;
+    server->flows[i] = flow;
+}
+
+static int FlowInsert(BTcpServer *server, BTcpFlow *flow) {
+    if (2 * (server->count + 1) > server->size) {
+        BTcpFlow **old = server->flows;
+        size_t old_size = server->size;
+        server->flows = calloc(2 * old_size, sizeof *server->flows);
+        if (server->flows == NULL) {
+            server->flows = old;
+            return -1;
+        }
+        server->size = 2 * old_size;
+        for (size_t i = 0; i < old_size; i++)
+            if (old[i] != NULL)
+                FlowPlace(server, old[i]);
+        free(old);
+    }
+    FlowPlace(server, flow);
+    server->count++;
+    return 0;
+}
+
+static void FlowRemove(BTcpServer *server, BTcpFlow *flow) {
+    const size_t mask = server->size - 1;
+    size_t i = FlowHome(server, flow->key);
+    while (server->flows[i] != flow)
+        i = (i + 1) & mask;
+    // Pull later entries of the same probe sequence into the gap, so that
+    // lookups never stop short of them
+    for (size_t j = (i + 1) & mask; server->flows[j] != NULL; j = (j + 1) & mask) {
+        size_t home = FlowHome(server, server->flows[j]->key);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            server->flows[i] = server->flows[j];
+            i = j;
+        }
+    }
+    server->flows[i] = NULL;
+    server->count--;
+}
+
+static void FlowClose(BTcpServer *server, BTcpFlow *flow, int complete) {
+    char name[64];
+    Logf(complete ? LOG_INFO : LOG_WARNING, "Flow %s %s after %llu bytes",
+         FlowName(flow, name, sizeof name), complete ? "closed" : "dropped",
+         (unsigned long long)flow->offset);
+    server->ops->close(flow->ctx, flow->offset, complete);
+    FlowRemove(server, flow);
+    if (flow->queued)
+        for (size_t i = 0; i < server->touching; i++)
+            if (server->touched[i] == flow)
+                server->touched[i] = NULL;
+    BTWindowFree(&flow->win);
+    free(flow);
+    server->finished++;
+}
+
+// Hand the next $len bytes of $flow to the application
+static int Deliver(BTcpServer *server, BTcpFlow *flow, const void *data, size_t len) {
+    if (len > 0 && server->ops->data(flow->ctx, data, len, flow->offset) != 0)
+        return -1;
+    flow->offset += len;
+    flow->conn.stats.bytes_delivered += len;
+    if (flow->conn.config.digest)
+        flow->conn.state.digest = BTCrc32c(flow->conn.state.digest, data, len);
+    return 0;
+}
+
+static void FlowAck(BTcpServer *server, BTcpFlow *flow) {
+    const BTcpConnection *conn = &flow->conn;
+    SendAck(&flow->conn, &flow->win, flow->win_start,
+            conn->state.version >= 2 && conn->config.sack);
+    flow->unacked = 0;
+    flow->ack_at = 0;
+    flow->ack_now = 0;
+    flow->queued = 0;
+}
+
+// Start a flow for a sender we have not seen before. Only its very first
+// packet may do that: a negotiation probe, or data from a v1 sender.
+static BTcpFlow *FlowOpen(BTcpServer *server, const struct sockaddr_in *from,
+                          const uint8_t *pkt, size_t n, uint64_t now) {
+    BTcpHeaderInfo hdr;
+    if (DecodeHeader(1, pkt, n, 0, &hdr) != 0 || hdr.seq != 0 ||
+        hdr.data_off != sizeof(BTcpHeader) || n != hdr.data_off + hdr.data_len) {
+        Log(LOG_DEBUG, "Ignored packet from unknown sender");
+        return NULL;
+    }
+
+    // Aligned for the counters in its connection
+    BTcpFlow *flow = aligned_alloc(CACHE_LINE, sizeof *flow);
+    if (flow == NULL) {
+        Log(LOG_ERROR, "Failed to allocate memory");
+        return NULL;
+    }
+    memset(flow, 0, sizeof *flow);
+    BTcpConnection *conn = &flow->conn;
+    conn->socket = server->socket;
+    conn->addr = *from;
+    conn->config = server->config;
+    conn->config.sport = hdr.dport;
+    conn->config.dport = hdr.sport;
+    conn->state.flags = F_OPEN;
+    conn->state.version = (hdr.flags & F_V2) && server->config.header_version >= 2 ? 2 : 1;
+    conn->state.payload_size = PayloadSize(conn->state.version, server->config.max_packet_size);
+    conn->state.ts_recent = hdr.ts_val;
+    flow->key = FlowKey(from, hdr.sport, hdr.dport);
+    flow->win_start = hdr.seq + 1;
+    flow->last_seen = now;
+
+    const size_t bufsize = server->config.recv_buffer_size < MaxWindow(conn->state.version) ?
+                           server->config.recv_buffer_size : MaxWindow(conn->state.version);
+    if (BTWindowInit(&flow->win, bufsize, conn->state.payload_size) != 0 ||
+        FlowInsert(server, flow) != 0) {
+        Log(LOG_ERROR, "Failed to allocate memory");
+        BTWindowFree(&flow->win);
+        free(flow);
+        return NULL;
+    }
+    flow->ctx = server->ops->open(server->arg, from, hdr.sport, hdr.dport);
+    char name[64];
+    if (flow->ctx == NULL) {
+        Logf(LOG_WARNING, "Flow %s refused", FlowName(flow, name, sizeof name));
+        FlowRemove(server, flow);
+        BTWindowFree(&flow->win);
+        free(flow);
+        return NULL;
+    }
+    Logf(LOG_INFO, "Flow %s opened, header v%d, %zu bytes per packet",
+         FlowName(flow, name, sizeof name), conn->state.version, conn->state.payload_size);
+
+    conn->stats.packets_received++;
+    conn->stats.bytes_received += n;
+    if (Deliver(server, flow, pkt + hdr.data_off, hdr.data_len) != 0) {
+        FlowClose(server, flow, 0);
+        return NULL;
+    }
+    SendNegotiationReply(conn, flow->win_start, bufsize);
+    return flow;
+}
+
+// Take in one datagram of $flow, -1 if the flow has to go
+static int FlowInput(BTcpServer *server, BTcpFlow *flow, const uint8_t *pkt, size_t n, uint64_t now) {
+    BTcpConnection *conn = &flow->conn;
+    BTcpWindow *win = &flow->win;
+    const int version = conn->state.version, eager = version >= 2;
+    const size_t hdr_size = HeaderSize(version),
+                 bufsize = win->size,
+                 payload_size = conn->state.payload_size,
+                 ack_every = eager && conn->config.ack_every > 0 ? conn->config.ack_every : SIZE_MAX;
+    // Something after a pause means the sender is waiting for us. v1
+    // senders expect a single ACK per window, so they only ever get an
+    // ACK once they go quiet.
+    const int waiting = now - flow->last_seen > AckDelay(conn);
+    flow->last_seen = now;
+    conn->stats.packets_received++;
+    conn->stats.bytes_received += n;
+    if (++flow->unacked >= ack_every)
+        flow->ack_now = 1;
+
+    BTcpHeaderInfo hdr;
+    if (n == sizeof(BTcpHeader) &&
+        DecodeHeader(1, pkt, n, flow->win_start - 1, &hdr) == 0 &&
+        hdr.data_len == 0 && hdr.seq + 1 == flow->win_start) {
+        // A probe whose reply got lost, say it again
+        SendNegotiationReply(conn, flow->win_start, bufsize);
+        flow->unacked--;
+        return 0;
+    }
+    if (DecodeHeader(version, pkt, n, flow->win_start, &hdr) != 0) {
+        Log(LOG_WARNING, "Discarded packet with invalid header");
+        return 0;
+    } else if (CheckPacket(version, pkt, pkt + hdr_size, n - hdr_size) != 0) {
+        Log(LOG_WARNING, "Discarded packet with a bad checksum");
+        conn->stats.corrupted++;
+        return 0;
+    }
+    if (hdr.flags & F_PARITY)
+        return 0;  // Never asked for, flows take no parity
+    uint32_t win_ind = hdr.seq - flow->win_start;
+    if (win_ind >= bufsize || BTWindowTest(win, win_ind)) {
+        // Retransmitted or past the window, our ACK may be lost
+        Logf(LOG_DEBUG, "Unexpected packet seq=%u", hdr.seq);
+        if ((int32_t)win_ind < 0 || win_ind < bufsize)
+            conn->stats.duplicates++;
+        else
+            conn->stats.out_of_window++;
+        flow->ack_now |= eager;
+        return 0;
+    } else if (n != hdr.data_off + hdr.data_len || hdr.data_off != hdr_size ||
+               hdr.data_len > payload_size) {
+        Logf(LOG_WARNING, "Wrong packet length: Expected %d, got %zu", hdr.data_off + hdr.data_len, n);
+        return 0;
+    }
+
+    if (conn->state.ts_recent == 0)  // The oldest one the next ACK covers
+        conn->state.ts_recent = hdr.ts_val;
+    if (hdr.ts_ecr != 0 && hdr.ts_ecr != flow->last_ecr) {
+        flow->last_ecr = hdr.ts_ecr;
+        RttSample(conn, Timestamp() - hdr.ts_ecr);
+    }
+    if (eager && (waiting || hdr.data_len < payload_size ||  // End of a message
+                  (win_ind > 0 && !BTWindowTest(win, win_ind - 1)) ||
+                  (win_ind + 1 < bufsize && BTWindowTest(win, win_ind + 1))))
+        flow->ack_now = 1;  // Also when it opens or fills a hole
+
+    const uint8_t *payload = pkt + hdr_size;
+    if (win_ind > 0) {
+        memcpy(BTWindowSlot(win, win_ind), payload, hdr.data_len);
+        conn->stats.bytes_copied += hdr.data_len;
+        BTWindowSet(win, win_ind, hdr.data_len);
+        return 0;
+    }
+
+    // In order: straight to the application, followed by whatever was
+    // waiting for it in the window
+    if (Deliver(server, flow, payload, hdr.data_len) != 0)
+        return -1;
+    BTWindowSet(win, 0, hdr.data_len);
+    size_t run = BTWindowLeadingRun(win);
+    for (size_t i = 1; i < run; i++)
+        if (Deliver(server, flow, BTWindowSlot(win, i), BTWindowLen(win, i)) != 0)
+            return -1;
+    BTWindowAdvance(win, run);
+    flow->win_start += run;
+    return 0;
+}
+
+// A zero-length datagram closes every flow from its address, it has no
+// header to tell them apart
+static void CloseAddress(BTcpServer *server, const struct sockaddr_in *from) {
+    for (size_t i = 0; i < server->size;) {
+        BTcpFlow *flow = server->flows[i];
+        if (flow != NULL && flow->conn.addr.sin_addr.s_addr == from->sin_addr.s_addr &&
+            flow->conn.addr.sin_port == from->sin_port)
+            FlowClose(server, flow, 1);  // Refills slot $i
+        else
+            i++;
+    }
+}
+
+static void HandleBatch(BTcpServer *server, int count) {
+    uint64_t now = NowUs();
+    server->touching = 0;
+    for (int k = 0; k < count; k++) {
+        const uint8_t *pkt = server->bufs + k * server->buf_size;
+        const size_t n = server->msgs[k].msg_len;
+        const struct sockaddr_in *from = &server->addrs[k];
+        if (n == 0) {
+            CloseAddress(server, from);
+            continue;
+        } else if (n < 2) {
+            continue;
+        }
+
+        // Both header versions start with the ports
+        BTcpFlow *flow = FlowFind(server, FlowKey(from, pkt[0], pkt[1]));
+        if (flow == NULL) {
+            FlowOpen(server, from, pkt, n, now);
+            continue;
+        }
+        if (FlowInput(server, flow, pkt, n, now) != 0) {
+            FlowClose(server, flow, 0);
+            continue;
+        }
+        if (flow->ack_now) {
+            // One ACK per flow for the whole batch
+            if (!flow->queued)
+                server->touched[server->touching++] = flow;
+            flow->queued = 1;
+        } else if (flow->unacked > 0) {
+            flow->ack_at = now + AckDelay(&flow->conn);
+        }
+    }
+    for (size_t i = 0; i < server->touching; i++)
+        if (server->touched[i] != NULL)
+            FlowAck(server, server->touched[i]);
+    server->touching = 0;
+}
+
+// Send the ACKs that are due and drop silent flows, returns when the next
+// timer expires
+static uint64_t RunTimers(BTcpServer *server, uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    for (size_t i = 0; i < server->size;) {
+        BTcpFlow *flow = server->flows[i];
+        if (flow == NULL) {
+            i++;
+            continue;
+        }
+        if (now - flow->last_seen >= FLOW_IDLE) {
+            FlowClose(server, flow, 0);  // Refills slot $i
+            continue;
+        }
+        if (flow->ack_at != 0 && flow->ack_at <= now)
+            FlowAck(server, flow);
+        if (flow->ack_at != 0 && flow->ack_at < next)
+            next = flow->ack_at;
+        if (flow->last_seen + FLOW_IDLE < next)
+            next = flow->last_seen + FLOW_IDLE;
+        i++;
+    }
+    return next;
+}
+
+int BTServerPoll(BTcpServer *server, uint64_t timeout) {
+    uint64_t now = NowUs(), next = RunTimers(server, now);
+    if (next - now < timeout)
+        timeout = next > now ? next - now : 0;
+
+    struct epoll_event event;
+    struct timespec ts = {timeout / 1000000, timeout % 1000000 * 1000};
+    int ready = epoll_pwait2(server->epoll, &event, 1, &ts, NULL);
+    server->stats.syscalls++;
+    if (ready < 0 && errno != EINTR) {
+        Logf(LOG_ERROR, "Unknown error: %s", strerror(errno));
+        return -1;
+    }
+
+    // Drain the socket, a short batch means it is empty
+    int total = 0, count = 0;
+    while (ready > 0) {
+        for (size_t k = 0; k < server->batch; k++)
+            server->msgs[k].msg_hdr.msg_namelen = sizeof *server->addrs;
+        count = recvmmsg(server->socket, server->msgs, server->batch, MSG_DONTWAIT, NULL);
+        server->stats.syscalls++;
+        if (count <= 0)
+            break;
+        server->stats.packets_received += count;
+        for (int k = 0; k < count; k++)
+            server->stats.bytes_received += server->msgs[k].msg_len;
+        HandleBatch(server, count);
+        total += count;
+        if (count < server->batch)
+            break;
+    }
+    if (count < 0 && errno != EAGAIN)
+        Logf(LOG_WARNING, "Failed to receive packets: %s", strerror(errno));
+    RunTimers(server, NowUs());
+    return total;
+}
+
+int BTServe(BTcpServer *server, uint64_t flows) {
+    while (flows == 0 || server->finished < flows)
+        if (BTServerPoll(server, UINT64_MAX) < 0)
+            return -1;
+    return 0;
+}
+
+// Set up a server, on a socket that may share its port with others
+static BTcpServer* Listen(unsigned long addr, unsigned short port, const BTcpConfig* config,
+                          const BTcpServerOps *ops, void *arg, int shared) {
+    BTcpServer *server = aligned_alloc(CACHE_LINE, sizeof *server);
+    if (server == NULL) {
+        Log(LOG_ERROR, "Failed to allocate memory");
+        return NULL;
+    }
+    memset(server, 0, sizeof *server);
+    if (config != NULL) {
+        server->config = *config;
+    } else {
+        BTcpConnection defaults;
+        BTDefaultConfig(&defaults);
+        server->config = defaults.config;
+    }
+    server->ops = ops;
+    server->arg = arg;
+    server->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    server->epoll = epoll_create1(0);
+
+    struct sockaddr_in local = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = addr,
+        .sin_port = htons(port)
+    };
+    int rcvbuf = SOCKET_BUFFER;
+    struct epoll_event event = {.events = EPOLLIN};
+    if (server->socket < 0 || server->epoll < 0 ||
+        setsockopt(server->socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf) != 0 ||
+        (shared && setsockopt(server->socket, SOL_SOCKET, SO_REUSEPORT, &shared, sizeof shared) != 0) ||
+        bind(server->socket, (struct sockaddr *)&local, sizeof local) != 0 ||
+        epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->socket, &event) != 0) {
+        Logf(LOG_ERROR, "Failed to listen on port %u: %s", port, strerror(errno));
+        goto fail;
+    }
+
+    server->batch = server->config.batch_io ? SERVER_BATCH : 1;
+    server->buf_size = server->config.max_packet_size < MAX_DATAGRAM ?
+                       server->config.max_packet_size : MAX_DATAGRAM;
+    server->bufs = malloc(server->batch * server->buf_size);
+    server->msgs = calloc(server->batch, sizeof *server->msgs);
+    server->iov = calloc(server->batch, sizeof *server->iov);
+    server->addrs = calloc(server->batch, sizeof *server->addrs);
+    server->touched = calloc(server->batch, sizeof *server->touched);
+    server->size = INITIAL_FLOWS;
+    server->flows = calloc(server->size, sizeof *server->flows);
+    if (server->bufs == NULL || server->msgs == NULL || server->iov == NULL ||
+        server->addrs == NULL || server->touched == NULL || server->flows == NULL) {
+        Log(LOG_ERROR, "Failed to allocate memory");
+        goto fail;
+    }
+    for (size_t k = 0; k < server->batch; k++) {
+        server->iov[k].iov_base = server->bufs + k * server->buf_size;
+        server->iov[k].iov_len = server->buf_size;
+        server->msgs[k].msg_hdr.msg_iov = &server->iov[k];
+        server->msgs[k].msg_hdr.msg_iovlen = 1;
+        server->msgs[k].msg_hdr.msg_name = &server->addrs[k];
+    }
+    return server;
+
+fail:
+    BTServerClose(server);
+    return NULL;
+}
+
+BTcpServer* BTListen(unsigned long addr, unsigned short port, const BTcpConfig* config,
+                     const BTcpServerOps *ops, void *arg) {
+    return Listen(addr, port, config, ops, arg, 0);
+}
+
+void BTServerClose(BTcpServer *server) {
+    if (server->flows != NULL)
+        for (size_t i = 0; i < server->size;) {
+            if (server->flows[i] != NULL)
+                FlowClose(server, server->flows[i], 0);
+            else
+                i++;
+        }
+    if (server->socket >= 0)
+        close(server->socket);
+    if (server->epoll >= 0)
+        close(server->epoll);
+    free(server->bufs);
+    free(server->msgs);
+    free(server->iov);
+    free(server->addrs);
+    free(server->touched);
+    free(server->flows);
+    free(server);
+}
+
+static void *PoolThread(void *arg) {
+    BTcpPoolWorker *worker = arg;
+    BTcpServerPool *pool = worker->pool;
+    BTcpServer *server = worker->server;
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0)
+            Logf(LOG_WARNING, "Cannot pin thread to CPU %d", worker->cpu);
+    }
+    while (!pool->stop) {
+        uint64_t finished = server->finished;
+        if (BTServerPoll(server, POOL_TICK) < 0)
+            break;
+        if (server->finished != finished) {
+            pthread_mutex_lock(&pool->lock);
+            pool->finished += server->finished - finished;
+            pthread_cond_broadcast(&pool->changed);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+BTcpServerPool* BTListenPool(unsigned long addr, unsigned short port, const BTcpConfig* config,
+                             const BTcpServerOps *ops, void *arg,
+                             size_t count, const int *cpus, size_t ncpus) {
+    BTcpServerPool *pool = calloc(1, sizeof *pool);
+    BTcpPoolWorker *workers = calloc(count, sizeof *workers);
+    if (pool == NULL || workers == NULL) {
+        Log(LOG_ERROR, "Failed to allocate memory");
+        free(pool);
+        free(workers);
+        return NULL;
+    }
+    pool->workers = workers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+
+    // All sockets have to be in the group before traffic comes in, the
+    // kernel spreads senders over whatever is there at the time
+    for (pool->count = 0; pool->count < count; pool->count++) {
+        BTcpPoolWorker *worker = &workers[pool->count];
+        worker->pool = pool;
+        worker->cpu = ncpus > 0 ? cpus[pool->count % ncpus] : -1;
+        worker->server = Listen(addr, port, config, ops, arg, 1);
+        if (worker->server == NULL) {
+            BTServerPoolClose(pool);
+            return NULL;
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+        if (pthread_create(&workers[i].thread, NULL, PoolThread, &workers[i]) != 0) {
+            Log(LOG_ERROR, "Failed to start server thread");
+            workers[i].thread = 0;  // Only join those that run
+            BTServerPoolClose(pool);
+            return NULL;
+        }
+    Logf(LOG_INFO, "Serving port %u with %zu threads", port, count);
+    return pool;
+}
+
+void BTServerPoolWait(BTcpServerPool *pool, uint64_t flows) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < flows)
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void BTServerPoolClose(BTcpServerPool *pool) {
+    pool->stop = 1;
+    for (size_t i = 0; i < pool->count; i++)
+        if (pool->workers[i].thread)
+            pthread_join(pool->workers[i].thread, NULL);
+    for (size_t i = 0; i < pool->count; i++)
+        BTServerClose(pool->workers[i].server);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->changed);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,117 @@
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "btcp.h"
+#include "window.h"
+
+// What the server does with each flow's data, $ctx is whatever open()
+// returned for the flow
+typedef struct _BTcpServerOps {
+    // A new sender showed up, NULL turns it away
+    void *(*open)(void *arg, const struct sockaddr_in *addr, uint8_t sport, uint8_t dport);
+
+    // The next $len bytes of the flow, starting at $offset. -1 drops the flow.
+    int (*data)(void *ctx, const void *data, size_t len, uint64_t offset);
+
+    // The sender closed the flow ($complete), or it was dropped after
+    // $total bytes
+    void (*close)(void *ctx, uint64_t total, int complete);
+} BTcpServerOps;
+
+// One sender, told apart by its address and the ports in its headers. The
+// connection holds the protocol state and shares the server's socket.
+typedef struct _BTcpFlow {
+    BTcpConnection conn;
+    uint64_t key;
+    void *ctx;
+    BTcpWindow win;
+    uint32_t win_start;   // Everything before this was delivered
+    uint64_t offset;      // Bytes delivered so far
+    uint32_t last_ecr;    // Latest echo of our timestamps
+    size_t unacked;       // Datagrams since the last ACK
+    uint64_t ack_at;      // When the pending ACK is due, 0 if there is none
+    uint64_t last_seen;   // Latest datagram from the sender
+    int ack_now;          // ACK once the current batch is done
+    int queued;           // Already in the server's list for that
+} BTcpFlow;
+
+typedef struct _BTcpServer {
+    int socket;
+    int epoll;
+    BTcpConfig config;
+    const BTcpServerOps *ops;
+    void *arg;
+
+    // Open addressing on the flow key, $size is a power of 2
+    BTcpFlow **flows;
+    size_t size, count;
+    uint64_t finished;  // Flows closed so far
+
+    // Datagrams read by one recvmmsg(2)
+    size_t batch, buf_size;
+    uint8_t *bufs;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    struct sockaddr_in *addrs;
+    BTcpFlow **touched;  // Flows that want an ACK after the batch
+    size_t touching;
+
+    BTcpStats stats;  // Socket-level, per-flow ones are in each connection
+} BTcpServer;
+
+// Serve every sender that turns up at $addr:$port. $config may be NULL
+// for defaults.
+BTcpServer* BTListen(unsigned long addr, unsigned short port, const BTcpConfig* config,
+                     const BTcpServerOps *ops, void *arg);
+
+// Wait up to $timeout microseconds for traffic and handle it along with
+// any timers that expire. Returns the # of datagrams read, -1 on error.
+int BTServerPoll(BTcpServer *server, uint64_t timeout);
+
+// Run until $flows flows have finished, or forever if it is 0
+int BTServe(BTcpServer *server, uint64_t flows);
+
+// Drop all flows and release the server
+void BTServerClose(BTcpServer *server);
+
+// Servers on one port, each with a socket of its own (SO_REUSEPORT) and a
+// thread. The kernel hashes every sender to one of the sockets, so a flow
+// always stays with the same thread and the threads share nothing.
+typedef struct _BTcpServerPool BTcpServerPool;
+
+typedef struct _BTcpPoolWorker {
+    BTcpServerPool *pool;
+    BTcpServer *server;
+    pthread_t thread;
+    int cpu;  // -1 if the thread may run anywhere
+} BTcpPoolWorker;
+
+struct _BTcpServerPool {
+    size_t count;
+    BTcpPoolWorker *workers;
+    volatile int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint64_t finished;  // Flows closed by all workers, under $lock
+};
+
+// Start $count servers at $addr:$port. Thread $i is pinned to
+// $cpus[i % ncpus] unless $ncpus is 0. The callbacks in $ops are called
+// from all threads, but never at once for the same flow.
+BTcpServerPool* BTListenPool(unsigned long addr, unsigned short port, const BTcpConfig* config,
+                             const BTcpServerOps *ops, void *arg,
+                             size_t count, const int *cpus, size_t ncpus);
+
+// Block until $flows flows have finished across the pool
+void BTServerPoolWait(BTcpServerPool *pool, uint64_t flows);
+
+// Stop all threads, drop their flows and release the pool
+void BTServerPoolClose(BTcpServerPool *pool);
+
+#endif // __SERVER_H
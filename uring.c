@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+int BTUringInit(BTcpUring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof *ring);
+    memset(&params, 0, sizeof params);
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+    ring->entries = params.sq_entries;
+
+    // Older kernels map the two rings separately
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        BTUringFree(ring);
+        return -1;
+    }
+    if (single) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            BTUringFree(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        BTUringFree(ring);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void BTUringFree(BTcpUring *ring) {
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    ring->sqes = NULL;
+    ring->sq_ring = ring->cq_ring = NULL;
+    ring->fd = -1;
+}
+
+static int Queue(BTcpUring *ring, uint8_t opcode, int fd, struct msghdr *msg,
+                 unsigned flags, uint64_t data, int link) {
+    // Only we move the tail, the kernel moves the head
+    unsigned tail = *ring->sq_tail,
+             head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries)
+        return -1;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = data;
+    if (link)
+        sqe->flags = IOSQE_IO_LINK;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return 0;
+}
+
+int BTUringSendmsg(BTcpUring *ring, int fd, struct msghdr *msg, unsigned flags, uint64_t data, int link) {
+    return Queue(ring, IORING_OP_SENDMSG, fd, msg, flags, data, link);
+}
+
+int BTUringRecvmsg(BTcpUring *ring, int fd, struct msghdr *msg, unsigned flags, uint64_t data, int link) {
+    return Queue(ring, IORING_OP_RECVMSG, fd, msg, flags, data, link);
+}
+
+int BTUringSubmit(BTcpUring *ring, unsigned wait) {
+    unsigned queued = ring->queued;
+    ring->queued = 0;
+    return syscall(SYS_io_uring_enter, ring->fd, queued, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+struct io_uring_cqe *BTUringPeek(BTcpUring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+struct io_uring_cqe *BTUringWait(BTcpUring *ring) {
+    struct io_uring_cqe *cqe;
+    // A signal can cut the wait in BTUringSubmit short
+    while ((cqe = BTUringPeek(ring)) == NULL)
+        syscall(SYS_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    return cqe;
+}
+
+void BTUringSeen(BTcpUring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,44 @@
+#ifndef __URING_H
+#define __URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+// Just enough of io_uring(7) to move a batch of datagrams per syscall,
+// talking to the kernel directly instead of through liburing
+typedef struct _BTcpUring {
+    int fd;
+    unsigned entries;  // Submission queue size
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;  // Written since the last submit
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} BTcpUring;
+
+// Set up rings for $entries submissions, -1 where the kernel says no
+int BTUringInit(BTcpUring *ring, unsigned entries);
+void BTUringFree(BTcpUring *ring);
+
+// Queue a sendmsg(2) / recvmsg(2) of $msg on $fd, tagged $data. A $link
+// lets the next queued one run only if this one succeeds. Returns -1 when
+// the submission queue is full.
+int BTUringSendmsg(BTcpUring *ring, int fd, struct msghdr *msg, unsigned flags, uint64_t data, int link);
+int BTUringRecvmsg(BTcpUring *ring, int fd, struct msghdr *msg, unsigned flags, uint64_t data, int link);
+
+// Hand everything queued to the kernel and wait for $wait completions
+int BTUringSubmit(BTcpUring *ring, unsigned wait);
+
+// The oldest completion not seen yet, NULL if there is none
+struct io_uring_cqe *BTUringPeek(BTcpUring *ring);
+// Same, but waits for one to come if need be
+struct io_uring_cqe *BTUringWait(BTcpUring *ring);
+void BTUringSeen(BTcpUring *ring);
+
+#endif // __URING_H
@@ -0,0 +1,105 @@
+#include "window.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+
+int BTWindowInit(BTcpWindow *win, size_t size, size_t slot_size) {
+    win->size = size;
+    win->head = 0;
+    win->slot_size = slot_size;
+    win->slots = malloc(size * slot_size);
+    win->lens = malloc(size * sizeof *win->lens);
+    win->bitmap = calloc(BITMAP_WORDS(size), sizeof *win->bitmap);
+    if (win->slots == NULL || win->lens == NULL || win->bitmap == NULL) {
+        BTWindowFree(win);
+        return -1;
+    }
+    return 0;
+}
+
+void BTWindowFree(BTcpWindow *win) {
+    free(win->slots);
+    free(win->lens);
+    free(win->bitmap);
+    win->slots = NULL;
+    win->lens = NULL;
+    win->bitmap = NULL;
+}
+
+size_t BTWindowBytes(size_t size, size_t slot_size) {
+    return BITMAP_WORDS(size) * sizeof(uint64_t) + size * sizeof(uint16_t) + size * slot_size;
+}
+
+void BTWindowInitAt(BTcpWindow *win, size_t size, size_t slot_size, void *mem) {
+    win->size = size;
+    win->head = 0;
+    win->slot_size = slot_size;
+    win->bitmap = mem;
+    win->lens = (uint16_t *)(win->bitmap + BITMAP_WORDS(size));
+    win->slots = (uint8_t *)(win->lens + size);
+    memset(win->bitmap, 0, BITMAP_WORDS(size) * sizeof *win->bitmap);
+}
+
+// # of set bits in a row starting at ring index $r, stopping at $limit
+static size_t RunFrom(const BTcpWindow *win, size_t r, size_t limit, int set) {
+    size_t n = 0;
+    while (n < limit) {
+        uint64_t word = win->bitmap[r / 64] >> (r % 64);
+        if (!set)
+            word = ~word;
+        size_t avail = 64 - r % 64;
+        if (avail > win->size - r)
+            avail = win->size - r;
+        // Count trailing ones of $word, capped at the bits left in it
+        size_t ones = ~word ? (size_t)__builtin_ctzll(~word) : 64;
+        if (ones > avail)
+            ones = avail;
+        n += ones;
+        if (ones < avail)
+            break;
+        r += ones;
+        if (r == win->size)
+            r = 0;
+    }
+    return n < limit ? n : limit;
+}
+
+size_t BTWindowLeadingRun(const BTcpWindow *win) {
+    return RunFrom(win, win->head, win->size, 1);
+}
+
+size_t BTWindowCount(const BTcpWindow *win) {
+    // Bits past the last slot are never set
+    size_t n = 0;
+    for (size_t i = 0; i < BITMAP_WORDS(win->size); i++)
+        n += __builtin_popcountll(win->bitmap[i]);
+    return n;
+}
+
+size_t BTWindowFirstSet(const BTcpWindow *win) {
+    return RunFrom(win, win->head, win->size, 0);
+}
+
+size_t BTWindowRun(const BTcpWindow *win, size_t i, int set) {
+    if (i >= win->size)
+        return 0;
+    return RunFrom(win, BTWindowRing(win, i), win->size - i, set);
+}
+
+void BTWindowAdvance(BTcpWindow *win, size_t n) {
+    if (n >= win->size) {
+        BTWindowClear(win);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        size_t r = BTWindowRing(win, i);
+        win->bitmap[r / 64] &= ~(1ULL << (r % 64));
+    }
+    win->head = BTWindowRing(win, n);
+}
+
+void BTWindowClear(BTcpWindow *win) {
+    memset(win->bitmap, 0, BITMAP_WORDS(win->size) * sizeof *win->bitmap);
+}
@@ -0,0 +1,70 @@
+#ifndef __WINDOW_H
+#define __WINDOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Receive window as a ring of fixed-size slots. Slot $i is always relative
+// to the start of the window, so advancing the window never moves data.
+typedef struct _BTcpWindow {
+    size_t size;       // # of slots
+    size_t head;       // Ring index of slot 0
+    size_t slot_size;  // Bytes per slot
+    uint8_t *slots;    // Slot storage, size * slot_size bytes
+    uint16_t *lens;    // Bytes used in each slot
+    uint64_t *bitmap;  // Occupancy, one bit per ring index
+} BTcpWindow;
+
+int BTWindowInit(BTcpWindow *win, size_t size, size_t slot_size);
+void BTWindowFree(BTcpWindow *win);
+
+// Bytes BTWindowInitAt needs for a window of the same shape
+size_t BTWindowBytes(size_t size, size_t slot_size);
+
+// Lay the window out in $mem, BTWindowBytes() long and 8-byte aligned,
+// which stays the caller's to release. Starts out empty.
+void BTWindowInitAt(BTcpWindow *win, size_t size, size_t slot_size, void *mem);
+
+// # of occupied slots in a row from the start of the window
+size_t BTWindowLeadingRun(const BTcpWindow *win);
+
+// # of occupied slots in all
+size_t BTWindowCount(const BTcpWindow *win);
+
+// First occupied slot, or $win->size if there is none
+size_t BTWindowFirstSet(const BTcpWindow *win);
+
+// # of slots in a row from slot $i that are occupied ($set) or free
+size_t BTWindowRun(const BTcpWindow *win, size_t i, int set);
+
+// Release the first $n slots and slide the window forward
+void BTWindowAdvance(BTcpWindow *win, size_t n);
+
+// Release all slots without moving the window
+void BTWindowClear(BTcpWindow *win);
+
+static inline size_t BTWindowRing(const BTcpWindow *win, size_t i) {
+    size_t r = win->head + i;
+    return r >= win->size ? r - win->size : r;
+}
+
+static inline int BTWindowTest(const BTcpWindow *win, size_t i) {
+    size_t r = BTWindowRing(win, i);
+    return (win->bitmap[r / 64] >> (r % 64)) & 1;
+}
+
+static inline void BTWindowSet(BTcpWindow *win, size_t i, uint16_t len) {
+    size_t r = BTWindowRing(win, i);
+    win->bitmap[r / 64] |= 1ULL << (r % 64);
+    win->lens[r] = len;
+}
+
+static inline uint16_t BTWindowLen(const BTcpWindow *win, size_t i) {
+    return win->lens[BTWindowRing(win, i)];
+}
+
+static inline uint8_t *BTWindowSlot(const BTcpWindow *win, size_t i) {
+    return win->slots + BTWindowRing(win, i) * win->slot_size;
+}
+
+#endif // __WINDOW_H